@@ -0,0 +1,96 @@
+//
+// Host implementation of the register access layer. The registers belong to the simulated TWI peripheral of the
+// virtual bus.
+//
+
+#ifndef ATMEGA_TWI_TWIHOSTHARDWARE_H
+#define ATMEGA_TWI_TWIHOSTHARDWARE_H
+
+#include <stdint.h>
+#include "VirtualBus.h"
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+/** TWCR bits, same positions as on the ATmega640/1280/2560 **/
+#define TWINT   7
+#define TWEA    6
+#define TWSTA   5
+#define TWSTO   4
+#define TWWC    3
+#define TWEN    2
+#define TWIE    0
+
+/** Interrupt vector of the simulated peripheral, called by the virtual bus **/
+#define ISR(vector) extern "C" void vector(void)
+#define TWI_vect TWI_host_vector
+ISR(TWI_vect);
+
+inline void sei() { VirtualBus::setInterruptsEnabled(true); }
+inline void cli() { VirtualBus::setInterruptsEnabled(false); }
+
+/** The host has no separate program memory, constant tables are addressed like any other memory **/
+typedef uintptr_t TWIFlashAddress;
+#define PROGMEM
+
+/** Line of a virtual wire, stands in for the port pin of a software TWI **/
+typedef struct TWIPin {
+    VirtualWire *wire;
+    VirtualWire::Line line;
+} TWIPin;
+
+namespace TWIHardware {
+
+    inline uint8_t readControl() { return VirtualBus::readControl(); }
+    inline void writeControl(uint8_t value) { VirtualBus::writeControl(value); }
+
+    inline uint8_t readStatus() { return VirtualBus::readStatus(); }
+    inline void writeStatus(uint8_t value) { VirtualBus::writeStatus(value); }
+
+    inline uint8_t readData() { return VirtualBus::readData(); }
+    inline void writeData(uint8_t value) { VirtualBus::writeData(value); }
+
+    inline void writeBitRate(uint8_t value) { VirtualBus::writeBitRate(value); }
+
+    inline void writeAddress(uint8_t value) { VirtualBus::writeAddress(value); }
+
+    inline uint8_t readFlash(TWIFlashAddress address) { return *reinterpret_cast<const uint8_t *>(address); }
+    inline uint8_t readTable(const uint8_t *entry) { return *entry; }
+    template <typename Function>
+    inline Function readFunction(const Function *entry) { return *entry; }
+
+    /** Timer1 running at F_CPU / 8, derived from the time of the virtual bus **/
+    inline uint16_t readTimer() { return VirtualBus::readTimer1(); }
+    inline void startTimer() {}
+    inline void armWakeup(uint16_t count) { VirtualBus::armCompare1(count); }
+    inline void disarmWakeup() { VirtualBus::disarmCompare1(); }
+
+    /** Bus lines while the TWI is disabled **/
+    inline void pullSCL() { VirtualBus::driveSCL(false); }
+    inline void releaseSCL() { VirtualBus::driveSCL(true); }
+    inline void pullSDA() { VirtualBus::driveSDA(false); }
+    inline void releaseSDA() { VirtualBus::driveSDA(true); }
+    inline bool readSDA() { return VirtualBus::readSDA(); }
+    inline bool readSCL() { return VirtualBus::readSCL(); }
+    inline void initPin(const TWIPin &pin) { pin.wire->drive(pin.line, true); }
+    inline void pullPin(const TWIPin &pin) { pin.wire->drive(pin.line, false); }
+    inline void releasePin(const TWIPin &pin) { pin.wire->drive(pin.line, true); }
+    inline bool readPin(const TWIPin &pin) { return pin.wire->read(pin.line); }
+
+    inline void recoveryDelay() { VirtualBus::delay(5000); }
+
+    /** Lets the virtual bus advance instead of waiting for real hardware **/
+    inline void idle() { VirtualBus::idle(); }
+    inline void sleep() { VirtualBus::sleep(); }
+
+    class InterruptGuard {
+    public:
+        InterruptGuard() : enabled(VirtualBus::interruptsEnabled()) { VirtualBus::setInterruptsEnabled(false); }
+        ~InterruptGuard() { VirtualBus::setInterruptsEnabled(enabled); }
+    private:
+        bool enabled;
+    };
+}
+
+#endif //ATMEGA_TWI_TWIHOSTHARDWARE_H
@@ -0,0 +1,355 @@
+//
+// Virtual I2C bus with a simulated ATmega TWI peripheral and scriptable slave models.
+//
+
+#ifndef ATMEGA_TWI_VIRTUALBUS_H
+#define ATMEGA_TWI_VIRTUALBUS_H
+
+#include <stdint.h>
+#include <vector>
+
+/****************************************************************/
+/* Slave device attached to the virtual bus                     */
+/****************************************************************/
+class SlaveModel {
+public:
+    explicit SlaveModel(uint8_t address);
+    virtual ~SlaveModel() = default;
+
+    uint8_t getAddress() const { return slaveAddress; }
+
+    /** Bus events, called by the virtual bus. Return true to acknowledge **/
+    bool address(bool read);
+    bool receive(uint8_t data);
+    uint8_t transmit();
+    void stop();
+
+    /** Script **/
+    void nackAddress(uint16_t count);   /*!< NACK the next count address phases */
+    void nackByte(uint16_t index);      /*!< NACK the data byte with this index of every write, 0xFFFF disables */
+    void stretch(uint32_t ns);          /*!< Stretch the clock by ns on every byte */
+    uint32_t getStretch() const { return stretchNs; }
+    void limitFrequency(uint32_t hz);   /*!< NACK the address while SCL runs faster than hz, 0 disables */
+    uint32_t getMaxFrequency() const { return maxFrequency; }
+
+protected:
+    virtual bool onAddress(bool read);
+    virtual bool onReceive(uint8_t data);
+    virtual uint8_t onTransmit();
+    virtual void onStop();
+
+    uint8_t slaveAddress;
+
+private:
+    uint16_t addressNacks;
+    uint16_t nackIndex;
+    uint16_t receivedBytes;
+    uint32_t stretchNs;
+    uint32_t maxFrequency;
+};
+
+/****************************************************************/
+/* Register file device: the first bytes of a write set the     */
+/* register pointer, further bytes are written to consecutive   */
+/* registers. Reads continue at the register pointer.           */
+/****************************************************************/
+class MemorySlave : public SlaveModel {
+public:
+    MemorySlave(uint8_t address, uint16_t size, uint8_t addressBytes = 1);
+
+    uint8_t *memory() { return mem.data(); }
+    uint16_t getPointer() const { return pointer; }
+    uint32_t getWrites() const { return writes; }
+
+protected:
+    bool onAddress(bool read) override;
+    bool onReceive(uint8_t data) override;
+    uint8_t onTransmit() override;
+
+    std::vector<uint8_t> mem;
+    uint8_t addressBytes;
+    uint8_t addressPhase;
+    uint16_t pointer;
+    uint32_t writes;
+};
+
+/****************************************************************/
+/* AT24Cxx style EEPROM: writes wrap around within a page and   */
+/* the address is not acknowledged during the write cycle that  */
+/* follows the STOP of a write.                                 */
+/****************************************************************/
+class EepromSlave : public MemorySlave {
+public:
+    EepromSlave(uint8_t address, uint16_t size, uint16_t pageSize, uint32_t writeCycleNs, uint8_t addressBytes = 2);
+
+    uint32_t getBusyNacks() const { return busyNacks; }
+
+protected:
+    bool onAddress(bool read) override;
+    bool onReceive(uint8_t data) override;
+    void onStop() override;
+
+    uint16_t pageSize;
+    uint32_t writeCycleNs;
+    uint64_t busyUntil;
+    bool dataWritten;
+    uint32_t busyNacks;
+};
+
+/****************************************************************/
+/* SMBus device with packet error checking, e.g. a battery      */
+/* gauge. BLOCK_COMMAND is a block register, PROCESS_COMMAND a  */
+/* process call returning the complement of the word written,   */
+/* every other command a word register. Writes end with a PEC,  */
+/* a wrong one is NACKed and the write is ignored. Reads are    */
+/* followed by a PEC.                                           */
+/****************************************************************/
+class SmbusSlave : public SlaveModel {
+public:
+    static const uint8_t BLOCK_COMMAND = 0x40;
+    static const uint8_t PROCESS_COMMAND = 0x50;
+
+    explicit SmbusSlave(uint8_t address);
+
+    std::vector<uint8_t> &block() { return blockData; }
+    uint16_t &word(uint8_t command) { return words[command]; }
+    void corruptPec(uint16_t count) { corruptions = count; } /*!< The next count PEC bytes sent are wrong */
+    uint32_t getPecErrors() const { return pecErrors; }
+
+protected:
+    bool onAddress(bool read) override;
+    bool onReceive(uint8_t data) override;
+    uint8_t onTransmit() override;
+
+private:
+    static uint8_t crc8(uint8_t crc, uint8_t data);
+
+    std::vector<uint8_t> blockData;
+    uint16_t words[256];
+    std::vector<uint8_t> received;
+    std::vector<uint8_t> response;
+    uint16_t sent;
+    uint8_t crc;
+    uint16_t corruptions;
+    uint32_t pecErrors;
+};
+
+/****************************************************************/
+/* Counters collected by the virtual bus                        */
+/****************************************************************/
+typedef struct VirtualBusCounters {
+    uint32_t starts;        /*!< START and repeated START conditions */
+    uint32_t stops;         /*!< STOP conditions */
+    uint32_t bytes;         /*!< Address and data bytes on the bus */
+    uint32_t interrupts;    /*!< TWI interrupts delivered to the driver */
+    uint32_t recoveryClocks; /*!< SCL pulses driven by the port */
+    uint32_t portStops;     /*!< STOP conditions driven by the port */
+    uint32_t bitRateWrites; /*!< Writes to TWBR */
+    uint32_t sleeps;        /*!< Idle sleeps of the driver */
+    uint64_t busyNs;        /*!< Time the bus was occupied */
+    uint64_t serviceNs;     /*!< Time SCL was held low waiting for the ISR */
+} VirtualBusCounters;
+
+/****************************************************************/
+/* Simulated TWI peripheral and the bus it is attached to       */
+/****************************************************************/
+class VirtualBus {
+public:
+    /** Detaches all slaves and resets the peripheral, the time and the counters **/
+    static void reset();
+
+    static void attach(SlaveModel &slave);
+    static void detach(SlaveModel &slave);
+
+    /** Registers **/
+    static uint8_t readControl();
+    static void writeControl(uint8_t value);
+    static uint8_t readStatus();
+    static void writeStatus(uint8_t value);
+    static uint8_t readData();
+    static void writeData(uint8_t value);
+    static void writeBitRate(uint8_t value);
+    static void writeAddress(uint8_t value);
+
+    static bool interruptsEnabled();
+    static void setInterruptsEnabled(bool enabled);
+
+    /** Executes the pending bus action and delivers the TWI interrupt. Returns false if there was nothing to do **/
+    static bool step();
+
+    /** Steps until the bus is idle **/
+    static void run();
+
+    /** Called from busy-wait loops, lets 1 us pass if the bus has nothing to do **/
+    static void idle();
+
+    /** Called by the idle sleep of the driver: enables interrupts and lets time pass until the TWI, the timer or
+     *  the Timer1 compare interrupt is delivered **/
+    static void sleep();
+
+    /** Script: the next count address phases of the driver lose arbitration against another master, which then
+     *  writes winnerBytes data bytes to another slave before releasing the bus **/
+    static void loseArbitration(uint8_t count, uint16_t winnerBytes = 0);
+
+    /** Script: after the next lost arbitration the master that won keeps the bus busy for ns, a START of the driver
+     *  waits for its STOP **/
+    static void keepBusAfterArbitration(uint32_t ns);
+
+    /** Script: another master transfers for ns, clocking SCL at 100 kHz. A START of the driver waits for its STOP **/
+    static void occupyBus(uint32_t ns);
+
+    /** Script: the next address phase loses arbitration against a master that addresses the driver and writes data **/
+    static void loseArbitrationTo(uint8_t data);
+
+    /** Script: the next bus action ends with a bus error **/
+    static void injectBusError();
+
+    /** Script: raises the TWI interrupt with a status code the peripheral does not produce in the current phase **/
+    static void raiseStatus(uint8_t status);
+
+    /** Script: the next bus action hangs with SDA held low by a slave until SCL has been clocked count times **/
+    static void holdSDA(uint8_t count);
+
+    /** Bus lines driven by the port while the TWI is disabled **/
+    static void driveSCL(bool high);
+    static void driveSDA(bool high);
+    static bool readSDA();
+    static bool readSCL();
+
+    /** Lets time pass without bus activity **/
+    static void elapse(uint32_t ns);
+
+    /** Busy-wait of the driver with interrupts enabled: lets time pass, the timer interrupt keeps running **/
+    static void delay(uint32_t ns);
+
+    /** Another master addressing the driver in slave mode. Return the number of acknowledged data bytes **/
+    static uint16_t masterWrite(uint8_t address, const uint8_t *data, uint16_t length);
+    static uint16_t masterRead(uint8_t address, uint8_t *data, uint16_t length);
+
+    /** Timer interrupt of the simulated micro-controller: handler is called every periodNs of bus time while
+     *  interrupts are enabled, from busy-wait loops. 0 stops it **/
+    static void setTimer(uint32_t periodNs, void (*handler)());
+
+    /** Script: Timer1 stops counting, as if the application never started it, or runs again **/
+    static void stopTimer1(bool stopped);
+
+    /** Compare interrupt of Timer1 at count, ends sleep() like the TWI interrupt **/
+    static void armCompare1(uint16_t count);
+    static void disarmCompare1();
+
+    /** Timing **/
+    static uint64_t now() { return nowNs; }
+    static uint16_t readTimer1(); /*!< Timer1 at F_CPU / 8, derived from the bus time while it runs */
+    static void setServiceLatency(uint32_t ns); /*!< Time from TWINT to the TWCR write of the ISR, SCL is held low */
+    static uint32_t sclPeriodNs();
+    static const VirtualBusCounters &counters() { return stats; }
+
+private:
+    enum class Phase : uint8_t {
+        Idle,           /*!< Bus is free */
+        Started,        /*!< START has been transmitted, SLA+R/W expected in TWDR */
+        Transmitting,   /*!< Master transmitter */
+        Receiving,      /*!< Master receiver */
+        Addressed       /*!< Driver has been addressed as slave by another master */
+    };
+
+    static SlaveModel *find(uint8_t address);
+    static void executeMaster();
+    static void raise(uint8_t status);
+    static void deliver();
+    static void busTime(uint64_t ns);
+    static bool slaveRaise(uint8_t status);
+    static void runTimer();
+
+    static std::vector<SlaveModel *> slaves;
+    static SlaveModel *target;
+    static Phase phase;
+    static bool pending;
+    static bool busError;
+    static bool interrupts;
+    static uint8_t arbitrationLosses;
+    static uint16_t arbitrationWinnerBytes;
+    static bool arbitrationAddressed;
+    static uint8_t arbitrationData;
+    static uint8_t sdaHeld;
+    static bool sclLine;
+    static bool sdaLine;
+    static uint8_t twcr;
+    static uint8_t twsr;
+    static uint8_t twdr;
+    static uint8_t twbr;
+    static uint8_t twar;
+    static uint64_t nowNs;
+    static uint64_t stalledNs;
+    static uint32_t arbitrationHoldNs;
+    static uint64_t busyUntilNs;
+    static bool timer1Stopped;
+    static uint16_t timer1Count;
+    static uint32_t serviceLatencyNs;
+    static void (*timerHandler)();
+    static uint32_t timerCalls;
+    static bool compare1Armed;
+    static uint16_t compare1From;
+    static uint16_t compare1Count;
+    static bool compare1Reached();
+    static uint32_t timerPeriodNs;
+    static uint64_t timerDueNs;
+    static VirtualBusCounters stats;
+};
+
+/****************************************************************/
+/* The two open drain lines of a software TWI, with slave       */
+/* models attached. The slaves decode the line changes bit by   */
+/* bit and drive SDA for their ACK and data bits. A slave that  */
+/* stretches the clock holds SCL low after every byte. Time     */
+/* passes through the timer of the virtual bus.                 */
+/****************************************************************/
+class VirtualWire {
+public:
+    enum class Line : uint8_t {
+        SCL,
+        SDA
+    };
+
+    VirtualWire();
+
+    void attach(SlaveModel &slave);
+
+    /** Master side of the lines **/
+    void drive(Line line, bool high);
+    bool read(Line line);
+
+    /** starts, stops and bytes are counted **/
+    const VirtualBusCounters &counters() const { return stats; }
+
+private:
+    enum class State : uint8_t {
+        Idle,           /*!< No transfer since the last STOP */
+        Address,        /*!< SLA+R/W is being clocked in */
+        Receive,        /*!< A slave receives data bytes */
+        Transmit,       /*!< A slave transmits data bytes */
+        Ignore          /*!< Transfer not for any slave, or the master NACKed */
+    };
+
+    void update();
+    void onStart();
+    void onStop();
+    void onRise();
+    void onFall();
+
+    std::vector<SlaveModel *> slaves;
+    SlaveModel *target;
+    State state;
+    bool masterScl;
+    bool masterSda;
+    bool slaveSda;
+    bool scl;               /*!< Levels as seen by the slaves */
+    bool sda;
+    uint8_t bit;            /*!< Bit of the current byte, 8 is the ACK, 0xFF between START and the first bit */
+    uint8_t shift;
+    bool masterAck;         /*!< The master acknowledged the last byte sent by the slave */
+    uint64_t heldUntilNs;   /*!< Stretching slave holds SCL low until then */
+    VirtualBusCounters stats;
+};
+
+#endif //ATMEGA_TWI_VIRTUALBUS_H
@@ -0,0 +1,1027 @@
+//
+// Virtual I2C bus with a simulated ATmega TWI peripheral and scriptable slave models.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "TWIHostHardware.h"
+
+/** Bus time without any progress after which a busy-wait loop is considered hung **/
+static const uint64_t STALL_LIMIT_NS = 1000000000ULL;
+
+/****************************************************************/
+/** SLAVE MODELS **/
+/****************************************************************/
+
+SlaveModel::SlaveModel(uint8_t address)
+    : slaveAddress(address),
+      addressNacks(0),
+      nackIndex(0xFFFF),
+      receivedBytes(0),
+      stretchNs(0),
+      maxFrequency(0)
+{
+}
+
+bool SlaveModel::address(bool read)
+{
+    receivedBytes = 0;
+    if (addressNacks > 0) {
+        addressNacks--;
+        return false;
+    }
+    return onAddress(read);
+}
+
+bool SlaveModel::receive(uint8_t data)
+{
+    if (receivedBytes++ == nackIndex) {
+        return false;
+    }
+    return onReceive(data);
+}
+
+uint8_t SlaveModel::transmit()
+{
+    return onTransmit();
+}
+
+void SlaveModel::stop()
+{
+    onStop();
+}
+
+void SlaveModel::nackAddress(uint16_t count)
+{
+    addressNacks = count;
+}
+
+void SlaveModel::nackByte(uint16_t index)
+{
+    nackIndex = index;
+}
+
+void SlaveModel::stretch(uint32_t ns)
+{
+    stretchNs = ns;
+}
+
+void SlaveModel::limitFrequency(uint32_t hz)
+{
+    maxFrequency = hz;
+}
+
+bool SlaveModel::onAddress(bool)
+{
+    return true;
+}
+
+bool SlaveModel::onReceive(uint8_t)
+{
+    return true;
+}
+
+uint8_t SlaveModel::onTransmit()
+{
+    return 0xFF;
+}
+
+void SlaveModel::onStop()
+{
+}
+
+MemorySlave::MemorySlave(uint8_t address, uint16_t size, uint8_t addressBytes)
+    : SlaveModel(address),
+      mem(size, 0),
+      addressBytes(addressBytes),
+      addressPhase(0),
+      pointer(0),
+      writes(0)
+{
+}
+
+bool MemorySlave::onAddress(bool read)
+{
+    if (!read) {
+        // The first bytes of every write transfer select the register
+        addressPhase = addressBytes;
+        writes++;
+    }
+    return true;
+}
+
+bool MemorySlave::onReceive(uint8_t data)
+{
+    if (addressPhase > 0) {
+        if (addressPhase == addressBytes) {
+            pointer = 0;
+        }
+        pointer = static_cast<uint16_t>((pointer << 8) | data);
+        if (--addressPhase == 0) {
+            pointer = static_cast<uint16_t>(pointer % mem.size());
+        }
+    }
+    else {
+        mem[pointer] = data;
+        pointer = static_cast<uint16_t>((pointer + 1) % mem.size());
+    }
+    return true;
+}
+
+uint8_t MemorySlave::onTransmit()
+{
+    uint8_t data = mem[pointer];
+    pointer = static_cast<uint16_t>((pointer + 1) % mem.size());
+    return data;
+}
+
+EepromSlave::EepromSlave(uint8_t address,
+                         uint16_t size,
+                         uint16_t pageSize,
+                         uint32_t writeCycleNs,
+                         uint8_t addressBytes)
+    : MemorySlave(address, size, addressBytes),
+      pageSize(pageSize),
+      writeCycleNs(writeCycleNs),
+      busyUntil(0),
+      dataWritten(false),
+      busyNacks(0)
+{
+}
+
+bool EepromSlave::onAddress(bool read)
+{
+    if (VirtualBus::now() < busyUntil) {
+        busyNacks++;
+        return false;
+    }
+    dataWritten = false;
+    return MemorySlave::onAddress(read);
+}
+
+bool EepromSlave::onReceive(uint8_t data)
+{
+    if (addressPhase > 0) {
+        return MemorySlave::onReceive(data);
+    }
+    // The address counter rolls over within the page
+    mem[pointer] = data;
+    uint16_t page = static_cast<uint16_t>(pointer - pointer % pageSize);
+    pointer = static_cast<uint16_t>(page + (pointer + 1) % pageSize);
+    dataWritten = true;
+    return true;
+}
+
+void EepromSlave::onStop()
+{
+    if (dataWritten) {
+        dataWritten = false;
+        busyUntil = VirtualBus::now() + writeCycleNs;
+    }
+}
+
+SmbusSlave::SmbusSlave(uint8_t address)
+    : SlaveModel(address),
+      words(),
+      sent(0),
+      crc(0),
+      corruptions(0),
+      pecErrors(0)
+{
+}
+
+uint8_t SmbusSlave::crc8(uint8_t value, uint8_t data)
+{
+    value ^= data;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+        value = static_cast<uint8_t>((value & 0x80) ? ((value << 1) ^ 0x07) : (value << 1));
+    }
+    return value;
+}
+
+bool SmbusSlave::onAddress(bool read)
+{
+    if (!read) {
+        crc = crc8(0, static_cast<uint8_t>(slaveAddress << 1));
+        received.clear();
+        return true;
+    }
+    // The read follows the command after a repeated START, the PEC covers both
+    crc = crc8(crc, static_cast<uint8_t>((slaveAddress << 1) | 0x01));
+    uint8_t command = received.empty() ? 0 : received[0];
+    response.clear();
+    if (command == BLOCK_COMMAND) {
+        response.push_back(static_cast<uint8_t>(blockData.size()));
+        response.insert(response.end(), blockData.begin(), blockData.end());
+    }
+    else {
+        response.push_back(static_cast<uint8_t>(words[command]));
+        response.push_back(static_cast<uint8_t>(words[command] >> 8));
+    }
+    sent = 0;
+    return true;
+}
+
+bool SmbusSlave::onReceive(uint8_t data)
+{
+    // Command, the byte count of a block, the data, then the PEC
+    size_t pecIndex = 3;
+    if ((received.size() >= 2) && (received[0] == BLOCK_COMMAND)) {
+        pecIndex = 2U + received[1];
+    }
+    if (received.size() == pecIndex) {
+        if (data != crc) {
+            pecErrors++;
+            return false;
+        }
+        if (received[0] == BLOCK_COMMAND) {
+            blockData.assign(received.begin() + 2, received.end());
+        }
+        else {
+            words[received[0]] = static_cast<uint16_t>(received[1] | (received[2] << 8));
+        }
+        return true;
+    }
+    crc = crc8(crc, data);
+    received.push_back(data);
+    if ((received.size() == 3) && (received[0] == PROCESS_COMMAND)) {
+        // A process call continues with the read of the result, without a PEC ahead of it
+        words[PROCESS_COMMAND] = static_cast<uint16_t>(~(received[1] | (received[2] << 8)));
+    }
+    return true;
+}
+
+uint8_t SmbusSlave::onTransmit()
+{
+    if (sent < response.size()) {
+        uint8_t data = response[sent++];
+        crc = crc8(crc, data);
+        return data;
+    }
+    if (sent++ == response.size()) {
+        if (corruptions > 0) {
+            corruptions--;
+            return static_cast<uint8_t>(crc ^ 0x5A);
+        }
+        return crc;
+    }
+    return 0xFF;
+}
+
+/****************************************************************/
+/** VIRTUAL BUS **/
+/****************************************************************/
+
+std::vector<SlaveModel *> VirtualBus::slaves;
+SlaveModel *VirtualBus::target = nullptr;
+VirtualBus::Phase VirtualBus::phase = VirtualBus::Phase::Idle;
+bool VirtualBus::pending = false;
+bool VirtualBus::busError = false;
+bool VirtualBus::interrupts = false;
+uint8_t VirtualBus::arbitrationLosses = 0;
+uint16_t VirtualBus::arbitrationWinnerBytes = 0;
+bool VirtualBus::arbitrationAddressed = false;
+uint8_t VirtualBus::arbitrationData = 0;
+uint8_t VirtualBus::sdaHeld = 0;
+bool VirtualBus::sclLine = true;
+bool VirtualBus::sdaLine = true;
+uint8_t VirtualBus::twcr = 0;
+uint8_t VirtualBus::twsr = 0xF8;
+uint8_t VirtualBus::twdr = 0xFF;
+uint8_t VirtualBus::twbr = 0;
+uint8_t VirtualBus::twar = 0;
+uint64_t VirtualBus::nowNs = 0;
+uint64_t VirtualBus::stalledNs = 0;
+uint32_t VirtualBus::arbitrationHoldNs = 0;
+uint64_t VirtualBus::busyUntilNs = 0;
+bool VirtualBus::timer1Stopped = false;
+uint16_t VirtualBus::timer1Count = 0;
+uint32_t VirtualBus::serviceLatencyNs = 0;
+void (*VirtualBus::timerHandler)() = nullptr;
+uint32_t VirtualBus::timerCalls = 0;
+bool VirtualBus::compare1Armed = false;
+uint16_t VirtualBus::compare1From = 0;
+uint16_t VirtualBus::compare1Count = 0;
+uint32_t VirtualBus::timerPeriodNs = 0;
+uint64_t VirtualBus::timerDueNs = 0;
+VirtualBusCounters VirtualBus::stats = {};
+
+void VirtualBus::reset()
+{
+    slaves.clear();
+    target = nullptr;
+    phase = Phase::Idle;
+    pending = false;
+    busError = false;
+    interrupts = false;
+    arbitrationLosses = 0;
+    arbitrationWinnerBytes = 0;
+    arbitrationAddressed = false;
+    arbitrationData = 0;
+    sdaHeld = 0;
+    sclLine = true;
+    sdaLine = true;
+    twcr = 0;
+    twsr = 0xF8;
+    twdr = 0xFF;
+    twbr = 0;
+    twar = 0;
+    nowNs = 0;
+    stalledNs = 0;
+    arbitrationHoldNs = 0;
+    busyUntilNs = 0;
+    timer1Stopped = false;
+    timer1Count = 0;
+    compare1Armed = false;
+    serviceLatencyNs = 0;
+    timerHandler = nullptr;
+    timerPeriodNs = 0;
+    stats = VirtualBusCounters();
+}
+
+void VirtualBus::attach(SlaveModel &slave)
+{
+    slaves.push_back(&slave);
+}
+
+void VirtualBus::detach(SlaveModel &slave)
+{
+    for (auto it = slaves.begin(); it != slaves.end(); ++it) {
+        if (*it == &slave) {
+            slaves.erase(it);
+            break;
+        }
+    }
+}
+
+uint8_t VirtualBus::readControl()
+{
+    return twcr;
+}
+
+void VirtualBus::writeControl(uint8_t value)
+{
+    if (!(value & (1 << TWEN))) {
+        // Disabling the TWI terminates any ongoing transmission
+        twcr = static_cast<uint8_t>(value & ~(1 << TWINT));
+        phase = Phase::Idle;
+        target = nullptr;
+        pending = false;
+        return;
+    }
+    bool clearFlag = (value & (1 << TWINT)) != 0;
+    twcr = static_cast<uint8_t>((value & ~(1 << TWINT)) | (clearFlag ? 0 : (twcr & (1 << TWINT))));
+    if (clearFlag) {
+        pending = true;
+    }
+}
+
+uint8_t VirtualBus::readStatus()
+{
+    return twsr;
+}
+
+void VirtualBus::writeStatus(uint8_t value)
+{
+    // Only the prescaler bits are writable
+    twsr = static_cast<uint8_t>((twsr & 0xF8) | (value & 0x03));
+}
+
+uint8_t VirtualBus::readData()
+{
+    return twdr;
+}
+
+void VirtualBus::writeData(uint8_t value)
+{
+    twdr = value;
+}
+
+void VirtualBus::writeBitRate(uint8_t value)
+{
+    twbr = value;
+    stats.bitRateWrites++;
+}
+
+void VirtualBus::writeAddress(uint8_t value)
+{
+    twar = value;
+}
+
+bool VirtualBus::interruptsEnabled()
+{
+    return interrupts;
+}
+
+void VirtualBus::setInterruptsEnabled(bool enabled)
+{
+    interrupts = enabled;
+}
+
+uint32_t VirtualBus::sclPeriodNs()
+{
+    uint32_t prescaler = 1UL << (2 * (twsr & 0x03));
+    uint64_t clocks = 16 + 2ULL * twbr * prescaler;
+    return static_cast<uint32_t>(clocks * 1000000000ULL / F_CPU);
+}
+
+SlaveModel *VirtualBus::find(uint8_t address)
+{
+    for (SlaveModel *slave : slaves) {
+        if (slave->getAddress() == address) {
+            return slave;
+        }
+    }
+    return nullptr;
+}
+
+void VirtualBus::busTime(uint64_t ns)
+{
+    nowNs += ns;
+    stats.busyNs += ns;
+}
+
+void VirtualBus::raise(uint8_t status)
+{
+    twsr = static_cast<uint8_t>((status & 0xF8) | (twsr & 0x03));
+    twcr |= (1 << TWINT);
+}
+
+void VirtualBus::deliver()
+{
+    // The AVR clears the global interrupt flag while the ISR is running
+    stats.interrupts++;
+    interrupts = false;
+    // SCL stays low from TWINT until the ISR has written TWCR
+    nowNs += serviceLatencyNs;
+    stats.serviceNs += serviceLatencyNs;
+    TWI_vect();
+    interrupts = true;
+}
+
+void VirtualBus::executeMaster()
+{
+    uint32_t period = sclPeriodNs();
+
+    if (busError) {
+        busError = false;
+        if (target != nullptr) {
+            target->stop();
+        }
+        target = nullptr;
+        phase = Phase::Idle;
+        raise(0x00);
+        return;
+    }
+
+    if (twcr & (1 << TWSTO)) {
+        // The hardware clears TWSTO once the STOP has been transmitted
+        twcr &= ~(1 << TWSTO);
+        if (phase != Phase::Idle) {
+            if (target != nullptr) {
+                target->stop();
+            }
+            target = nullptr;
+            phase = Phase::Idle;
+            stats.stops++;
+            busTime(period);
+        }
+        if (!(twcr & (1 << TWSTA))) {
+            return;
+        }
+    }
+
+    if (twcr & (1 << TWSTA)) {
+        bool restart = phase != Phase::Idle;
+        if (target != nullptr) {
+            target->stop();
+        }
+        target = nullptr;
+        phase = Phase::Started;
+        stats.starts++;
+        busTime(period);
+        raise(restart ? 0x10 : 0x08);
+        return;
+    }
+
+    switch (phase) {
+        case Phase::Started: {
+            bool read = (twdr & 0x01) != 0;
+            stats.bytes++;
+            busTime(9ULL * period);
+            if (arbitrationAddressed && (twar >> 1) != 0) {
+                // The other master sends the own address and one data byte to the driver, followed by a STOP
+                arbitrationAddressed = false;
+                phase = Phase::Addressed;
+                twdr = static_cast<uint8_t>(twar & 0xFE);
+                if (slaveRaise(0x68)) {
+                    twdr = arbitrationData;
+                    stats.bytes++;
+                    busTime(9ULL * period);
+                    if (slaveRaise(0x80)) {
+                        stats.stops++;
+                        busTime(period);
+                        slaveRaise(0xA0);
+                    }
+                }
+                phase = Phase::Idle;
+                break;
+            }
+            if (arbitrationLosses > 0) {
+                arbitrationLosses--;
+                if (arbitrationWinnerBytes > 0) {
+                    // The winner keeps the bus for its data bytes and the STOP
+                    stats.bytes += arbitrationWinnerBytes;
+                    stats.stops++;
+                    busTime((9ULL * arbitrationWinnerBytes + 1) * period);
+                }
+                phase = Phase::Idle;
+                busyUntilNs = nowNs + arbitrationHoldNs;
+                arbitrationHoldNs = 0;
+                raise(0x38);
+                break;
+            }
+            target = find(static_cast<uint8_t>(twdr >> 1));
+            // A device clocked beyond its speed misses its address
+            bool tooFast = (target != nullptr) && (target->getMaxFrequency() != 0) &&
+                           (1000000000ULL / period > target->getMaxFrequency());
+            bool ack = (target != nullptr) && !tooFast && target->address(read);
+            if (target != nullptr) {
+                busTime(target->getStretch());
+            }
+            if (!ack) {
+                // The master keeps the bus until it sends STOP or a repeated START
+                target = nullptr;
+                phase = Phase::Transmitting;
+                raise(read ? 0x48 : 0x20);
+            }
+            else {
+                phase = read ? Phase::Receiving : Phase::Transmitting;
+                raise(read ? 0x40 : 0x18);
+            }
+            break;
+        }
+
+        case Phase::Transmitting: {
+            stats.bytes++;
+            busTime(9ULL * period);
+            bool ack = false;
+            if (target != nullptr) {
+                busTime(target->getStretch());
+                ack = target->receive(twdr);
+            }
+            raise(ack ? 0x28 : 0x30);
+            break;
+        }
+
+        case Phase::Receiving: {
+            stats.bytes++;
+            busTime(9ULL * period);
+            twdr = 0xFF;
+            if (target != nullptr) {
+                busTime(target->getStretch());
+                twdr = target->transmit();
+            }
+            raise((twcr & (1 << TWEA)) ? 0x50 : 0x58);
+            break;
+        }
+
+        default:
+            // TWINT has been cleared without a pending bus action
+            break;
+    }
+}
+
+bool VirtualBus::step()
+{
+    bool acted = false;
+    // A START waits while another master owns the bus
+    bool waiting = (twcr & (1 << TWSTA)) && (phase == Phase::Idle) && (nowNs < busyUntilNs);
+    if (pending && (sdaHeld == 0) && !waiting) {
+        pending = false;
+        acted = true;
+        if (phase != Phase::Addressed) {
+            executeMaster();
+        }
+    }
+    if ((twcr & (1 << TWINT)) && (twcr & (1 << TWIE)) && interrupts) {
+        deliver();
+        acted = true;
+    }
+    if (acted) {
+        stalledNs = 0;
+    }
+    return acted;
+}
+
+void VirtualBus::run()
+{
+    while (step()) {
+    }
+}
+
+void VirtualBus::idle()
+{
+    if (!step()) {
+        nowNs += 1000;
+        stalledNs += 1000;
+        if (stalledNs > STALL_LIMIT_NS) {
+            fprintf(stderr, "VirtualBus: no progress for %llu ns, TWCR=0x%02X TWSR=0x%02X\n",
+                    static_cast<unsigned long long>(stalledNs), twcr, twsr);
+            abort();
+        }
+    }
+    runTimer();
+}
+
+void VirtualBus::setTimer(uint32_t periodNs, void (*handler)())
+{
+    timerPeriodNs = periodNs;
+    timerHandler = (periodNs > 0) ? handler : nullptr;
+    timerDueNs = nowNs + periodNs;
+}
+
+void VirtualBus::stopTimer1(bool stopped)
+{
+    readTimer1();
+    timer1Stopped = stopped;
+}
+
+uint16_t VirtualBus::readTimer1()
+{
+    if (!timer1Stopped) {
+        timer1Count = static_cast<uint16_t>(nowNs * (F_CPU / 8) / 1000000000ULL);
+    }
+    return timer1Count;
+}
+
+void VirtualBus::armCompare1(uint16_t count)
+{
+    compare1Armed = true;
+    compare1From = readTimer1();
+    compare1Count = count;
+}
+
+void VirtualBus::disarmCompare1()
+{
+    compare1Armed = false;
+}
+
+/** Timer1 counted up to the armed compare value since it was armed **/
+bool VirtualBus::compare1Reached()
+{
+    return compare1Armed &&
+           (static_cast<uint16_t>(readTimer1() - compare1From) >= static_cast<uint16_t>(compare1Count - compare1From));
+}
+
+/** Calls the timer handler for every period passed, like the ISR it runs with interrupts disabled **/
+void VirtualBus::runTimer()
+{
+    while ((timerHandler != nullptr) && interrupts && (nowNs >= timerDueNs)) {
+        timerDueNs += timerPeriodNs;
+        interrupts = false;
+        timerCalls++;
+        timerHandler();
+        interrupts = true;
+        stalledNs = 0;
+    }
+}
+
+void VirtualBus::sleep()
+{
+    stats.sleeps++;
+    interrupts = true;
+    uint32_t delivered = stats.interrupts;
+    uint32_t ticks = timerCalls;
+    while ((stats.interrupts == delivered) && (timerCalls == ticks) && !compare1Reached()) {
+        idle();
+    }
+}
+
+void VirtualBus::loseArbitration(uint8_t count, uint16_t winnerBytes)
+{
+    arbitrationLosses = count;
+    arbitrationWinnerBytes = winnerBytes;
+}
+
+void VirtualBus::keepBusAfterArbitration(uint32_t ns)
+{
+    arbitrationHoldNs = ns;
+}
+
+void VirtualBus::occupyBus(uint32_t ns)
+{
+    busyUntilNs = nowNs + ns;
+}
+
+void VirtualBus::loseArbitrationTo(uint8_t data)
+{
+    arbitrationAddressed = true;
+    arbitrationData = data;
+}
+
+void VirtualBus::injectBusError()
+{
+    busError = true;
+}
+
+void VirtualBus::raiseStatus(uint8_t status)
+{
+    raise(status);
+    step();
+}
+
+void VirtualBus::holdSDA(uint8_t count)
+{
+    sdaHeld = count;
+}
+
+void VirtualBus::driveSCL(bool high)
+{
+    if (twcr & (1 << TWEN)) {
+        return;
+    }
+    if (high && !sclLine && (sdaHeld > 0)) {
+        // Every clock shifts out one more bit of the byte the slave is stuck in
+        sdaHeld--;
+    }
+    if (high && !sclLine) {
+        stats.recoveryClocks++;
+    }
+    sclLine = high;
+}
+
+void VirtualBus::driveSDA(bool high)
+{
+    if (twcr & (1 << TWEN)) {
+        return;
+    }
+    if (high && !sdaLine && sclLine && (sdaHeld == 0)) {
+        stats.portStops++;
+    }
+    sdaLine = high;
+}
+
+bool VirtualBus::readSDA()
+{
+    return sdaLine && (sdaHeld == 0);
+}
+
+bool VirtualBus::readSCL()
+{
+    if (nowNs < busyUntilNs) {
+        // Another master clocks the bus
+        return (nowNs / 5000) % 2 == 0;
+    }
+    return sclLine;
+}
+
+void VirtualBus::setServiceLatency(uint32_t ns)
+{
+    serviceLatencyNs = ns;
+}
+
+void VirtualBus::elapse(uint32_t ns)
+{
+    nowNs += ns;
+}
+
+void VirtualBus::delay(uint32_t ns)
+{
+    nowNs += ns;
+    runTimer();
+}
+
+bool VirtualBus::slaveRaise(uint8_t status)
+{
+    raise(status);
+    if ((twcr & (1 << TWIE)) && interrupts) {
+        deliver();
+    }
+    // Writes to TWCR from the ISR only continue the slave transfer
+    pending = false;
+    return !(twcr & (1 << TWINT));
+}
+
+uint16_t VirtualBus::masterWrite(uint8_t address, const uint8_t *data, uint16_t length)
+{
+    uint32_t period = sclPeriodNs();
+    bool general = (address == 0) && (twar & 0x01);
+    if (phase != Phase::Idle) {
+        return 0;
+    }
+    stats.starts++;
+    stats.stops++;
+    stats.bytes++;
+    busTime(11ULL * period);
+    if (!(twcr & (1 << TWEN)) || !(twcr & (1 << TWEA)) || (!general && ((twar >> 1) != address))) {
+        return 0;
+    }
+
+    phase = Phase::Addressed;
+    uint16_t acknowledged = 0;
+    bool addressed = slaveRaise(general ? 0x70 : 0x60);
+    for (uint16_t index = 0; addressed && (index < length); index++) {
+        bool ack = (twcr & (1 << TWEA)) != 0;
+        twdr = data[index];
+        stats.bytes++;
+        busTime(9ULL * period);
+        if (ack) {
+            addressed = slaveRaise(general ? 0x90 : 0x80);
+            acknowledged++;
+        }
+        else {
+            // The slave switches to the not addressed mode after a NACK
+            slaveRaise(general ? 0x98 : 0x88);
+            addressed = false;
+        }
+    }
+    if (addressed) {
+        slaveRaise(0xA0);
+    }
+    phase = Phase::Idle;
+    return acknowledged;
+}
+
+uint16_t VirtualBus::masterRead(uint8_t address, uint8_t *data, uint16_t length)
+{
+    uint32_t period = sclPeriodNs();
+    if (phase != Phase::Idle) {
+        return 0;
+    }
+    stats.starts++;
+    stats.stops++;
+    stats.bytes++;
+    busTime(11ULL * period);
+    if (!(twcr & (1 << TWEN)) || !(twcr & (1 << TWEA)) || ((twar >> 1) != address)) {
+        return 0;
+    }
+
+    phase = Phase::Addressed;
+    uint16_t received = 0;
+    bool addressed = slaveRaise(0xA8);
+    while (addressed && (received < length)) {
+        data[received++] = twdr;
+        stats.bytes++;
+        busTime(9ULL * period);
+        bool slaveHasMore = (twcr & (1 << TWEA)) != 0;
+        bool masterAck = received < length;
+        uint8_t status = !masterAck ? 0xC0 : (slaveHasMore ? 0xB8 : 0xC8);
+        addressed = slaveRaise(status) && (status == 0xB8);
+    }
+    phase = Phase::Idle;
+    return received;
+}
+
+
+/****************************************************************/
+/** VIRTUAL WIRE **/
+/****************************************************************/
+
+VirtualWire::VirtualWire()
+    : target(nullptr),
+      state(State::Idle),
+      masterScl(true),
+      masterSda(true),
+      slaveSda(true),
+      scl(true),
+      sda(true),
+      bit(0),
+      shift(0),
+      masterAck(false),
+      heldUntilNs(0),
+      stats()
+{
+}
+
+void VirtualWire::attach(SlaveModel &slave)
+{
+    slaves.push_back(&slave);
+}
+
+void VirtualWire::drive(Line line, bool high)
+{
+    if (line == Line::SCL) {
+        masterScl = high;
+    } else {
+        masterSda = high;
+    }
+    update();
+}
+
+bool VirtualWire::read(Line line)
+{
+    update();
+    return (line == Line::SCL) ? scl : sda;
+}
+
+/** Applies a change of the wired-AND levels. The master changes one line at a time, the slaves change SDA only
+ * while SCL is low **/
+void VirtualWire::update()
+{
+    bool level = masterScl && (VirtualBus::now() >= heldUntilNs);
+    if (level != scl) {
+        scl = level;
+        if (scl) {
+            onRise();
+        } else {
+            onFall();
+        }
+    }
+    level = masterSda && slaveSda;
+    if (level != sda) {
+        sda = level;
+        if (scl) {
+            if (sda) {
+                onStop();
+            } else {
+                onStart();
+            }
+        }
+    }
+}
+
+void VirtualWire::onStart()
+{
+    stats.starts++;
+    if (target != nullptr) {
+        target->stop();
+    }
+    target = nullptr;
+    state = State::Address;
+    bit = 0xFF;
+    shift = 0;
+    slaveSda = true;
+}
+
+void VirtualWire::onStop()
+{
+    stats.stops++;
+    if (target != nullptr) {
+        target->stop();
+    }
+    target = nullptr;
+    state = State::Idle;
+    slaveSda = true;
+}
+
+/** Receivers sample SDA while SCL is high **/
+void VirtualWire::onRise()
+{
+    if (bit == 8) {
+        masterAck = !sda;
+    } else if ((bit < 8) && ((state == State::Address) || (state == State::Receive))) {
+        shift = static_cast<uint8_t>((shift << 1) | (sda ? 1 : 0));
+    }
+}
+
+/** Transmitters change SDA while SCL is low, the slave decides on its ACK once the 8th bit has been clocked **/
+void VirtualWire::onFall()
+{
+    if ((state == State::Idle) || (state == State::Ignore)) {
+        return;
+    }
+    bit = (bit == 0xFF) ? 0 : static_cast<uint8_t>(bit + 1);
+    if (bit == 8) {
+        stats.bytes++;
+        if (state == State::Address) {
+            bool reading = (shift & 0x01) != 0;
+            for (SlaveModel *slave : slaves) {
+                if (slave->getAddress() == (shift >> 1)) {
+                    target = slave;
+                }
+            }
+            if ((target != nullptr) && target->address(reading)) {
+                state = reading ? State::Transmit : State::Receive;
+                masterAck = true;
+                slaveSda = false;
+            } else {
+                target = nullptr;
+                state = State::Ignore;
+            }
+        } else if (state == State::Receive) {
+            slaveSda = !target->receive(shift);
+        } else {
+            slaveSda = true;
+        }
+        return;
+    }
+    if (bit == 9) {
+        // Byte done: the slave stretches the clock, then the next byte starts
+        bit = 0;
+        slaveSda = true;
+        heldUntilNs = VirtualBus::now() + target->getStretch();
+        if (state == State::Transmit) {
+            if (!masterAck) {
+                state = State::Ignore;
+                return;
+            }
+            shift = target->transmit();
+        } else {
+            shift = 0;
+        }
+    }
+    if (state == State::Transmit) {
+        slaveSda = ((shift >> (7 - bit)) & 0x01) != 0;
+    }
+}
@@ -0,0 +1,177 @@
+//
+// Throughput benchmark: runs the driver against the timed virtual bus and prints the payload throughput and the bus
+// utilisation of representative workloads as a markdown table.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "TWI.h"
+
+static TWI twi;
+static int failures = 0;
+
+#define EXPECT(condition)                                                           \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            printf("    FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition);       \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+/** SCL frequencies every workload is run at **/
+static const uint32_t frequencies[] = {100000, 400000};
+
+/** ISR service latencies: an ideal ISR, and about 100 cycles at 16 MHz for prologue, dispatch, handler and epilogue **/
+static const uint32_t serviceLatencies[] = {0, 6000};
+
+static MemorySlave sensor(0x48, 256);
+static MemorySlave display(0x3C, 2048, 2);
+static MemorySlave slowDevice(0x30, 256);
+
+static uint8_t receiveStorage[32];
+static uint8_t transmitStorage[32];
+static uint8_t replyStorage[32];
+
+/** ISR service latency of the running workload **/
+static uint32_t serviceLatency = 0;
+
+/** Resets the virtual bus, the bus time starts at 0, and sets the driver up in the given mode **/
+static void setup(TWIMode mode, uint32_t frequency)
+{
+    VirtualBus::reset();
+    VirtualBus::setServiceLatency(serviceLatency);
+    sei();
+    twi.TWISetMode(mode, 0x41, PrescalerValue::PRESCALE_VALUE_1, frequency);
+}
+
+/****************************************************************/
+/* Workloads, each returns the payload bytes it transferred     */
+/****************************************************************/
+
+/** 2 byte register reads of a sensor, one transaction per read **/
+static uint32_t registerReads(uint32_t frequency)
+{
+    setup(TWIMode::Master, frequency);
+    VirtualBus::attach(sensor);
+    sensor.memory()[0x10] = 0x12;
+    sensor.memory()[0x11] = 0x34;
+    uint8_t value[2];
+    for (uint8_t count = 0; count < 64; count++) {
+        EXPECT(twi.readRegister(0x48, 0x10, value, sizeof(value)) == TWIResult::Success);
+        EXPECT(value[1] == 0x34);
+    }
+    return 64 * sizeof(value);
+}
+
+/** Framebuffer writes of 2 address bytes and 512 data bytes, sent without staging copies **/
+static uint32_t bulkWrites(uint32_t frequency)
+{
+    setup(TWIMode::Master, frequency);
+    VirtualBus::attach(display);
+    static uint8_t framebuffer[2 + 512];
+    for (uint16_t index = 2; index < sizeof(framebuffer); index++) {
+        framebuffer[index] = static_cast<uint8_t>(index * 7);
+    }
+    for (uint8_t count = 0; count < 4; count++) {
+        EXPECT(twi.WriteDirect(0x3C, framebuffer, sizeof(framebuffer)) == TWIResult::Success);
+    }
+    EXPECT(memcmp(display.memory(), &framebuffer[2], 512) == 0);
+    return 4 * 512;
+}
+
+/** Bulk writes to a slave that stretches the clock by 10 us on every byte **/
+static uint32_t stretchedWrites(uint32_t frequency)
+{
+    setup(TWIMode::Master, frequency);
+    VirtualBus::attach(slowDevice);
+    slowDevice.stretch(10000);
+    uint8_t data[1 + 32] = {0};
+    for (uint8_t count = 0; count < 16; count++) {
+        EXPECT(twi.WriteDirect(0x30, data, sizeof(data)) == TWIResult::Success);
+    }
+    slowDevice.stretch(0);
+    return 16 * 32;
+}
+
+/** The driver as slave: another master writes 16 bytes, the application queues them as reply and they are read back **/
+static uint32_t slaveEcho(uint32_t frequency)
+{
+    setup(TWIMode::Slave, frequency);
+    twi.setBuffers(transmitStorage, sizeof(transmitStorage), receiveStorage, sizeof(receiveStorage));
+    twi.setReplyBuffer(replyStorage, sizeof(replyStorage));
+    twi.configure(TWIMode::Slave, 0x41, TWI::bitRateDivider(frequency, PrescalerValue::PRESCALE_VALUE_1),
+                  PrescalerValue::PRESCALE_VALUE_1);
+    uint8_t request[16];
+    uint8_t message[16];
+    uint8_t reply[16];
+    for (uint8_t count = 0; count < 32; count++) {
+        for (uint8_t index = 0; index < sizeof(request); index++) {
+            request[index] = static_cast<uint8_t>(count + index);
+        }
+        EXPECT(VirtualBus::masterWrite(0x41, request, sizeof(request)) == sizeof(request));
+        uint8_t length = twi.receiveMessage(message, sizeof(message));
+        EXPECT(twi.sendMessage(message, length));
+        EXPECT(VirtualBus::masterRead(0x41, reply, sizeof(reply)) == sizeof(reply));
+        EXPECT(memcmp(reply, request, sizeof(request)) == 0);
+    }
+    twi.setReplyBuffer(nullptr, 0);
+    twi.setBuffers(nullptr, 0, nullptr, 0);
+    return 32 * 2 * sizeof(request);
+}
+
+/** 8 byte writes that each lose arbitration once against a master writing 8 bytes to another slave **/
+static uint32_t contendedWrites(uint32_t frequency)
+{
+    setup(TWIMode::Slave, frequency);
+    VirtualBus::attach(sensor);
+    uint8_t data[1 + 8] = {0x20, 1, 2, 3, 4, 5, 6, 7, 8};
+    for (uint8_t count = 0; count < 32; count++) {
+        VirtualBus::loseArbitration(1, 1 + 8);
+        EXPECT(twi.WriteDirect(0x48, data, sizeof(data)) == TWIResult::Success);
+    }
+    EXPECT(sensor.memory()[0x27] == 8);
+    return 32 * 8;
+}
+
+typedef struct Workload {
+    const char *name;
+    uint32_t (*run)(uint32_t frequency);
+} Workload;
+
+static const Workload workloads[] = {
+        {"register read 2 B x64", registerReads},
+        {"bulk write 512 B x4", bulkWrites},
+        {"bulk write 32 B x16, 10 us stretch", stretchedWrites},
+        {"slave echo 16 B x32", slaveEcho},
+        {"contended write 8 B x32", contendedWrites},
+};
+
+/** Runs a workload and prints one row of the results table **/
+static void measure(const Workload &workload, uint32_t frequency, uint32_t latency)
+{
+    serviceLatency = latency;
+    uint32_t payload = workload.run(frequency);
+    const VirtualBusCounters &counters = VirtualBus::counters();
+    double elapsedNs = static_cast<double>(VirtualBus::now());
+    printf("| %s | %u kHz | %.1f us | %u B | %.1f us | %.0f B/s | %.1f %% | %.1f %% | %u |\n",
+           workload.name, frequency / 1000, latency / 1000.0, payload, elapsedNs / 1000.0,
+           payload * 1e9 / elapsedNs, 100.0 * counters.busyNs / elapsedNs, 100.0 * counters.serviceNs / elapsedNs,
+           counters.interrupts);
+}
+
+int main()
+{
+    printf("| Workload | SCL | ISR latency | Payload | Bus time | Throughput | Utilisation | SCL held by ISR | IRQ |\n");
+    printf("|---|---:|---:|---:|---:|---:|---:|---:|---:|\n");
+    for (const Workload &workload : workloads) {
+        for (uint32_t frequency : frequencies) {
+            for (uint32_t latency : serviceLatencies) {
+                measure(workload, frequency, latency);
+            }
+        }
+    }
+    if (failures != 0) {
+        printf("FAILED: %d failure(s)\n", failures);
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,1479 @@
+//
+// Host build of the driver: runs the driver against the virtual bus and reports the results of a set of scenarios
+// together with the bus time they took.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "TWI.h"
+#include "TWIConfig.h"
+#include "TWIEeprom.h"
+#include "TWIRegisterCache.h"
+#include "TWIScheduler.h"
+#include "TWISoftBus.h"
+#include "TWITrace.h"
+
+static int failures = 0;
+static uint32_t interruptsAtStart = 0;
+
+#define EXPECT(condition)                                                           \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            printf("    FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition);       \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+/** Starts a measurement, returns the current bus time **/
+static uint64_t mark()
+{
+    interruptsAtStart = VirtualBus::counters().interrupts;
+    return VirtualBus::now();
+}
+
+/** Prints one line of the results table **/
+static void report(const char *scenario, uint32_t payloadBytes, uint64_t startNs)
+{
+    uint64_t elapsedNs = VirtualBus::now() - startNs;
+    double throughput = elapsedNs ? (payloadBytes * 1e9 / elapsedNs) : 0.0;
+    printf("%-36s %8u B %12.1f us %10.0f B/s %6u IRQ\n",
+           scenario, payloadBytes, elapsedNs / 1000.0, throughput,
+           VirtualBus::counters().interrupts - interruptsAtStart);
+}
+
+/** Submits a single transaction and waits for it **/
+static TWIResult transfer(uint8_t address, TWIDirection direction, uint8_t *data, uint8_t length)
+{
+    TWITransaction transaction = {};
+    transaction.address = address;
+    transaction.direction = direction;
+    transaction.data = data;
+    transaction.length = length;
+    twi.submit(transaction);
+    return twi.wait(transaction);
+}
+
+/** Resets the virtual bus and sets the driver up as master **/
+static void setupMaster(uint32_t frequency)
+{
+    VirtualBus::reset();
+    sei();
+    twi.TWISetMode(TWIMode::Master, 0x01, PrescalerValue::PRESCALE_VALUE_1, frequency);
+}
+
+static void registerRead(uint32_t frequency)
+{
+    MemorySlave sensor(0x48, 256);
+    setupMaster(frequency);
+    VirtualBus::attach(sensor);
+    for (uint16_t index = 0; index < 256; index++) {
+        sensor.memory()[index] = static_cast<uint8_t>(index ^ 0x5A);
+    }
+
+    uint64_t start = mark();
+    uint8_t values[6] = {0};
+    for (uint8_t reg = 0; reg < 16; reg++) {
+        twi.Write(0x48, reg, true);
+        twi.Read(0x48, values, sizeof(values));
+        EXPECT(values[0] == static_cast<uint8_t>(reg ^ 0x5A));
+        EXPECT(values[5] == static_cast<uint8_t>((reg + 5) ^ 0x5A));
+    }
+    report(frequency == 100000 ? "register read 16x6 @100k" : "register read 16x6 @400k", 16 * 6, start);
+
+    start = mark();
+    for (uint8_t reg = 0; reg < 16; reg++) {
+        EXPECT(twi.readRegister(0x48, reg, values, sizeof(values)) == TWIResult::Success);
+        EXPECT(values[0] == static_cast<uint8_t>(reg ^ 0x5A));
+        EXPECT(values[5] == static_cast<uint8_t>((reg + 5) ^ 0x5A));
+    }
+    report(frequency == 100000 ? "readRegister 16x6 @100k" : "readRegister 16x6 @400k", 16 * 6, start);
+}
+
+static void wideRegisters()
+{
+    MemorySlave device(0x57, 4096, 2);
+    setupMaster(400000);
+    VirtualBus::attach(device);
+
+    const uint8_t values[4] = {0xDE, 0xAD, 0xBE, 0xEF};
+    uint8_t readback[4] = {0};
+    uint64_t start = mark();
+    EXPECT(twi.writeRegister(0x57, 0x0ABC, values, sizeof(values), TWIRegisterSize::Word) == TWIResult::Success);
+    EXPECT(memcmp(&device.memory()[0x0ABC], values, sizeof(values)) == 0);
+    EXPECT(twi.readRegister(0x57, 0x0ABD, readback, 3, TWIRegisterSize::Word) == TWIResult::Success);
+    EXPECT(memcmp(readback, &values[1], 3) == 0);
+    EXPECT(twi.readRegister(0x58, 0x0000, readback, 3, TWIRegisterSize::Word) == TWIResult::AddressNack);
+    report("16 bit register write 4 + read 3", 7, start);
+}
+
+static void queuedWrites()
+{
+    MemorySlave first(0x50, 64);
+    MemorySlave second(0x51, 64);
+    VirtualBus::reset();
+    sei();
+    TWIConfig<TWIMode::Master, 400000>::begin();
+    static_assert(TWIConfig<TWIMode::Master, 400000>::prescaler == PrescalerValue::PRESCALE_VALUE_1,
+                  "TWBR 12 fits without a prescaler");
+    static_assert(TWIConfig<TWIMode::Master, 10000>::prescaler == PrescalerValue::PRESCALE_VALUE_4,
+                  "TWBR 792 needs the prescaler 4");
+    VirtualBus::attach(first);
+    VirtualBus::attach(second);
+
+    uint8_t payload[8][9];
+    TWITransaction transactions[8] = {};
+    for (uint8_t index = 0; index < 8; index++) {
+        payload[index][0] = static_cast<uint8_t>(index * 8);
+        for (uint8_t byte = 1; byte < 9; byte++) {
+            payload[index][byte] = static_cast<uint8_t>(index * 16 + byte);
+        }
+        transactions[index].address = (index & 0x01) ? 0x51 : 0x50;
+        transactions[index].direction = TWIDirection::Write;
+        transactions[index].data = payload[index];
+        transactions[index].length = sizeof(payload[index]);
+    }
+
+    uint64_t start = mark();
+    // The queue holds TWI_QUEUE_SIZE - 1 transactions
+    for (uint8_t index = 0; index < TWI_QUEUE_SIZE - 1; index++) {
+        EXPECT(twi.submit(transactions[index]));
+    }
+    EXPECT(!twi.submit(transactions[7]));
+    EXPECT(twi.wait(transactions[6]) == TWIResult::Success);
+    EXPECT(twi.submit(transactions[7]));
+    EXPECT(twi.wait(transactions[7]) == TWIResult::Success);
+    for (uint8_t index = 0; index < 8; index++) {
+        EXPECT(transactions[index].result == TWIResult::Success);
+        MemorySlave &slave = (index & 0x01) ? second : first;
+        EXPECT(memcmp(&slave.memory()[index * 8], &payload[index][1], 8) == 0);
+    }
+    EXPECT(VirtualBus::counters().starts == 8);
+    report("queued writes 8x8 @400k", 8 * 8, start);
+}
+
+static void errors()
+{
+    MemorySlave device(0x20, 16);
+    setupMaster(100000);
+    VirtualBus::attach(device);
+    TWIStatistics statistics;
+    twi.getStatistics(statistics, true);
+    uint64_t start = mark();
+
+    uint8_t data[4] = {0x00, 1, 2, 3};
+    EXPECT(transfer(0x21, TWIDirection::Write, data, sizeof(data)) == TWIResult::AddressNack);
+
+    device.nackByte(1);
+    EXPECT(transfer(0x20, TWIDirection::Write, data, sizeof(data)) == TWIResult::DataNack);
+    device.nackByte(0xFFFF);
+
+    VirtualBus::loseArbitration(TWI_ARBITRATION_RETRIES + 1);
+    EXPECT(transfer(0x20, TWIDirection::Write, data, sizeof(data)) == TWIResult::ArbitrationLost);
+
+    VirtualBus::injectBusError();
+    EXPECT(transfer(0x20, TWIDirection::Write, data, sizeof(data)) == TWIResult::BusError);
+
+    device.nackByte(0);
+    EXPECT(twi.readRegister(0x20, 0x00, data, 1) == TWIResult::DataNack);
+    device.nackByte(0xFFFF);
+
+    EXPECT(transfer(0x20, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(device.memory()[2] == 3);
+    report("NACK, arbitration, bus error", 0, start);
+
+    twi.getStatistics(statistics, true);
+    EXPECT(statistics.transactions == 6);
+    EXPECT(statistics.addressNacks == 1);
+    EXPECT(statistics.dataNacks == 1);
+    EXPECT(statistics.registerNacks == 1);
+    EXPECT(statistics.arbitrationLosses == TWI_ARBITRATION_RETRIES + 1);
+    EXPECT(statistics.busErrors == 1);
+    uint16_t timed = 0;
+    for (uint8_t bucket = 0; bucket < TWI_LATENCY_BUCKETS; bucket++) {
+        timed += statistics.latency[bucket];
+    }
+    EXPECT(timed == statistics.transactions);
+    // 4 bytes plus the address at 100 kHz take about 450 us, 900 ticks of Timer1 at F_CPU / 8
+    EXPECT(statistics.latency[10] >= 1);
+    twi.getStatistics(statistics);
+    EXPECT(statistics.transactions == 0);
+}
+
+static uint8_t traceLines = 0;
+static bool traceNamed = false;
+static bool traceLate = false;
+
+static void traceLine(const char *line)
+{
+    traceLines++;
+    if (strstr(line, " 0x20 TWI_MT_SLA_NACK ") != nullptr) {
+        traceNamed = true;
+    }
+    if (strcmp(line, "#6000000000") == 0) {
+        traceLate = true;
+    }
+}
+
+/** Copies a name of TWITrace out of program memory **/
+static const char *flashName(const char *name)
+{
+    static char text[32];
+    auto address = static_cast<TWIFlashAddress>(reinterpret_cast<uintptr_t>(name));
+    uint8_t length = 0;
+    while (length < sizeof(text) - 1) {
+        auto character = static_cast<char>(TWIHardware::readFlash(address++));
+        if (character == '\0') {
+            break;
+        }
+        text[length++] = character;
+    }
+    text[length] = '\0';
+    return text;
+}
+
+static void trace()
+{
+    MemorySlave device(0x22, 16);
+    setupMaster(400000);
+    VirtualBus::attach(device);
+    TWITraceEntry entries[32];
+    twi.getTrace(entries, 32, true);
+
+    uint8_t data[3] = {0x00, 0x5A, 0x5B};
+    EXPECT(transfer(0x22, TWIDirection::Write, data, 2) == TWIResult::Success);
+    device.nackByte(1);
+    EXPECT(transfer(0x22, TWIDirection::Write, data, 3) == TWIResult::DataNack);
+
+    // START, SLA+W ACK and two data bytes for each transfer
+    uint8_t count = twi.getTrace(entries, 32);
+    EXPECT(count == 8);
+    EXPECT(entries[0].status == TWI_START);
+    EXPECT(entries[1].status == TWI_MT_SLA_ACK);
+    EXPECT(entries[3].status == TWI_MT_DATA_ACK);
+    EXPECT(entries[3].data == 0x5A);
+    EXPECT(entries[7].status == TWI_MT_DATA_NACK);
+    EXPECT(entries[7].state == MasterTransmitter);
+    EXPECT(static_cast<uint16_t>(entries[7].time - entries[0].time) > 0);
+    EXPECT(strcmp(flashName(TWITrace::statusName(entries[6].status)), "TWI_MT_DATA_ACK") == 0);
+    EXPECT(strcmp(flashName(TWITrace::stateName(entries[6].state)), "MasterTransmitter") == 0);
+
+    // Wraps around, keeping the latest entries
+    VirtualBus::detach(device);
+    for (uint8_t index = 0; index < 20; index++) {
+        transfer(0x22, TWIDirection::Write, data, sizeof(data));
+    }
+    EXPECT(twi.getTrace(entries, 32) == 32);
+    EXPECT(entries[31].status == TWI_MT_SLA_NACK);
+
+    traceLines = 0;
+    TWITrace::printListing(entries, 32, traceLine);
+    EXPECT(traceLines == 32);
+    EXPECT(traceNamed);
+    traceLines = 0;
+    TWITrace::printVCD(entries, 4, 500, traceLine);
+    EXPECT(traceLines == 7 + 4 * 4);
+
+    // Entries seconds apart are dumped beyond the 32 bit range of nanoseconds
+    entries[1].time = static_cast<uint16_t>(entries[0].time + 60000);
+    entries[2].time = static_cast<uint16_t>(entries[1].time + 60000);
+    TWITrace::printVCD(entries, 3, 50000, traceLine);
+    EXPECT(traceLate);
+}
+
+static uint32_t recoveryBaseline = 0;
+static uint8_t nestedServices = 0;
+
+/** Timer interrupt of an application servicing the bus, it fires while the main loop recovers the bus **/
+static void serviceDuringRecovery()
+{
+    if (VirtualBus::counters().recoveryClocks != recoveryBaseline) {
+        nestedServices++;
+        twi.service();
+    }
+}
+
+static void timeouts()
+{
+    MemorySlave device(0x24, 16);
+    setupMaster(100000);
+    VirtualBus::attach(device);
+    TWIStatistics statistics;
+    twi.getStatistics(statistics, true);
+    uint64_t start = mark();
+
+    // A slave holding SDA low stalls the transfer, the driver clocks it free and reports the timeout
+    uint8_t data[3] = {0x04, 0x11, 0x22};
+    VirtualBus::holdSDA(5);
+    EXPECT(transfer(0x24, TWIDirection::Write, data, sizeof(data)) == TWIResult::Timeout);
+    EXPECT(VirtualBus::counters().recoveryClocks == 6);
+    EXPECT(VirtualBus::counters().portStops == 1);
+    EXPECT(transfer(0x24, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(device.memory()[5] == 0x22);
+
+    // Per-transaction timeout; the queued transaction behind the hung one still runs
+    TWITransaction hung = {};
+    hung.address = 0x24;
+    hung.direction = TWIDirection::Write;
+    hung.data = data;
+    hung.length = sizeof(data);
+    hung.timeout = 2000;
+    TWITransaction queued = hung;
+    data[1] = 0x33;
+    VirtualBus::holdSDA(9);
+    uint64_t hangStart = VirtualBus::now();
+    EXPECT(twi.submit(hung));
+    EXPECT(twi.submit(queued));
+    EXPECT(twi.wait(hung) == TWIResult::Timeout);
+    EXPECT(VirtualBus::now() - hangStart < 1500000);
+    EXPECT(twi.wait(queued) == TWIResult::Success);
+    EXPECT(device.memory()[4] == 0x33);
+    report("timeout + recovery, 2 hangs", 9, start);
+
+    twi.getStatistics(statistics, true);
+    EXPECT(statistics.timeouts == 2);
+
+    // A hung bus raises no TWI interrupt, a sleeping wait is woken by the compare interrupt of Timer1
+    twi.setWaitMode(TWIWaitMode::Sleep);
+    uint32_t sleeps = VirtualBus::counters().sleeps;
+    VirtualBus::holdSDA(5);
+    EXPECT(transfer(0x24, TWIDirection::Write, data, sizeof(data)) == TWIResult::Timeout);
+    EXPECT(VirtualBus::counters().sleeps - sleeps > 0);
+    EXPECT(transfer(0x24, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    twi.setWaitMode(TWIWaitMode::Spin);
+
+    // An interrupt servicing the bus during the recovery leaves the stuck transaction to the main loop
+    recoveryBaseline = VirtualBus::counters().recoveryClocks;
+    nestedServices = 0;
+    VirtualBus::setTimer(10000, serviceDuringRecovery);
+    VirtualBus::holdSDA(5);
+    EXPECT(twi.submit(hung));
+    EXPECT(twi.submit(queued));
+    EXPECT(twi.wait(hung) == TWIResult::Timeout);
+    EXPECT(twi.wait(queued) == TWIResult::Success);
+    VirtualBus::setTimer(0, nullptr);
+    EXPECT(nestedServices > 0);
+    EXPECT(VirtualBus::counters().recoveryClocks - recoveryBaseline == 6);
+
+    // The recovery only sets the TWI up again: messages received as slave and the queued reply survive a timeout
+    VirtualBus::reset();
+    sei();
+    VirtualBus::attach(device);
+    uint8_t receiveStorage[16];
+    uint8_t transmitStorage[16];
+    uint8_t replyStorage[8];
+    twi.setBuffers(transmitStorage, sizeof(transmitStorage), receiveStorage, sizeof(receiveStorage));
+    twi.setReplyBuffer(replyStorage, sizeof(replyStorage));
+    twi.configure(TWIMode::Slave, 0x14, 72, PrescalerValue::PRESCALE_VALUE_1);
+    const uint8_t command[2] = {0xC1, 0xC2};
+    const uint8_t answer[2] = {0xA1, 0xA2};
+    EXPECT(VirtualBus::masterWrite(0x14, command, sizeof(command)) == sizeof(command));
+    EXPECT(twi.sendMessage(answer, sizeof(answer)));
+    VirtualBus::holdSDA(5);
+    EXPECT(transfer(0x24, TWIDirection::Write, data, sizeof(data)) == TWIResult::Timeout);
+    uint8_t message[4] = {0};
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == sizeof(command));
+    EXPECT(memcmp(message, command, sizeof(command)) == 0);
+    EXPECT(VirtualBus::masterRead(0x14, message, sizeof(answer)) == sizeof(answer));
+    EXPECT(memcmp(message, answer, sizeof(answer)) == 0);
+    twi.setReplyBuffer(nullptr, 0);
+    twi.setBuffers(nullptr, 0, nullptr, 0);
+}
+
+static void multiMaster()
+{
+    MemorySlave device(0x28, 16);
+    VirtualBus::reset();
+    sei();
+    twi.TWISetMode(TWIMode::Slave, 0x41, PrescalerValue::PRESCALE_VALUE_1, 100000);
+    VirtualBus::attach(device);
+    uint64_t start = mark();
+
+    // Lost arbitration is retried after a backoff, the transaction reports its retries
+    uint8_t data[3] = {0x02, 0x12, 0x34};
+    TWITransaction transaction = {};
+    transaction.address = 0x28;
+    transaction.direction = TWIDirection::Write;
+    transaction.data = data;
+    transaction.length = sizeof(data);
+    VirtualBus::loseArbitration(2);
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::Success);
+    EXPECT(transaction.retries == 2);
+    EXPECT(device.memory()[3] == 0x34);
+
+    // The master that won addresses the driver: it is served as slave and the transaction restarts afterwards
+    data[2] = 0x56;
+    VirtualBus::loseArbitrationTo(0xEE);
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::Success);
+    EXPECT(transaction.retries == 1);
+    EXPECT(device.memory()[3] == 0x56);
+    uint8_t message[4] = {0};
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == 1);
+    EXPECT(message[0] == 0xEE);
+
+    // A stopped TWI_TIMER does not block the restart, the backoff is counted in polls
+    data[2] = 0x78;
+    VirtualBus::stopTimer1(true);
+    VirtualBus::loseArbitration(1);
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::Success);
+    EXPECT(transaction.retries == 1);
+    EXPECT(device.memory()[3] == 0x78);
+    VirtualBus::stopTimer1(false);
+
+    // The master that won keeps the bus beyond the timeout: the restart gives up without driving the lines
+    uint32_t recoveryClocks = VirtualBus::counters().recoveryClocks;
+    VirtualBus::loseArbitration(1);
+    VirtualBus::keepBusAfterArbitration(15000000);
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::ArbitrationLost);
+    EXPECT(transaction.retries == 1);
+    EXPECT(VirtualBus::counters().recoveryClocks == recoveryClocks);
+    VirtualBus::elapse(5000000);
+
+    // Another master keeps the bus beyond the timeout before the first attempt: it times out without a recovery
+    uint32_t portStops = VirtualBus::counters().portStops;
+    VirtualBus::occupyBus(15000000);
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::Timeout);
+    EXPECT(transaction.retries == 0);
+    EXPECT(VirtualBus::counters().recoveryClocks == recoveryClocks);
+    EXPECT(VirtualBus::counters().portStops == portStops);
+    data[2] = 0x9A;
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::Success);
+    EXPECT(device.memory()[3] == 0x9A);
+
+    // Bounded retries
+    VirtualBus::loseArbitration(TWI_ARBITRATION_RETRIES + 1);
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::ArbitrationLost);
+    EXPECT(transaction.retries == TWI_ARBITRATION_RETRIES);
+
+    // Still listening to the own address after the master transactions
+    EXPECT(VirtualBus::masterWrite(0x41, data, 2) == 2);
+
+    // A status code without a handler still clears TWINT, so SCL is not held low and the own address is served
+    VirtualBus::raiseStatus(0xD0);
+    EXPECT(!(VirtualBus::readControl() & (1 << TWINT)));
+    EXPECT(VirtualBus::masterWrite(0x41, data, 2) == 2);
+    report("multi-master, 9 arbitration losses", 9, start);
+}
+
+static void scatterGather()
+{
+    MemorySlave device(0x2A, 256, 2);
+    setupMaster(400000);
+    VirtualBus::attach(device);
+    uint64_t start = mark();
+
+    // 16 bit register address, header and payload from separate buffers in one write
+    uint8_t reg[2] = {0x00, 0x10};
+    uint8_t header[2] = {0xCA, 0xFE};
+    uint8_t payload[4] = {1, 2, 3, 4};
+    uint8_t empty[1] = {0};
+    const TWISegment write[] = {
+        {reg, sizeof(reg), TWIDirection::Write, false},
+        {header, sizeof(header), TWIDirection::Write, false},
+        {empty, 0, TWIDirection::Write, false},
+        {payload, sizeof(payload), TWIDirection::Write, false},
+    };
+    uint32_t starts = VirtualBus::counters().starts;
+    EXPECT(twi.transferSegments(0x2A, write, 4) == TWIResult::Success);
+    EXPECT(VirtualBus::counters().starts - starts == 1);
+    EXPECT((device.memory()[0x10] == 0xCA) && (device.memory()[0x11] == 0xFE));
+    EXPECT((device.memory()[0x12] == 1) && (device.memory()[0x15] == 4));
+
+    // Register address, repeated START, then one read scattered into two buffers
+    uint8_t readHeader[2] = {0};
+    uint8_t readPayload[4] = {0};
+    const TWISegment read[] = {
+        {reg, sizeof(reg), TWIDirection::Write, false},
+        {readHeader, sizeof(readHeader), TWIDirection::Read, false},
+        {readPayload, sizeof(readPayload), TWIDirection::Read, false},
+    };
+    starts = VirtualBus::counters().starts;
+    EXPECT(twi.transferSegments(0x2A, read, 3) == TWIResult::Success);
+    EXPECT(VirtualBus::counters().starts - starts == 2);
+    EXPECT(memcmp(readHeader, header, sizeof(header)) == 0);
+    EXPECT(memcmp(readPayload, payload, sizeof(payload)) == 0);
+
+    // Explicit repeated START between two reads
+    const TWISegment reads[] = {
+        {reg, sizeof(reg), TWIDirection::Write, false},
+        {readHeader, 1, TWIDirection::Read, false},
+        {readPayload, 1, TWIDirection::Read, true},
+    };
+    starts = VirtualBus::counters().starts;
+    EXPECT(twi.transferSegments(0x2A, reads, 3) == TWIResult::Success);
+    EXPECT(VirtualBus::counters().starts - starts == 3);
+    EXPECT((readHeader[0] == 0xCA) && (readPayload[0] == 0xFE));
+    report("scatter-gather 8 + 6 + 2", 16, start);
+}
+
+static void speedProfiles()
+{
+    MemorySlave eeprom(0x50, 64);
+    MemorySlave sensor(0x68, 64);
+    eeprom.limitFrequency(100000);
+    setupMaster(100000);
+    VirtualBus::attach(eeprom);
+    VirtualBus::attach(sensor);
+    uint8_t data[17] = {0};
+
+    // Without profiles every device runs at the bus speed of TWISetMode()
+    uint64_t start = mark();
+    EXPECT(transfer(0x68, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    uint64_t slow = VirtualBus::now() - start;
+    report("write 16 to sensor @100k", 16, start);
+
+    static TWIDeviceProfile devices[] = {TWI::deviceProfile(0x50, 100000), TWI::deviceProfile(0x68, 400000)};
+    static_assert(TWI::deviceProfile(0x68, 400000).bitRate == 12, "400 kHz needs TWBR 12 at 16 MHz");
+    twi.setDeviceProfiles(devices, 2);
+    start = mark();
+    EXPECT(transfer(0x68, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(VirtualBus::now() - start < slow / 2);
+    report("write 16 to sensor @400k profile", 16, start);
+
+    // TWBR is only written when the speed changes
+    uint32_t writes = VirtualBus::counters().bitRateWrites;
+    EXPECT(transfer(0x68, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(VirtualBus::counters().bitRateWrites == writes);
+    EXPECT(transfer(0x50, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(transfer(0x50, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(transfer(0x68, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(VirtualBus::counters().bitRateWrites - writes == 2);
+
+    // The EEPROM misses its address at 400 kHz, the probe steps down to 100 kHz
+    TWIDeviceProfile probed = TWI::deviceProfile(0x50, 400000);
+    EXPECT(twi.probeSpeed(probed) == 100000);
+    EXPECT(probed.bitRate == devices[0].bitRate);
+    EXPECT(twi.probeSpeed(devices[1]) == 400000);
+    TWIDeviceProfile absent = TWI::deviceProfile(0x51, 400000);
+    EXPECT(twi.probeSpeed(absent, 2) == 0);
+    EXPECT(absent.bitRate == 12);
+    twi.setDeviceProfiles(nullptr, 0);
+}
+
+/** Lets the bus run until the next timer tick **/
+static void runUntil(uint64_t ns)
+{
+    while (VirtualBus::now() < ns) {
+        VirtualBus::idle();
+    }
+}
+
+static void pollScheduler()
+{
+    MemorySlave accel(0x19, 64);
+    MemorySlave gyro(0x6B, 64);
+    MemorySlave pressure(0x77, 256);
+    for (uint8_t index = 0; index < 64; index++) {
+        accel.memory()[index] = index;
+        gyro.memory()[index] = static_cast<uint8_t>(0x80 + index);
+    }
+    pressure.memory()[0xF7] = 0x5A;
+    setupMaster(400000);
+    VirtualBus::attach(accel);
+    VirtualBus::attach(gyro);
+    VirtualBus::attach(pressure);
+
+    static uint8_t accelData[6];
+    static uint8_t gyroData[6];
+    static uint8_t pressureData[3];
+    static uint8_t missingData[2];
+    static TWIPollJob jobs[] = {
+        {0x19, TWIRegisterSize::Byte, 0x28, accelData, 6, 1},
+        {0x6B, TWIRegisterSize::Byte, 0x22, gyroData, 6, 2},
+        {0x77, TWIRegisterSize::Byte, 0xF7, pressureData, 3, 5},
+        {0x42, TWIRegisterSize::Byte, 0x00, missingData, 2, 5},
+    };
+    TWIScheduler scheduler;
+    uint8_t snapshot[6] = {0};
+    EXPECT(!scheduler.read(jobs[0], snapshot));
+
+    // 1 ms timer tick for 20 ms, the main loop does nothing but wait
+    uint64_t start = mark();
+    scheduler.start(jobs, 4);
+    for (uint8_t tick = 0; tick < 20; tick++) {
+        scheduler.tick();
+        runUntil(start + (tick + 1) * 1000000ULL);
+    }
+    scheduler.stop();
+    VirtualBus::run();
+    report("poll 4 jobs for 20 ms @400k", 20 * 6 + 10 * 6 + 4 * 3, start);
+
+    uint8_t sequence = 0;
+    EXPECT(scheduler.read(jobs[0], snapshot, &sequence));
+    EXPECT((sequence == 40) && (snapshot[0] == 0x28) && (snapshot[5] == 0x2D));
+    EXPECT(scheduler.read(jobs[1], snapshot, &sequence));
+    EXPECT((sequence == 20) && (snapshot[0] == 0xA2));
+    EXPECT(scheduler.read(jobs[2], snapshot, &sequence));
+    EXPECT((sequence == 8) && (snapshot[0] == 0x5A));
+    EXPECT(!scheduler.read(jobs[3], snapshot));
+    EXPECT((jobs[3].errors == 4) && (jobs[3].lastResult == TWIResult::AddressNack));
+    EXPECT((jobs[0].overruns == 0) && (jobs[0].errors == 0));
+
+    // The snapshot stays readable while the next read is on the bus
+    scheduler.start(jobs, 1);
+    scheduler.tick();
+    VirtualBus::run();
+    EXPECT(scheduler.read(jobs[0], snapshot, &sequence) && (sequence == 2));
+    accel.memory()[0x28] = 0x99;
+    scheduler.tick();
+    VirtualBus::step();
+    VirtualBus::step();
+    EXPECT(scheduler.read(jobs[0], snapshot, &sequence) && (sequence == 2) && (snapshot[0] == 0x28));
+    // A tick shorter than the read skips a period
+    scheduler.tick();
+    EXPECT(jobs[0].overruns == 1);
+    scheduler.stop();
+    VirtualBus::run();
+    EXPECT(scheduler.read(jobs[0], snapshot, &sequence) && (sequence == 4) && (snapshot[0] == 0x99));
+    accel.memory()[0x28] = 0x28;
+
+    // A read that does not fit into the queue leaves the sequence alone, it is retried on the next tick
+    TWITransaction fillers[TWI_QUEUE_SIZE - 1] = {};
+    for (TWITransaction &filler : fillers) {
+        filler.address = 0x19;
+        filler.direction = TWIDirection::Read;
+        filler.data = snapshot;
+        filler.length = 1;
+        EXPECT(twi.submit(filler));
+    }
+    scheduler.start(jobs, 1);
+    scheduler.tick();
+    EXPECT((jobs[0].sequence == 0) && (jobs[0].transaction.result != TWIResult::Pending));
+    VirtualBus::run();
+    scheduler.tick();
+    scheduler.stop();
+    VirtualBus::run();
+    EXPECT(scheduler.read(jobs[0], snapshot, &sequence) && (sequence == 2));
+
+    // Jobs longer than TWI_POLL_LENGTH are refused
+    static uint8_t longData[TWI_POLL_LENGTH + 1];
+    static TWIPollJob longJob[] = {{0x19, TWIRegisterSize::Byte, 0x00, longData, TWI_POLL_LENGTH + 1, 1}};
+    scheduler.start(longJob, 1);
+    scheduler.tick();
+    scheduler.stop();
+    EXPECT((longJob[0].lastResult == TWIResult::OutOfRange) && (longJob[0].transaction.result == TWIResult::Idle));
+
+    // A hung read times out from the ticks and a main loop that only calls service(), the following reads run again
+    scheduler.start(jobs, 1);
+    VirtualBus::holdSDA(5);
+    start = VirtualBus::now();
+    for (uint8_t tick = 0; tick < 20; tick++) {
+        scheduler.tick();
+        runUntil(start + (tick + 1) * 1000000ULL);
+        scheduler.service();
+    }
+    scheduler.stop();
+    VirtualBus::run();
+    EXPECT((jobs[0].errors == 1) && (jobs[0].overruns > 0) && (jobs[0].lastResult == TWIResult::Success));
+}
+
+static uint8_t readyCallbacks = 0;
+static uint64_t readyDoneNs = 0;
+
+static void readyDone(TWIReadyPoll *poll)
+{
+    (void) poll;
+    readyCallbacks++;
+    readyDoneNs = VirtualBus::now();
+}
+
+static void readyPolling()
+{
+    MemorySlave magnetometer(0x1E, 16);
+    for (uint8_t index = 0; index < 6; index++) {
+        magnetometer.memory()[0x03 + index] = static_cast<uint8_t>(0xA0 + index);
+    }
+    setupMaster(400000);
+    VirtualBus::attach(magnetometer);
+    TWIScheduler scheduler;
+    readyCallbacks = 0;
+
+    // Data ready bit set after 6.5 ms, status polled every 1 ms tick
+    static uint8_t sample[6];
+    static TWIReadyPoll ready = {0x1E, TWIRegisterSize::Byte, 0x09, 0x01, 0x01, 1, 50, 0x03, sample, 6, readyDone};
+    uint64_t start = mark();
+    EXPECT(scheduler.pollUntil(ready));
+    EXPECT(!scheduler.pollUntil(ready));
+    uint64_t readyNs = 0;
+    for (uint8_t tick = 0; (tick < 20) && (ready.result == TWIResult::Pending); tick++) {
+        if (tick == 6) {
+            runUntil(start + 6500000ULL);
+            magnetometer.memory()[0x09] = 0x01;
+            readyNs = VirtualBus::now();
+        }
+        runUntil(start + (tick + 1) * 1000000ULL);
+        scheduler.tick();
+        VirtualBus::run();
+    }
+    report("ready poll, 6 B after 6.5 ms @400k", 6, start);
+    EXPECT((ready.result == TWIResult::Success) && (readyCallbacks == 1));
+    EXPECT((ready.tries == 8) && (sample[0] == 0xA0) && (sample[5] == 0xA5));
+    // Status read and data read back-to-back on the first tick after the bit was set
+    EXPECT(readyDoneNs - readyNs < 1000000ULL);
+    EXPECT(readyDoneNs - (start + 7000000ULL) < 400000ULL);
+
+    // Never ready: the poll gives up after maxTries status reads
+    magnetometer.memory()[0x09] = 0x00;
+    ready.interval = 2;
+    ready.maxTries = 3;
+    EXPECT(scheduler.pollUntil(ready));
+    for (uint8_t tick = 0; tick < 10; tick++) {
+        scheduler.tick();
+        VirtualBus::run();
+    }
+    EXPECT((ready.result == TWIResult::Timeout) && (ready.tries == 3) && (readyCallbacks == 2));
+
+    // Interval 0 polls back-to-back from the interrupt, a missing device counts as not ready
+    static TWIReadyPoll missing = {0x42, TWIRegisterSize::Byte, 0x00, 0x80, 0x00, 0, 4, 0x01, sample, 2, readyDone};
+    EXPECT(scheduler.pollUntil(missing));
+    VirtualBus::run();
+    EXPECT((missing.result == TWIResult::Timeout) && (missing.tries == 4) && (readyCallbacks == 3));
+
+    // Without data registers the poll ends with the matching status read
+    magnetometer.memory()[0x09] = 0x01;
+    static TWIReadyPoll conversion = {0x1E, TWIRegisterSize::Byte, 0x09, 0x01, 0x01, 0, 0, 0, nullptr, 0, nullptr};
+    EXPECT(scheduler.pollUntil(conversion));
+    VirtualBus::run();
+    EXPECT((conversion.result == TWIResult::Success) && (conversion.tries == 1));
+    scheduler.tick();
+}
+
+static uint32_t yields = 0;
+
+static void countYield()
+{
+    yields++;
+    VirtualBus::idle();
+}
+
+static void waitModes()
+{
+    MemorySlave device(0x3C, 64);
+    setupMaster(100000);
+    VirtualBus::attach(device);
+    uint8_t data[9] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+
+    // Every wake-up is a TWI interrupt, the CPU does not poll in between
+    twi.setWaitMode(TWIWaitMode::Sleep);
+    uint32_t sleeps = VirtualBus::counters().sleeps;
+    uint64_t start = mark();
+    EXPECT(twi.writeRegister(0x3C, 0x10, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(VirtualBus::counters().sleeps - sleeps == VirtualBus::counters().interrupts - interruptsAtStart);
+    EXPECT(device.memory()[0x18] == 8);
+    report("write 9 @100k, idle sleep", 9, start);
+
+    // Queue full: the submitting loop sleeps as well
+    TWITransaction queued[TWI_QUEUE_SIZE] = {};
+    uint8_t count = 0;
+    for (TWITransaction &transaction : queued) {
+        transaction.address = 0x3C;
+        transaction.direction = TWIDirection::Write;
+        transaction.data = data;
+        transaction.length = sizeof(data);
+        if (twi.submit(transaction)) {
+            count++;
+        }
+    }
+    EXPECT(count == TWI_QUEUE_SIZE - 1);
+    sleeps = VirtualBus::counters().sleeps;
+    twi.Write(0x3C, data, 4);
+    EXPECT(VirtualBus::counters().sleeps - sleeps > 0);
+    EXPECT(queued[0].result == TWIResult::Success);
+    for (TWITransaction &transaction : queued) {
+        twi.wait(transaction);
+    }
+    VirtualBus::run();
+
+    // Per call, independent of the mode set
+    TWITransaction transaction = {};
+    transaction.address = 0x3C;
+    transaction.direction = TWIDirection::Read;
+    transaction.data = data;
+    transaction.length = 4;
+    twi.setWaitMode(TWIWaitMode::Yield, countYield);
+    twi.submit(transaction);
+    EXPECT(twi.wait(transaction) == TWIResult::Success);
+    EXPECT(yields > 0);
+    sleeps = VirtualBus::counters().sleeps;
+    twi.submit(transaction);
+    EXPECT(twi.wait(transaction, TWIWaitMode::Sleep) == TWIResult::Success);
+    EXPECT(VirtualBus::counters().sleeps - sleeps == 6);
+    twi.setWaitMode(TWIWaitMode::Spin);
+}
+
+static void flashWrites()
+{
+    // Display initialisation longer than the transmission buffer, register address 0x0000 ahead of the data
+    static uint8_t init[2 + 300];
+    for (uint16_t index = 2; index < sizeof(init); index++) {
+        init[index] = static_cast<uint8_t>(index * 7);
+    }
+    MemorySlave display(0x3C, 512, 2);
+    setupMaster(400000);
+    VirtualBus::attach(display);
+
+    uint64_t start = mark();
+    EXPECT(twi.WriteP(0x3C, init, sizeof(init)) == TWIResult::Success);
+    EXPECT((display.memory()[0] == init[2]) && (display.memory()[299] == init[301]));
+    report("WriteP 300 from flash @400k", 300, start);
+
+    EXPECT(twi.writeRegisterP(0x3C, 0x0100, init + 2, 16, TWIRegisterSize::Word) == TWIResult::Success);
+    EXPECT(memcmp(display.memory() + 0x100, init + 2, 16) == 0);
+    EXPECT(twi.WriteFarP(0x3C, reinterpret_cast<uintptr_t>(init), 3) == TWIResult::Success);
+    EXPECT(display.getPointer() == 1);
+}
+
+static void registerCache()
+{
+    // IMU: configuration registers 0x19-0x1C, 0x37-0x38 and 0x6B, sample registers from 0x3B
+    MemorySlave imu(0x68, 0x80);
+    imu.memory()[0x3B] = 0x12;
+    setupMaster(400000);
+    VirtualBus::attach(imu);
+    static uint8_t shadow[0x80];
+    static uint8_t flags[TWI_CACHE_FLAG_BYTES(0x80)];
+    TWIRegisterCache cache(0x68, shadow, flags, 0x80);
+    cache.setCacheable(0x19, 4);
+    cache.setCacheable(0x37, 2);
+    cache.setCacheable(0x6B, 1);
+
+    // The configuration code runs twice, the second run does not touch the bus
+    const uint8_t rates[] = {0x07, 0x03, 0x18, 0x10};
+    const uint8_t power[] = {0x01};
+    const uint8_t pins[] = {0x02, 0x01};
+    uint64_t start = mark();
+    for (uint8_t run = 0; run < 2; run++) {
+        EXPECT(cache.write(0x19, rates, sizeof(rates)) == TWIResult::Success);
+        EXPECT(cache.write(0x6B, power, sizeof(power)) == TWIResult::Success);
+        EXPECT(cache.write(0x37, pins, sizeof(pins)) == TWIResult::Success);
+    }
+    report("register cache, configuration x2", 2 * 7, start);
+    EXPECT((imu.getWrites() == 3) && (cache.getSkipped() == 7));
+    EXPECT((imu.memory()[0x1A] == 0x03) && (imu.memory()[0x38] == 0x01));
+
+    // Only the changed register is written
+    uint32_t bytes = VirtualBus::counters().bytes;
+    const uint8_t faster[] = {0x07, 0x04, 0x18, 0x10};
+    EXPECT(cache.write(0x19, faster, sizeof(faster)) == TWIResult::Success);
+    EXPECT((VirtualBus::counters().bytes - bytes == 3) && (imu.memory()[0x1A] == 0x04));
+
+    // Configuration reads come from the shadow, sample reads from the device
+    uint8_t value[4];
+    bytes = VirtualBus::counters().bytes;
+    EXPECT((cache.read(0x19, value, 4) == TWIResult::Success) && (value[1] == 0x04));
+    EXPECT((VirtualBus::counters().bytes == bytes) && (cache.getHits() == 4));
+    EXPECT((cache.read(0x3B, value, 2) == TWIResult::Success) && (value[0] == 0x12));
+    EXPECT(VirtualBus::counters().bytes - bytes == 5);
+    EXPECT(cache.read(0x7F, value, 2) == TWIResult::OutOfRange);
+
+    // Staged registers: 0x19 and 0x1B are joined over the known 0x1A, 0x6B holds the value already
+    const uint8_t divider[] = {0x09};
+    const uint8_t range[] = {0x08};
+    const uint8_t interrupt[] = {0x12};
+    EXPECT(cache.stage(0x19, divider, 1) == TWIResult::Success);
+    EXPECT(cache.stage(0x1B, range, 1) == TWIResult::Success);
+    EXPECT(cache.stage(0x37, interrupt, 1) == TWIResult::Success);
+    EXPECT(cache.stage(0x6B, power, 1) == TWIResult::Success);
+    EXPECT((cache.read(0x19, value, 4) == TWIResult::Success) && (value[0] == 0x09) && (value[2] == 0x08));
+    EXPECT(imu.memory()[0x19] == 0x07);
+    uint32_t writes = imu.getWrites();
+    EXPECT(cache.flush() == TWIResult::Success);
+    EXPECT(imu.getWrites() - writes == 2);
+    EXPECT((imu.memory()[0x19] == 0x09) && (imu.memory()[0x1A] == 0x04) && (imu.memory()[0x1B] == 0x08));
+    EXPECT((imu.memory()[0x1C] == 0x10) && (imu.memory()[0x37] == 0x12));
+    EXPECT(cache.flush() == TWIResult::Success);
+    EXPECT(imu.getWrites() - writes == 2);
+
+    // After a reset of the device the values are read again
+    imu.memory()[0x1A] = 0x00;
+    cache.invalidate();
+    EXPECT((cache.read(0x19, value, 4) == TWIResult::Success) && (value[1] == 0x00));
+}
+
+static TWISoftBus *timerBus = nullptr;
+
+/** Timer interrupt clocking the software bus **/
+static void softBusTick()
+{
+    timerBus->tick();
+}
+
+static void multipleBuses()
+{
+    // Two sensors with the same address, one on the TWI and one on a software bus ticked at 400 kHz (200 kHz SCL)
+    MemorySlave left(0x48, 256);
+    MemorySlave right(0x48, 256);
+    setupMaster(400000);
+    VirtualBus::attach(left);
+    VirtualWire wire;
+    wire.attach(right);
+    TWISoftBus soft({&wire, VirtualWire::Line::SCL}, {&wire, VirtualWire::Line::SDA});
+    timerBus = &soft;
+    VirtualBus::setTimer(2500, softBusTick);
+    TWIBus &hardware = TWIHardwareBus::instance();
+
+    static uint8_t block[1 + 128];
+    for (uint16_t index = 0; index < sizeof(block); index++) {
+        block[index] = static_cast<uint8_t>(index * 3);
+    }
+    block[0] = 0x00;
+
+    // One after the other
+    uint64_t start = mark();
+    EXPECT(hardware.write(0x48, block, sizeof(block)) == TWIResult::Success);
+    uint64_t hardwareNs = VirtualBus::now() - start;
+    report("TWI write 128 B @400k", 128, start);
+    start = mark();
+    EXPECT(soft.write(0x48, block, 1 + 64) == TWIResult::Success);
+    uint64_t softNs = VirtualBus::now() - start;
+    report("software bus write 64 B @200k", 64, start);
+    EXPECT((memcmp(left.memory(), &block[1], 128) == 0) && (memcmp(right.memory(), &block[1], 64) == 0));
+    EXPECT((wire.counters().starts == 1) && (wire.counters().stops == 1) && (wire.counters().bytes == 1 + 1 + 64));
+
+    // Both buses at the same time
+    memset(left.memory(), 0, 256);
+    memset(right.memory(), 0, 256);
+    TWITransaction first = {};
+    first.address = 0x48;
+    first.direction = TWIDirection::Write;
+    first.data = block;
+    first.length = sizeof(block);
+    TWITransaction second = first;
+    second.length = 1 + 64;
+    start = mark();
+    EXPECT(hardware.submit(first) && soft.submit(second));
+    EXPECT((hardware.wait(first) == TWIResult::Success) && (soft.wait(second) == TWIResult::Success));
+    uint64_t bothNs = VirtualBus::now() - start;
+    report("TWI 128 B + software bus 64 B at once", 128 + 64, start);
+    EXPECT((memcmp(left.memory(), &block[1], 128) == 0) && (memcmp(right.memory(), &block[1], 64) == 0));
+    EXPECT(bothNs * 10 < (hardwareNs + softNs) * 6);
+
+    // Register reads, a repeated START between two transactions and a missing device
+    uint8_t value[4] = {0};
+    EXPECT((soft.readRegister(0x48, 0x10, value, 4) == TWIResult::Success) && (value[0] == block[0x11]));
+    EXPECT((value[3] == block[0x14]) && (right.getPointer() == 0x14));
+    EXPECT(soft.read(0x48, value, 2) == TWIResult::Success);
+    EXPECT((value[0] == block[0x15]) && (value[1] == block[0x16]));
+    uint32_t starts = wire.counters().starts;
+    uint32_t stops = wire.counters().stops;
+    TWITransaction pointer = {};
+    pointer.address = 0x48;
+    pointer.direction = TWIDirection::Write;
+    pointer.data = block;
+    pointer.length = 1;
+    pointer.repeatedStart = true;
+    TWITransaction contents = {};
+    contents.address = 0x48;
+    contents.direction = TWIDirection::Read;
+    contents.data = value;
+    contents.length = 3;
+    EXPECT(soft.submit(pointer) && soft.submit(contents));
+    EXPECT(soft.wait(contents) == TWIResult::Success);
+    EXPECT((value[0] == block[1]) && (value[2] == block[3]) && (pointer.result == TWIResult::Success));
+    EXPECT((wire.counters().starts - starts == 2) && (wire.counters().stops - stops == 1));
+    EXPECT(soft.readRegister(0x21, 0x00, value, 1) == TWIResult::AddressNack);
+    TWITransaction segmented = {};
+    TWISegment segment = {value, 1, TWIDirection::Write, false};
+    segmented.segments = &segment;
+    segmented.segmentCount = 1;
+    EXPECT(!soft.supports(segmented) && !soft.submit(segmented));
+    EXPECT(soft.transfer(segmented) == TWIResult::Unsupported);
+    EXPECT(soft.read(0x48, value, 0) == TWIResult::Unsupported);
+    EXPECT(soft.write(0x48, nullptr, 0) == TWIResult::Success);
+
+    // Waiting follows the wait mode of the TWI, a sleeping CPU is woken by the ticks
+    yields = 0;
+    twi.setWaitMode(TWIWaitMode::Yield, countYield);
+    EXPECT((soft.readRegister(0x48, 0x10, value, 2) == TWIResult::Success) && (yields > 0));
+    twi.setWaitMode(TWIWaitMode::Sleep);
+    uint32_t sleeps = VirtualBus::counters().sleeps;
+    EXPECT(soft.readRegister(0x48, 0x10, value, 2) == TWIResult::Success);
+    EXPECT(VirtualBus::counters().sleeps - sleeps > 0);
+    twi.setWaitMode(TWIWaitMode::Spin);
+
+    // A slave stretching the clock slows the software bus down, a hung one times out
+    right.stretch(20000);
+    start = mark();
+    EXPECT(soft.writeRegister(0x48, 0x40, &block[1], 16) == TWIResult::Success);
+    EXPECT((VirtualBus::now() - start > 17 * 20000) && (right.memory()[0x4F] == block[16]));
+    right.stretch(3000000);
+    EXPECT(soft.writeRegister(0x48, 0x40, &block[1], 1) == TWIResult::Timeout);
+    runUntil(VirtualBus::now() + 3000000);
+    // Held after the last byte, the STOP cannot be sent
+    EXPECT(soft.write(0x48, nullptr, 0) == TWIResult::Timeout);
+    right.stretch(0);
+    EXPECT(soft.isIdle());
+    runUntil(VirtualBus::now() + 3000000);
+
+    // The device drivers run on the software bus
+    EepromSlave eeprom(0x50, 4096, 32, 1000000, 2);
+    wire.attach(eeprom);
+    TWIEeprom storage(0x50, 4096, 32, TWIRegisterSize::Word, 1, soft);
+    uint8_t readBack[100];
+    EXPECT(storage.write(0x1F0, block, sizeof(readBack)) == TWIResult::Success);
+    EXPECT(storage.read(0x1F0, readBack, sizeof(readBack)) == TWIResult::Success);
+    EXPECT((memcmp(readBack, block, sizeof(readBack)) == 0) && (eeprom.getBusyNacks() > 0));
+    static uint8_t shadow[0x20];
+    static uint8_t flags[TWI_CACHE_FLAG_BYTES(0x20)];
+    TWIRegisterCache cache(0x48, shadow, flags, 0x20, TWIRegisterSize::Byte, soft);
+    cache.setCacheable(0x00, 0x20);
+    EXPECT(cache.write(0x18, &block[1], 4) == TWIResult::Success);
+    uint32_t bytes = wire.counters().bytes;
+    EXPECT(cache.write(0x18, &block[1], 4) == TWIResult::Success);
+    EXPECT((wire.counters().bytes == bytes) && (right.memory()[0x1B] == block[4]));
+
+    VirtualBus::setTimer(0, nullptr);
+    timerBus = nullptr;
+}
+
+static void eepromStorage()
+{
+    // 24C256: 64 byte pages, the write cycle takes 3 ms of the 5 ms of the data sheet
+    EepromSlave eeprom(0x50, 32768, 64, 3000000);
+    setupMaster(400000);
+    VirtualBus::attach(eeprom);
+    static uint8_t record[1024];
+    static uint8_t readBack[1024];
+    for (uint16_t index = 0; index < sizeof(record); index++) {
+        record[index] = static_cast<uint8_t>(index ^ (index >> 8));
+    }
+
+    // Former logging loop: page aligned chunks through the transmission buffer, each followed by a fixed 5 ms delay
+    uint64_t start = mark();
+    uint8_t chunk[18];
+    for (uint16_t offset = 0; offset < sizeof(record); offset += 16) {
+        chunk[0] = static_cast<uint8_t>(offset >> 8);
+        chunk[1] = static_cast<uint8_t>(offset);
+        memcpy(chunk + 2, record + offset, 16);
+        twi.Write(0x50, static_cast<const uint8_t *>(chunk), sizeof(chunk));
+        runUntil(VirtualBus::now() + 5000000);
+    }
+    uint64_t buffered = VirtualBus::now() - start;
+    report("EEPROM write 1024, 16 B + 5 ms delay", 1024, start);
+    EXPECT(memcmp(eeprom.memory(), record, sizeof(record)) == 0);
+
+    TWIEeprom storage(0x50, 32768, 64);
+    start = mark();
+    EXPECT(storage.write(0x1000, record, sizeof(record)) == TWIResult::Success);
+    EXPECT(storage.sync() == TWIResult::Success);
+    uint64_t paged = VirtualBus::now() - start;
+    report("EEPROM write 1024, pages + ACK polling", 1024, start);
+    EXPECT(paged * 4 < buffered);
+    EXPECT(memcmp(eeprom.memory() + 0x1000, record, sizeof(record)) == 0);
+    EXPECT(storage.getPolls() > 16);
+
+    start = mark();
+    EXPECT(storage.read(0x1000, readBack, sizeof(readBack)) == TWIResult::Success);
+    report("EEPROM sequential read 1024", 1024, start);
+    EXPECT(memcmp(readBack, record, sizeof(record)) == 0);
+
+    // Unaligned write across a page boundary, the read waits for the write cycle
+    EXPECT(storage.write(0x203C, record, 10) == TWIResult::Success);
+    EXPECT(storage.read(0x203C, readBack, 10) == TWIResult::Success);
+    EXPECT(memcmp(readBack, record, 10) == 0);
+    EXPECT(storage.write(32760, record, 16) == TWIResult::OutOfRange);
+
+    // 24C16 style: 8 bit addresses, the block is selected by the slave address
+    EepromSlave block0(0x54, 256, 16, 3000000, 1);
+    EepromSlave block1(0x55, 256, 16, 3000000, 1);
+    VirtualBus::attach(block0);
+    VirtualBus::attach(block1);
+    TWIEeprom blocks(0x54, 256, 16, TWIRegisterSize::Byte, 2);
+    EXPECT(blocks.write(240, record, 40) == TWIResult::Success);
+    EXPECT((block0.memory()[255] == record[15]) && (block1.memory()[23] == record[39]));
+    EXPECT(blocks.read(240, readBack, 40) == TWIResult::Success);
+    EXPECT(memcmp(readBack, record, 40) == 0);
+    // The write cycles of at most 8 chips are tracked, more are not addressed
+    TWIEeprom tooMany(0x50, 256, 16, TWIRegisterSize::Byte, 12);
+    EXPECT(tooMany.size() == TWIEeprom::MAX_CHIPS * 256);
+
+    // FRAM: no pages and no write cycle, one transaction
+    MemorySlave fram(0x57, 8192, 2);
+    VirtualBus::attach(fram);
+    TWIEeprom framStorage(0x57, 8192, 0);
+    uint32_t starts = VirtualBus::counters().starts;
+    start = mark();
+    EXPECT(framStorage.write(100, record, sizeof(record)) == TWIResult::Success);
+    report("FRAM write 1024", 1024, start);
+    EXPECT(VirtualBus::counters().starts - starts == 1);
+    EXPECT(memcmp(fram.memory() + 100, record, sizeof(record)) == 0);
+    EXPECT(framStorage.getPolls() == 0);
+}
+
+static void clockStretching()
+{
+    MemorySlave device(0x30, 64);
+    setupMaster(400000);
+    VirtualBus::attach(device);
+    uint8_t data[33] = {0};
+    for (uint8_t index = 1; index < sizeof(data); index++) {
+        data[index] = index;
+    }
+
+    uint64_t start = mark();
+    EXPECT(transfer(0x30, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    uint64_t plain = VirtualBus::now() - start;
+    report("bulk write 32 @400k", 32, start);
+
+    device.stretch(10000);
+    start = mark();
+    EXPECT(transfer(0x30, TWIDirection::Write, data, sizeof(data)) == TWIResult::Success);
+    EXPECT(VirtualBus::now() - start > plain + 32 * 10000);
+    EXPECT(device.memory()[31] == 32);
+    report("bulk write 32 @400k, 10 us stretch", 32, start);
+}
+
+static void bulkTransfers()
+{
+    MemorySlave display(0x3C, 2048, 2);
+    setupMaster(400000);
+    VirtualBus::attach(display);
+
+    // Two address bytes followed by the framebuffer, sent without staging copies
+    static uint8_t framebuffer[2 + 1024];
+    framebuffer[0] = 0x01;
+    framebuffer[1] = 0x00;
+    for (uint16_t index = 2; index < sizeof(framebuffer); index++) {
+        framebuffer[index] = static_cast<uint8_t>(index * 7);
+    }
+
+    uint64_t start = mark();
+    EXPECT(twi.WriteDirect(0x3C, framebuffer, sizeof(framebuffer)) == TWIResult::Success);
+    EXPECT(memcmp(&display.memory()[0x100], &framebuffer[2], 1024) == 0);
+    report("zero-copy write 1024 @400k", 1024, start);
+
+    static uint8_t readback[1024];
+    start = mark();
+    EXPECT(twi.WriteDirect(0x3C, framebuffer, 2, true) == TWIResult::Success);
+    EXPECT(twi.Read(0x3C, readback, sizeof(readback)) == TWIResult::Success);
+    EXPECT(memcmp(readback, &framebuffer[2], 1024) == 0);
+    report("zero-copy read 1024 @400k", 1024, start);
+}
+
+static void slaveTransfers()
+{
+    VirtualBus::reset();
+    sei();
+    twi.TWISetMode(TWIMode::Slave, 0x10);
+
+    uint64_t start = mark();
+    const uint8_t command[3] = {0xA0, 0xA1, 0xA2};
+    EXPECT(VirtualBus::masterWrite(0x10, command, sizeof(command)) == sizeof(command));
+    EXPECT(VirtualBus::masterWrite(0x11, command, sizeof(command)) == 0);
+
+    twi.Write("echo");
+    uint8_t reply[4] = {0};
+    EXPECT(VirtualBus::masterRead(0x10, reply, sizeof(reply)) == sizeof(reply));
+    EXPECT(memcmp(reply, "echo", 4) == 0);
+    report("slave write 3 + read 4 @100k", 7, start);
+
+    uint8_t message[8] = {0};
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == sizeof(command));
+    EXPECT(memcmp(message, command, sizeof(command)) == 0);
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == 0);
+}
+
+static void slaveMessages()
+{
+    VirtualBus::reset();
+    sei();
+    uint8_t receiveStorage[16];
+    uint8_t transmitStorage[16];
+    uint8_t replyStorage[12];
+    twi.setBuffers(transmitStorage, sizeof(transmitStorage), receiveStorage, sizeof(receiveStorage));
+    twi.setReplyBuffer(replyStorage, sizeof(replyStorage));
+    twi.configure(TWIMode::Slave, 0x14, 72, PrescalerValue::PRESCALE_VALUE_1);
+
+    // Burst of messages faster than the application drains them: 4 + 4 + 4 bytes fit, the fourth message does not
+    uint64_t start = mark();
+    const uint8_t burst[4][3] = {{1, 2, 3}, {4, 5, 6}, {7, 8, 9}, {10, 11, 12}};
+    EXPECT(VirtualBus::masterWrite(0x14, burst[0], 3) == 3);
+    EXPECT(VirtualBus::masterWrite(0x14, burst[1], 3) == 3);
+    EXPECT(VirtualBus::masterWrite(0x14, burst[2], 3) == 3);
+    EXPECT(VirtualBus::masterWrite(0x14, burst[3], 3) < 3);
+    EXPECT(twi.getReceiveOverflows() == 1);
+
+    uint8_t message[8] = {0};
+    for (uint8_t index = 0; index < 3; index++) {
+        EXPECT(twi.receiveMessage(message, sizeof(message)) == 3);
+        EXPECT(memcmp(message, burst[index], 3) == 0);
+    }
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == 0);
+
+    // Drained ring accepts messages again, wrapping around the end of the storage
+    EXPECT(VirtualBus::masterWrite(0x14, burst[3], 3) == 3);
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == 3);
+    EXPECT(memcmp(message, burst[3], 3) == 0);
+
+    // Queued replies answer consecutive reads in order, the last byte is sent with TWEA = 0
+    const uint8_t first[2] = {0x51, 0x52};
+    const uint8_t second[3] = {0x61, 0x62, 0x63};
+    EXPECT(twi.sendMessage(first, sizeof(first)));
+    EXPECT(twi.sendMessage(second, sizeof(second)));
+    const uint8_t tooLong[8] = {0};
+    EXPECT(!twi.sendMessage(tooLong, sizeof(tooLong)));
+    uint8_t reply[3] = {0};
+    EXPECT(VirtualBus::masterRead(0x14, reply, sizeof(first)) == sizeof(first));
+    EXPECT(memcmp(reply, first, sizeof(first)) == 0);
+    EXPECT(VirtualBus::masterRead(0x14, reply, sizeof(second)) == sizeof(second));
+    EXPECT(memcmp(reply, second, sizeof(second)) == 0);
+    report("slave message ring 5 writes + 2 reads", 20, start);
+
+    twi.setReplyBuffer(nullptr, 0);
+    twi.setBuffers(nullptr, 0, nullptr, 0);
+}
+
+static uint8_t writtenFirst = 0;
+static uint8_t writtenCount = 0;
+
+static void registersWritten(uint8_t first, uint8_t count)
+{
+    writtenFirst = first;
+    writtenCount = count;
+}
+
+static void registerSlave()
+{
+    VirtualBus::reset();
+    sei();
+    twi.TWISetMode(TWIMode::Slave, 0x12);
+
+    uint8_t registers[16] = {0};
+    const uint8_t readOnly[2] = {0x01, 0x00};    // register 0 is an ID register
+    const uint8_t writeOnly[2] = {0x00, 0x80};   // register 15 is a command register
+    registers[0] = 0xA5;
+    TWIRegisterMap map = {};
+    map.registers = registers;
+    map.size = sizeof(registers);
+    map.readOnly = readOnly;
+    map.writeOnly = writeOnly;
+    map.written = registersWritten;
+    twi.setRegisterMap(&map);
+
+    uint64_t start = mark();
+    const uint8_t write[] = {0x0E, 0x11, 0x22, 0x33, 0x44};
+    EXPECT(VirtualBus::masterWrite(0x12, write, sizeof(write)) == sizeof(write));
+    EXPECT(registers[14] == 0x11);
+    EXPECT(registers[15] == 0x22);
+    EXPECT(registers[0] == 0xA5);
+    EXPECT(registers[1] == 0x44);
+    EXPECT((writtenFirst == 14) && (writtenCount == 4));
+
+    const uint8_t pointer = 0x0E;
+    uint8_t read[4] = {0};
+    EXPECT(VirtualBus::masterWrite(0x12, &pointer, 1) == 1);
+    EXPECT(VirtualBus::masterRead(0x12, read, sizeof(read)) == sizeof(read));
+    EXPECT((read[0] == 0x11) && (read[1] == 0x00) && (read[2] == 0xA5) && (read[3] == 0x44));
+    report("register slave write 4 + read 4", 8, start);
+    twi.setRegisterMap(nullptr);
+}
+
+static void smbusPec()
+{
+    SmbusSlave gauge(0x0B);
+    setupMaster(100000);
+    VirtualBus::attach(gauge);
+    TWIStatistics before;
+    twi.getStatistics(before, true);
+
+    // Check value of the SMBus CRC-8
+    EXPECT(TWI::computePec(reinterpret_cast<const uint8_t *>("123456789"), 9) == 0xF4);
+
+    // Block write and block read back, the count is stored ahead of the data
+    uint64_t start = mark();
+    const uint8_t name[] = {'L', 'i', 'I', 'o', 'n'};
+    EXPECT(twi.smbusBlockWrite(0x0B, SmbusSlave::BLOCK_COMMAND, name, sizeof(name)) == TWIResult::Success);
+    EXPECT((gauge.block().size() == sizeof(name)) && (memcmp(gauge.block().data(), name, sizeof(name)) == 0));
+    uint8_t block[33] = {0};
+    EXPECT(twi.smbusBlockRead(0x0B, SmbusSlave::BLOCK_COMMAND, block, sizeof(block)) == TWIResult::Success);
+    EXPECT((block[0] == sizeof(name)) && (memcmp(&block[1], name, sizeof(name)) == 0));
+    report("SMBus block write 5 + read 5, PEC", 10, start);
+
+    // Process call: one PEC over the write, the repeated START and the reply
+    uint16_t reply = 0;
+    EXPECT(twi.smbusProcessCall(0x0B, SmbusSlave::PROCESS_COMMAND, 0x1234, reply) == TWIResult::Success);
+    EXPECT(reply == 0xEDCB);
+
+    // Word write with PEC through a plain transaction
+    uint8_t voltage[2] = {0x10, 0x0E};
+    TWITransaction transaction = {};
+    transaction.address = 0x0B;
+    transaction.direction = TWIDirection::Write;
+    transaction.data = voltage;
+    transaction.length = sizeof(voltage);
+    transaction.registerSize = TWIRegisterSize::Byte;
+    transaction.reg = 0x09;
+    transaction.pec = true;
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::Success);
+    EXPECT(gauge.word(0x09) == 0x0E10);
+
+    // A wrong PEC of the slave, the slave NACKing the PEC, the slave NACKing data ahead of the PEC
+    gauge.corruptPec(1);
+    EXPECT(twi.smbusBlockRead(0x0B, SmbusSlave::BLOCK_COMMAND, block, sizeof(block)) == TWIResult::PecError);
+    gauge.nackByte(3);
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::PecError);
+    gauge.nackByte(2);
+    EXPECT(twi.submit(transaction));
+    EXPECT(twi.wait(transaction) == TWIResult::DataNack);
+    gauge.nackByte(0xFFFF);
+
+    // The count of a block that does not fit ends the read right away: SLA+W, command, SLA+R, count and one NACKed byte
+    uint8_t small[4] = {0};
+    uint32_t bytes = VirtualBus::counters().bytes;
+    EXPECT(twi.smbusBlockRead(0x0B, SmbusSlave::BLOCK_COMMAND, small, sizeof(small)) == TWIResult::BlockOverflow);
+    EXPECT(VirtualBus::counters().bytes - bytes == 5);
+
+    TWIStatistics after;
+    twi.getStatistics(after);
+    EXPECT(after.pecErrors == 2);
+
+    // Slave mode: writes are checked and published without their PEC, replies to a command get one appended
+    VirtualBus::reset();
+    sei();
+    uint8_t receiveStorage[16];
+    uint8_t transmitStorage[16];
+    uint8_t replyStorage[8];
+    twi.setBuffers(transmitStorage, sizeof(transmitStorage), receiveStorage, sizeof(receiveStorage));
+    twi.setReplyBuffer(replyStorage, sizeof(replyStorage));
+    twi.configure(TWIMode::Slave, 0x0B, 72, PrescalerValue::PRESCALE_VALUE_1);
+    twi.setSlavePec(true);
+
+    uint8_t write[5] = {0x16, 0x16, 0x34, 0x12, 0};
+    write[4] = TWI::computePec(write, 4);
+    EXPECT(VirtualBus::masterWrite(0x0B, &write[1], 4) == 4);
+    uint8_t message[8] = {0};
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == 3);
+    EXPECT((message[0] == 0x16) && (message[2] == 0x12));
+    write[4] ^= 0x01;
+    EXPECT(VirtualBus::masterWrite(0x0B, &write[1], 4) == 4);
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == 0);
+    EXPECT(twi.getPecErrors() == 1);
+
+    const uint8_t command = 0x0D;
+    const uint8_t charge[2] = {0x55, 0x00};
+    EXPECT(twi.sendMessage(charge, sizeof(charge)));
+    EXPECT(VirtualBus::masterWrite(0x0B, &command, 1) == 1);
+    uint8_t read[3] = {0};
+    EXPECT(VirtualBus::masterRead(0x0B, read, sizeof(read)) == sizeof(read));
+    const uint8_t covered[5] = {0x16, command, 0x17, charge[0], charge[1]};
+    EXPECT((read[0] == 0x55) && (read[2] == TWI::computePec(covered, sizeof(covered))));
+    EXPECT(twi.receiveMessage(message, sizeof(message)) == 1);
+
+    twi.setSlavePec(false);
+    twi.setReplyBuffer(nullptr, 0);
+    twi.setBuffers(nullptr, 0, nullptr, 0);
+}
+
+static uint16_t imagePosition = 0;
+static const uint16_t IMAGE_SIZE = 1000;
+
+static uint8_t imageByte(uint16_t index)
+{
+    return static_cast<uint8_t>(index * 31 + (index >> 8));
+}
+
+static uint8_t refillImage(uint8_t *block, uint8_t size)
+{
+    uint8_t length = 0;
+    while ((length < size) && (imagePosition < IMAGE_SIZE)) {
+        block[length++] = imageByte(imagePosition++);
+    }
+    return length;
+}
+
+static void slaveStreaming()
+{
+    VirtualBus::reset();
+    sei();
+    twi.TWISetMode(TWIMode::Slave, 0x16, PrescalerValue::PRESCALE_VALUE_1, 400000);
+
+    // Firmware image far larger than the blocks, refilled from the interrupt and read in 4 transfers
+    uint8_t first[32];
+    uint8_t second[32];
+    TWIStreamBuffer stream;
+    imagePosition = 0;
+    stream.attach(first, second, sizeof(first), refillImage);
+    twi.setSlaveStream(&stream);
+    static uint8_t image[IMAGE_SIZE];
+    uint64_t start = mark();
+    for (uint16_t offset = 0; offset < IMAGE_SIZE; offset += 250) {
+        EXPECT(VirtualBus::masterRead(0x16, &image[offset], 250) == 250);
+    }
+    bool intact = true;
+    for (uint16_t index = 0; index < IMAGE_SIZE; index++) {
+        intact = intact && (image[index] == imageByte(index));
+    }
+    EXPECT(intact);
+    EXPECT(stream.underruns == 0);
+    report("slave stream 1000 @400k, refill", IMAGE_SIZE, start);
+
+    // Samples filled by the application into one block while the other is on the wire
+    stream.attach(first, second, 16);
+    uint8_t sample = 0;
+    for (uint8_t block = 0; block < 2; block++) {
+        uint8_t *data = stream.acquire();
+        EXPECT(data != nullptr);
+        for (uint8_t index = 0; index < 16; index++) {
+            data[index] = sample++;
+        }
+        stream.publish(16);
+    }
+    EXPECT(stream.acquire() == nullptr);
+    uint8_t read[24] = {0};
+    EXPECT(VirtualBus::masterRead(0x16, read, sizeof(read)) == sizeof(read));
+    EXPECT((read[0] == 0) && (read[15] == 15) && (read[23] == 23));
+
+    // The first block is free again and continues after the 8 samples left of the second one
+    uint8_t *data = stream.acquire();
+    EXPECT(data == first);
+    for (uint8_t index = 0; index < 16; index++) {
+        data[index] = sample++;
+    }
+    stream.publish(16);
+    uint8_t more[28] = {0};
+    EXPECT(VirtualBus::masterRead(0x16, more, sizeof(more)) == sizeof(more));
+    EXPECT((more[0] == 24) && (more[23] == 47));
+    EXPECT((more[24] == 0) && (stream.underruns == 4));
+
+    twi.setSlaveStream(nullptr);
+}
+
+int main()
+{
+    printf("%-36s %10s %15s %14s %10s\n", "scenario", "payload", "bus time", "throughput", "interrupts");
+    registerRead(100000);
+    registerRead(400000);
+    wideRegisters();
+    queuedWrites();
+    errors();
+    trace();
+    timeouts();
+    multiMaster();
+    scatterGather();
+    speedProfiles();
+    pollScheduler();
+    readyPolling();
+    waitModes();
+    flashWrites();
+    eepromStorage();
+    registerCache();
+    multipleBuses();
+    clockStretching();
+    bulkTransfers();
+    slaveTransfers();
+    slaveMessages();
+    registerSlave();
+    slaveStreaming();
+    smbusPec();
+
+    printf("%s: %d failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+//
+// Entry point of the master-only and slave-only host builds. Does a transfer of the role against the virtual bus, so
+// the link of the variant is checked along with its compilation.
+//
+
+#include <stdio.h>
+#include "TWI.h"
+
+static TWI twi;
+
+int main()
+{
+    VirtualBus::reset();
+    sei();
+#if TWI_MASTER
+    static MemorySlave sensor(0x48, 16);
+    VirtualBus::attach(sensor);
+    twi.TWISetMode(TWIMode::Master);
+    uint8_t value = 0x5A;
+    bool passed = (twi.writeRegister(0x48, 0x02, &value, 1) == TWIResult::Success) && (sensor.memory()[0x02] == 0x5A);
+#else
+    twi.TWISetMode(TWIMode::Slave, 0x41);
+    uint8_t message[4];
+    bool passed = twi.receiveMessage(message, sizeof(message)) == 0;
+#endif
+    printf("%s\n", passed ? "PASSED" : "FAILED");
+    return passed ? 0 : 1;
+}
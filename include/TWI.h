@@ -4,12 +4,10 @@
 
 #ifndef ATMEGA_TWI_TWI_H
 #define ATMEGA_TWI_TWI_H
-#include <avr/interrupt.h>
-#include <avr/io.h>
 #include <stdbool.h>
-
-// Defining the TWI status
-#define TWI_STATUS	(TWSR & 0xF8)
+#include "TWIHardware.h"
+#include "TWIMessageRing.h"
+#include "TWIStreamBuffer.h"
 
 /****************************************************************/
 /* Enumeration to determine the current state of TWI            */
@@ -60,6 +58,7 @@ typedef struct TWIInfoStruct{
 /* Enumeration for TWI status codes                             */
 /****************************************************************/
 enum {
+    TWI_BUS_ERROR               = 0x00,     /*!< Bus error due to an illegal START or STOP condition.*/
     TWI_START                   = 0x08,     /*!< A START condition has been transmitted.*/
     TWI_RESTART                 = 0x10,     /*!< A repeated START condition has been transmitted.*/
 
@@ -116,9 +115,30 @@ enum class TWICommand
     TRANSMIT_ACK    = 3,        /*!< Transmit ACK */
     TRANSMIT_NACK   = 4,        /*!< Transmit NACK */
     ENABLE_SLAVE    = 5,         /*!< Enable slave mode */
-    RESET           = 6
+    RESET           = 6,
+    STOP_START      = 7,        /*!< Transmit STOP condition followed by a START condition */
+    HOLD            = 8         /*!< Keep the bus (SCL low) and mask the interrupt until the next START */
 };
 
+/****************************************************************/
+/* TWCR values of the transmission commands                     */
+/****************************************************************/
+namespace TWIControl {
+    constexpr uint8_t START         = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN) | (1<<TWIE);
+    constexpr uint8_t STOP          = (1<<TWINT) | (1<<TWSTO) | (1<<TWEN);
+    constexpr uint8_t STOP_SLAVE    = STOP | (1<<TWIE) | (1<<TWEA); /*!< STOP and listen to the own address again */
+    constexpr uint8_t STOP_START    = (1<<TWINT) | (1<<TWSTA) | (1<<TWSTO) | (1<<TWEN) | (1<<TWIE);
+    constexpr uint8_t TRANSMIT      = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);   /*!< Transmit data or address */
+    constexpr uint8_t NACK          = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);   /*!< Receive or transmit, TWEA = 0 */
+    constexpr uint8_t RELEASE       = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);   /*!< Clear TWINT without a bus action */
+    constexpr uint8_t ACK           = (1<<TWINT) | (1<<TWEN) | (1<<TWIE) | (1<<TWEA);
+    constexpr uint8_t SLAVE         = (1<<TWINT) | (1<<TWEN) | (1<<TWIE) | (1<<TWEA); /*!< Acknowledge own address */
+    constexpr uint8_t RESET         = (1<<TWINT) | (1<<TWSTO);
+    constexpr uint8_t HOLD          = (1<<TWEN);    /*!< TWINT is left set, which keeps SCL low */
+    constexpr uint8_t RECOVER       = (1<<TWINT) | (1<<TWSTO) | (1<<TWEN) | (1<<TWIE); /*!< Release after bus error */
+    constexpr uint8_t RECOVER_SLAVE = RECOVER | (1<<TWEA);
+}
+
 /****************************************************************/
 /* Enumeration of TWI Bit Rate Prescaler                        */
 /****************************************************************/
@@ -139,27 +159,344 @@ enum class TWIMode
     Slave   = 0x01      /*!< Set TWI communication as Slave */
 };
 
+/****************************************************************/
+/* Direction of a queued transaction                            */
+/****************************************************************/
+enum class TWIDirection : uint8_t
+{
+    Write   = 0x00,     /*!< Master transmitter, SLA+W */
+    Read    = 0x01      /*!< Master receiver, SLA+R */
+};
+
+/****************************************************************/
+/* Result of a queued transaction                               */
+/****************************************************************/
+enum class TWIResult : uint8_t
+{
+    Idle            = 0,        /*!< Transaction was never submitted */
+    Pending         = 1,        /*!< Transaction is queued or on the bus */
+    Success         = 2,        /*!< All bytes have been transferred */
+    AddressNack     = 3,        /*!< SLA+R/W has not been acknowledged */
+    DataNack        = 4,        /*!< A data byte has not been acknowledged before the last byte */
+    ArbitrationLost = 5,        /*!< Another master won the bus on every retry */
+    BusError        = 6,        /*!< Illegal START or STOP condition on the bus */
+    Timeout         = 7,        /*!< No progress within the timeout, the bus has been recovered */
+    PecError        = 8,        /*!< SMBus PEC of a read did not match, or the slave NACKed the PEC of a write */
+    BlockOverflow   = 9,        /*!< SMBus block read: the byte count reported by the slave exceeds the buffer */
+    Unsupported     = 10,       /*!< The bus cannot run the transaction, e.g. segments or PEC on a software bus */
+    OutOfRange      = 11        /*!< The request exceeds the memory or registers of a device, nothing was transferred */
+};
+
+/****************************************************************/
+/* How the blocking functions wait for the peripheral           */
+/****************************************************************/
+enum class TWIWaitMode : uint8_t
+{
+    Spin    = 0,        /*!< Busy-wait at full power */
+    Sleep   = 1,        /*!< Idle sleep, woken by the TWI and the TWI_TIMER compare interrupt */
+    Yield   = 2         /*!< Call the yield hook, e.g. of a cooperative scheduler */
+};
+
+typedef void (*TWIYieldHook)();
+
+/****************************************************************/
+/* Size of the register address of a combined transaction       */
+/****************************************************************/
+enum class TWIRegisterSize : uint8_t
+{
+    None    = 0,        /*!< Plain transaction without register address */
+    Byte    = 1,        /*!< 8 bit register address */
+    Word    = 2         /*!< 16 bit register address, sent MSB first */
+};
+
+struct TWITransaction;
+
+/*!
+ * Completion callback of a queued transaction. Called from within the TWI interrupt, after the next queued
+ * transaction has already been started.
+ */
+typedef void (*TWICallback)(TWITransaction *transaction);
+
+/****************************************************************/
+/* Buffer segment of a scatter-gather transaction               */
+/****************************************************************/
+typedef struct TWISegment {
+    uint8_t *data;              /*!< Caller owned buffer; only read from for write segments */
+    uint16_t length;            /*!< Number of bytes, at least 1 for read segments */
+    TWIDirection direction;     /*!< Write or read */
+    bool restart;               /*!< Repeated START and SLA+R/W ahead of the segment, implied on a direction change */
+} TWISegment;
+
+/****************************************************************/
+/* SMBus packet error checking, TWI_PEC = 1 enables it. The     */
+/* CRC-8 is updated byte by byte from the interrupt with a      */
+/* 256 byte table in program memory.                            */
+/****************************************************************/
+#ifndef TWI_PEC
+#define TWI_PEC 0
+#endif
+
+/****************************************************************/
+/* Descriptor of a queued master transaction                    */
+/****************************************************************/
+typedef struct TWITransaction {
+    uint8_t address;            /*!< 7 bit address of the slave device */
+    TWIDirection direction;     /*!< Write or read */
+    uint8_t *data;              /*!< Caller owned buffer; only read from for write transactions */
+    uint16_t length;            /*!< Number of bytes to be transferred */
+    TWIFlashAddress flashData;  /*!< Program memory the bytes of a write are read from instead of data, 0 for data */
+    const TWISegment *segments; /*!< Segments transferred instead of data, length and direction, may be nullptr */
+    uint8_t segmentCount;       /*!< Number of segments */
+    TWIRegisterSize registerSize; /*!< Register address written ahead of the data, None for plain transfers */
+    uint16_t reg;               /*!< Register address. Reads continue with a repeated START after writing it */
+    bool repeatedStart;         /*!< Keep the bus after this transaction and continue with a repeated START */
+#if TWI_PEC
+    bool pec;                   /*!< SMBus PEC: sent after the last byte of a write, received and checked after the
+                                 * last byte of a read */
+    bool blockRead;             /*!< SMBus block read: the first byte read is the byte count, stored in data[0], and
+                                 * the read ends after count further bytes. length is the size of data */
+#endif
+    uint16_t timeout;           /*!< TWI_TIMER ticks without bus progress until the transaction is aborted, 0 selects
+                                 * TWI_TIMEOUT */
+    uint8_t retries;            /*!< Set by the driver: restarts after lost arbitration */
+    TWICallback callback;       /*!< Completion callback, may be nullptr */
+    void *context;              /*!< User data for the callback */
+    volatile TWIResult result;  /*!< Current state of the transaction */
+} TWITransaction;
+
+/*!
+ * Called from within the TWI interrupt when a master has written registers of the register map, once per write
+ * transfer
+ * @param first First register written
+ * @param count Number of registers written, read only registers included
+ */
+typedef void (*TWIRegisterCallback)(uint8_t first, uint8_t count);
+
+/****************************************************************/
+/* Register map of the register-file slave mode                 */
+/****************************************************************/
+typedef struct TWIRegisterMap {
+    uint8_t *registers;         /*!< Register contents, owned by the application */
+    uint8_t size;               /*!< Number of registers, the register pointer wraps around at size */
+    const uint8_t *readOnly;    /*!< Bitmap, bit n of byte n / 8 set: master writes to register n are ignored.
+                                 * May be nullptr */
+    const uint8_t *writeOnly;   /*!< Bitmap, bit n of byte n / 8 set: register n reads as 0. May be nullptr */
+    TWIRegisterCallback written; /*!< Called at the end of a write transfer, may be nullptr */
+    volatile uint8_t pointer;   /*!< Register pointer, set by the first byte of a write transfer */
+} TWIRegisterMap;
+
+/****************************************************************/
+/* Roles compiled into the driver. A master-only or slave-only  */
+/* build drops the interrupt handlers, buffers and functions of */
+/* the other role.                                              */
+/****************************************************************/
+#ifndef TWI_MASTER
+#define TWI_MASTER 1
+#endif
+
+#ifndef TWI_SLAVE
+#define TWI_SLAVE 1
+#endif
+
+#if !TWI_MASTER && !TWI_SLAVE
+#error "TWI_MASTER and TWI_SLAVE are both disabled"
+#endif
+
+/****************************************************************/
+/* All TWI objects share the one peripheral, the global twi is  */
+/* only defined if TWI_GLOBAL_INSTANCE is set to 1.             */
+/****************************************************************/
+#ifndef TWI_GLOBAL_INSTANCE
+#define TWI_GLOBAL_INSTANCE 0
+#endif
+
+/****************************************************************/
+/* Size of the transaction queue, has to be a power of two      */
+/****************************************************************/
+#ifndef TWI_QUEUE_SIZE
+#define TWI_QUEUE_SIZE 8
+#endif
+
+/****************************************************************/
+/* Statistics updated from the interrupt, TWI_STATISTICS = 1    */
+/* enables them. Transactions are timed with TWI_TIMER.         */
+/****************************************************************/
+#ifndef TWI_STATISTICS
+#define TWI_STATISTICS 0
+#endif
+
+#define TWI_LATENCY_BUCKETS 16
+
+/****************************************************************/
+/* Bus speed of a slave device. Transactions to the device run  */
+/* with its TWBR and TWPS, see TWI::setDeviceProfiles()         */
+/****************************************************************/
+typedef struct TWIDeviceProfile {
+    uint8_t address;            /*!< 7 bit address of the slave device */
+    uint8_t bitRate;            /*!< TWBR for the device */
+    PrescalerValue prescaler;   /*!< TWPS for the device */
+    uint32_t maxFrequency;      /*!< Highest SCL frequency the device is specified for, upper bound of probeSpeed() */
+} TWIDeviceProfile;
+
+/****************************************************************/
+/* Default timeout of a transaction in TWI_TIMER ticks without  */
+/* an interrupt, 20000 ticks are 10 ms with Timer1 at F_CPU / 8 */
+/****************************************************************/
+#ifndef TWI_TIMEOUT
+#define TWI_TIMEOUT 20000
+#endif
+
+/****************************************************************/
+/* Multi-master: a transaction that lost arbitration is         */
+/* restarted up to TWI_ARBITRATION_RETRIES times, each after a  */
+/* random backoff below TWI_BACKOFF_TICKS << retries ticks.     */
+/****************************************************************/
+#ifndef TWI_ARBITRATION_RETRIES
+#define TWI_ARBITRATION_RETRIES 3
+#endif
+
+#ifndef TWI_BACKOFF_TICKS
+#define TWI_BACKOFF_TICKS 64
+#endif
+
+/****************************************************************/
+/* Wait mode of the blocking functions, see TWI::setWaitMode()  */
+/****************************************************************/
+#ifndef TWI_WAIT_MODE
+#define TWI_WAIT_MODE TWIWaitMode::Spin
+#endif
+
+typedef struct TWIStatistics {
+    uint32_t bytesTransmitted;      /*!< Address, register and data bytes sent, master and slave */
+    uint32_t bytesReceived;         /*!< Data bytes received, master and slave */
+    uint16_t transactions;          /*!< Finished master transactions, whatever their result */
+    uint16_t addressNacks;          /*!< SLA+W or SLA+R not acknowledged */
+    uint16_t registerNacks;         /*!< Register address of a combined transaction not acknowledged */
+    uint16_t dataNacks;             /*!< Data byte not acknowledged before the end of a write */
+    uint16_t arbitrationLosses;     /*!< Arbitration lost against another master */
+    uint16_t busErrors;             /*!< Illegal START or STOP conditions */
+    uint16_t timeouts;              /*!< Transactions aborted by a timeout, each followed by a bus recovery */
+    uint16_t pecErrors;             /*!< SMBus PEC mismatches, master and slave */
+    uint16_t latency[TWI_LATENCY_BUCKETS]; /*!< Transactions by duration from START to completion in TWI_TIMER ticks:
+                                            * bucket 0 below 1 tick, bucket n from 2^(n-1) to 2^n - 1 ticks, the last
+                                            * bucket everything longer */
+} TWIStatistics;
+
+/****************************************************************/
+/* Event trace, TWI_TRACE_SIZE entries (a power of two up to    */
+/* 256) are kept of the latest interrupts. 0 disables it.       */
+/****************************************************************/
+#ifndef TWI_TRACE_SIZE
+#define TWI_TRACE_SIZE 0
+#endif
+
+typedef struct TWITraceEntry {
+    uint16_t time;      /*!< TWI_TIMER at the start of the interrupt */
+    uint8_t status;     /*!< TWSR status code, prescaler bits masked */
+    uint8_t state;      /*!< TWIState before the interrupt was handled */
+    uint8_t data;       /*!< TWDR, the byte received or the last byte sent */
+} TWITraceEntry;
+
 ISR(TWI_vect);
 
 class TWI {
     friend void TWI_vect(void);
 
 public:
-    explicit TWI();
+    explicit constexpr TWI() {}
 
     void TWISetMode(TWIMode requestedMode = TWIMode::Master,
                     uint8_t setSlaveAddress = 0x01,
                     PrescalerValue value = PrescalerValue::PRESCALE_VALUE_1,
                     uint32_t twiFrequency = 100000);
 
+    void configure(TWIMode requestedMode,
+                   uint8_t setSlaveAddress,
+                   uint8_t bitRate,
+                   PrescalerValue value);
+
+    void setBuffers(uint8_t *transmitBuffer,
+                    uint8_t transmitBufferSize,
+                    uint8_t *receiveBuffer,
+                    uint8_t receiveBufferSize);
+
     void setPrescaler(PrescalerValue value);
 
     void setBitRate(uint32_t twiFrequency);
 
+    /*!
+     * Division factor of the TWPS prescaler bits
+     * @param value Prescaler value
+     * @return 1, 4, 16 or 64
+     */
+    static constexpr uint8_t prescalerFactor(PrescalerValue value)
+    {
+        return static_cast<uint8_t>(1 << (2 * static_cast<uint8_t>(value)));
+    }
+
+    /*!
+     * TWBR value for a SCL frequency: SCL = F_CPU / (16 + 2 * TWBR * prescaler)
+     * @param twiFrequency SCL frequency in Hz
+     * @param value Prescaler value
+     * @return TWBR value, values above 255 cannot be reached with this prescaler
+     */
+    static constexpr uint32_t bitRateDivider(uint32_t twiFrequency, PrescalerValue value)
+    {
+        return ((F_CPU / twiFrequency) - 16) / (2 * prescalerFactor(value));
+    }
+
+    /*!
+     * Smallest prescaler that reaches the frequency
+     * @param twiFrequency SCL frequency in Hz
+     * @return Prescaler value, PRESCALE_VALUE_64 if even that is too fast
+     */
+    static constexpr PrescalerValue prescalerFor(uint32_t twiFrequency)
+    {
+        return (bitRateDivider(twiFrequency, PrescalerValue::PRESCALE_VALUE_1) <= 0xFF) ? PrescalerValue::PRESCALE_VALUE_1
+             : (bitRateDivider(twiFrequency, PrescalerValue::PRESCALE_VALUE_4) <= 0xFF) ? PrescalerValue::PRESCALE_VALUE_4
+             : (bitRateDivider(twiFrequency, PrescalerValue::PRESCALE_VALUE_16) <= 0xFF) ? PrescalerValue::PRESCALE_VALUE_16
+             : PrescalerValue::PRESCALE_VALUE_64;
+    }
+
+    /*!
+     * Speed profile of a device with TWBR and TWPS computed at compile time
+     * @param address 7 bit address of the slave device
+     * @param maxFrequency SCL frequency in Hz the device is run with
+     * @return Entry of the device table, see setDeviceProfiles()
+     */
+    static constexpr TWIDeviceProfile deviceProfile(uint8_t address, uint32_t maxFrequency)
+    {
+        return {address,
+                static_cast<uint8_t>(bitRateDivider(maxFrequency, prescalerFor(maxFrequency))),
+                prescalerFor(maxFrequency),
+                maxFrequency};
+    }
+
     void TWIPerform(TWICommand command);
 
     bool isTWIReady();
 
+#if TWI_MASTER
+    void setDeviceProfiles(TWIDeviceProfile *profiles, uint8_t count);
+
+    uint32_t probeSpeed(TWIDeviceProfile &profile, uint8_t attempts = 8);
+
+    bool submit(TWITransaction &transaction);
+
+    bool poll(const TWITransaction &transaction);
+
+    TWIResult wait(const TWITransaction &transaction);
+
+    TWIResult wait(const TWITransaction &transaction, TWIWaitMode waitMode);
+
+    TWIResult transfer(TWITransaction &transaction);
+
+    void service();
+
+    void setWaitMode(TWIWaitMode waitMode, TWIYieldHook hook = nullptr);
+
+    static void pause(const TWITransaction &transaction);
+
     void Write(uint8_t slaveAddress,
                const uint8_t *data,
                uint8_t dataLen,
@@ -178,47 +515,292 @@ public:
         Write(slaveAddress, (uint8_t *) &data, sizeof(data), repeatedStart, false);
     }
 
+    TWIResult WriteDirect(uint8_t slaveAddress,
+                          const uint8_t *data,
+                          uint16_t dataLen,
+                          bool repeatedStart = false);
+
+    TWIResult WriteP(uint8_t slaveAddress,
+                     const uint8_t *data,
+                     uint16_t dataLen,
+                     bool repeatedStart = false);
+
+    TWIResult WriteFarP(uint8_t slaveAddress,
+                        TWIFlashAddress data,
+                        uint16_t dataLen,
+                        bool repeatedStart = false);
+
+    TWIResult Read(const uint8_t slaveAddress,
+                   uint8_t *data,
+                   uint16_t readBytesLen,
+                   const bool repeatedStart = false);
+
+    TWIResult readRegister(uint8_t slaveAddress,
+                           uint16_t reg,
+                           uint8_t *data,
+                           uint16_t length,
+                           TWIRegisterSize registerSize = TWIRegisterSize::Byte);
+
+    TWIResult transferSegments(uint8_t slaveAddress, const TWISegment *segments, uint8_t segmentCount);
+
+    TWIResult writeRegister(uint8_t slaveAddress,
+                            uint16_t reg,
+                            const uint8_t *data,
+                            uint16_t length,
+                            TWIRegisterSize registerSize = TWIRegisterSize::Byte);
+
+    TWIResult writeRegisterP(uint8_t slaveAddress,
+                             uint16_t reg,
+                             const uint8_t *data,
+                             uint16_t length,
+                             TWIRegisterSize registerSize = TWIRegisterSize::Byte);
+
+#if TWI_PEC
+    TWIResult smbusBlockWrite(uint8_t slaveAddress,
+                              uint8_t command,
+                              const uint8_t *data,
+                              uint8_t length,
+                              bool pec = true);
+
+    TWIResult smbusBlockRead(uint8_t slaveAddress,
+                             uint8_t command,
+                             uint8_t *block,
+                             uint8_t size,
+                             bool pec = true);
+
+    TWIResult smbusProcessCall(uint8_t slaveAddress,
+                               uint8_t command,
+                               uint16_t value,
+                               uint16_t &reply,
+                               bool pec = true);
+#endif
+#endif
+
+#if TWI_SLAVE
     void Write(const char *const data);
 
-    void Read(const uint8_t slaveAddress,
-              uint8_t *data,
-              uint8_t readBytesLen,
-              const bool repeatedStart = false);
-
     void Read();
+
+    void setRegisterMap(TWIRegisterMap *map);
+
+    uint8_t receiveMessage(uint8_t *data, uint8_t maxLength);
+
+    void setReplyBuffer(uint8_t *storage, uint8_t size);
+
+    bool sendMessage(const uint8_t *data, uint8_t length);
+
+    uint8_t getReceiveOverflows() const;
+
+    void setSlaveStream(TWIStreamBuffer *stream);
+
+#if TWI_PEC
+    void setSlavePec(bool enabled);
+
+    uint8_t getPecErrors() const;
+#endif
+#endif
+
+#if TWI_PEC
+    static uint8_t computePec(const uint8_t *data, uint16_t length, uint8_t crc = 0);
+#endif
+
+    void getStatistics(TWIStatistics &snapshot, bool reset = false);
+
+    uint8_t getTrace(TWITraceEntry *entries, uint8_t maxEntries, bool clear = false);
     
     bool GetAvailability();
 
 private:
-    uint8_t TWIPrescalerValue;
-    TWIMode mode;
-    uint8_t slaveModeAddress;
+    static uint8_t TWIPrescalerValue;
+    static TWIMode mode;
+    static uint8_t slaveModeAddress;
 
+    // Function for handling the TWI_vect interrupt calls
+    static inline void twi_interrupt_handler();
 
+    // Makes transaction the one on the bus
+    static void loadTransaction(TWITransaction *transaction);
 
+    enum class TWISegmentStep : uint8_t {
+        End,        /*!< No segment left */
+        Continue,   /*!< Next segment continues the current transfer */
+        Restart     /*!< Next segment starts with a repeated START */
+    };
 
-    // Function for handling the TWI_vect interrupt calls
-    inline void twi_interrupt_handler();
+    // Programs TWBR and TWPS for the device if they differ from the current ones
+    static void applyProfile(uint8_t address);
+
+    // Makes the next segment of a scatter-gather transaction the one on the bus
+    static TWISegmentStep nextSegment();
+
+    // Whether the byte after the next one is still part of the current read, decides between ACK and NACK
+    static bool readContinues();
+
+    // Sends a byte of the current master transaction, updating its PEC
+    static void transmit(uint8_t data);
+
+    // Reads a byte of the current master transaction, updating its PEC
+    static uint8_t receive();
+
+    // Finishes the transaction at the head of the queue and starts the next one
+    static void completeTransaction(TWIResult result, bool ownsBus);
+
+    // Interrupt handlers, see stateHandlers
+    static void onStart();
+    static void onMasterTransmitAddressed();
+    static void onMasterTransmitData();
+    static void onMasterTransmitNack();
+    static void onAddressNack();
+    static void onArbitrationLost();
+    static void onSlaveReceiveArbitrationLost();
+    static void onSlaveTransmitArbitrationLost();
+    static void onMasterReceiveAddressed();
+    static void onMasterReceiveData();
+    static void onMasterReceiveLast();
+    static void onBusError();
+    static void onSlaveTransmitAddressed();
+    static void onSlaveTransmitData();
+    static void onSlaveTransmitNack();
+    static void onSlaveTransmitLast();
+    static void onSlaveReceiveAddressed();
+    static void onSlaveReceiveData();
+    static void onSlaveReceiveNack();
+    static void onSlaveStop();
+    static void onUnexpected();
+
+    typedef void (*TWIStateHandler)();
+    static const TWIStateHandler stateHandlers[32]; /*!< Handler of each status code by TWSR >> 3, in program memory */
+
+    // Aborts the transaction on the bus if it made no progress within its timeout
+    bool checkTimeout();
+
+    // Waits for the next bus event while a blocking function has nothing to do
+    static void pause(TWIWaitMode waitMode, const TWITransaction *transaction);
+
+    // Issues the START of a transaction that lost arbitration once its backoff has passed
+    static void checkRestart();
+
+    // Prepares the restart of the current transaction after lost arbitration, false if it ran out of retries
+    static bool scheduleRetry();
+
+    // Finishes the current transaction without touching TWCR, used while another master addresses the driver
+    static void dropTransaction(TWIResult result);
+
+    // Updates the statistics, stores the result and calls the callback of a finished transaction
+    static void finishTransaction(TWITransaction *done, TWIResult result);
+
+    // Clocks a stuck slave free and sends a STOP with the TWI disabled
+    static void recoverBus();
+
+    // Sets the TWI up again after a bus recovery, keeping the slave messages and replies
+    void restoreHardware();
 
     /** Static variables **/
     // Buffer Setup
-    // Transmission buffer - Rx
-    static const uint8_t TX_BUFFER_SIZE = 32; /*!< Transmission buffer size */
-    static uint8_t txBuffer[TX_BUFFER_SIZE]; /*!< Transmission buffer to hold values before being sent on the TWI */
+    // Transmission buffer - Tx
+    static const uint8_t TX_BUFFER_SIZE = 32; /*!< Size of the default transmission buffer */
+    static uint8_t defaultTxBuffer[TX_BUFFER_SIZE]; /*!< Used if TWISetMode() is called without setBuffers() */
+    static uint8_t *txBuffer; /*!< Transmission buffer to hold values before being sent on the TWI */
+    static uint8_t txBufferSize; /*!< Transmission buffer size */
     static uint8_t txIndex;    /*!< Current index within the transmission buffer (txBuffer) */
     static uint8_t txBufferLen; /*!< Current size of the transmission buffer. Depends on the length of the data to be
  * transmitted */
 
     // Buffer Setup
     // Receiver buffer - Rx
-    static const uint8_t RX_BUFFER_SIZE = 32;/*!< Receiver buffer size */
-    static uint8_t rxBuffer[RX_BUFFER_SIZE]; /*!< Receiver buffer to hold values before being sent on the TWI */
-    static uint8_t rxIndex; /*!< Current index within the receiver buffer (rxBuffer) */
-    static uint8_t rxBufferLen; /*!< Current size of the receiver buffer. Depends on the length of the data to be
- * transmitted */
+    static const uint8_t RX_BUFFER_SIZE = 32;/*!< Size of the default receiver buffer */
+    static uint8_t *rxBuffer; /*!< Storage of the slave receiver message ring */
+    static uint8_t rxBufferSize; /*!< Receiver buffer size */
 
     static TWIInfoStruct TWIInfo;
+
+#if TWI_SLAVE
+    static uint8_t defaultRxBuffer[RX_BUFFER_SIZE]; /*!< Used if TWISetMode() is called without setBuffers() */
+
+    // Slave message rings
+    static TWIMessageRing rxRing; /*!< Messages written by a master, produced by the ISR */
+    static TWIMessageRing txRing; /*!< Replies read by a master, consumed by the ISR */
+    static uint8_t replyRemaining; /*!< Bytes left of the reply currently read by a master */
+    static bool replyActive; /*!< A reply of txRing is being read by a master */
+
+    // Register-file slave mode
+    static TWIRegisterMap *registerMap; /*!< Served in slave mode instead of the buffers, nullptr if not used */
+    static bool registerPointerPending; /*!< Next received byte sets the register pointer */
+    static uint8_t registerWriteFirst; /*!< First register written in the current write transfer */
+    static uint8_t registerWriteCount; /*!< Number of registers written in the current write transfer */
+
+    // Streaming slave transmitter
+    static TWIStreamBuffer *slaveStream; /*!< Served to read transfers instead of the replies, nullptr if not used */
+
+#if TWI_PEC
+    // SMBus packet error checking, slave side
+    static bool slavePec; /*!< Slave mode: writes end with a PEC byte, replies get one appended */
+    static uint8_t slavePecCrc; /*!< CRC-8 of the bytes of the current slave transfer */
+    static bool slavePecCarry; /*!< A one byte write (an SMBus command) precedes the next read, its CRC continues */
+    static bool slavePecNext; /*!< Slave transmitter: the next byte is the PEC of the reply */
+    static volatile uint8_t slavePecErrors; /*!< Writes dropped because of a wrong PEC */
+#endif
+#endif
+
+#if TWI_MASTER && TWI_PEC
+    // SMBus packet error checking, master side
+    static uint8_t pecCrc; /*!< CRC-8 of the bytes of the current master transaction */
+    static bool pecTrailer; /*!< The PEC byte of the current master transaction is still to be sent or received */
+    static uint8_t readTrailer; /*!< 1 if the PEC byte follows the current read without a repeated START */
+    static bool blockCountPending; /*!< Next byte read is the byte count of an SMBus block read */
+    static bool blockOverflow; /*!< Byte count of the SMBus block read exceeds the buffer */
+#endif
+
+    // Transaction queue
+    static_assert((TWI_QUEUE_SIZE & (TWI_QUEUE_SIZE - 1)) == 0, "TWI_QUEUE_SIZE has to be a power of two");
+    static TWITransaction *queue[TWI_QUEUE_SIZE]; /*!< Submitted transactions, head is the one on the bus */
+    static volatile uint8_t queueHead; /*!< Index of the transaction currently on the bus */
+    static volatile uint8_t queueTail; /*!< Index of the next free queue slot */
+    static TWITransaction *volatile current; /*!< Transaction currently on the bus, nullptr if the queue is empty */
+    static uint8_t *transferCursor; /*!< Next byte of the current transaction in the caller's buffer */
+    static TWIFlashAddress flashCursor; /*!< Next byte of a write from program memory, 0 if writing from RAM */
+    static uint16_t transferRemaining; /*!< Number of bytes left of the current transaction */
+    static uint8_t registerRemaining; /*!< Number of register address bytes left of the current transaction */
+    static TWIDirection transferDirection; /*!< Direction of the current transaction or segment */
+    static const TWISegment *segment; /*!< Next segment of a scatter-gather transaction */
+    static uint8_t segmentsRemaining; /*!< Number of segments after the current one */
+    static uint16_t readAhead; /*!< Bytes of the read segments continuing the current read without a restart */
+    static TWITransaction bufferTransaction; /*!< Transaction used by the buffered Write() and Read() functions */
+    static volatile uint16_t lastActivity; /*!< TWI_TIMER at the latest interrupt or transaction start */
+    static volatile bool restartPending; /*!< Current transaction waits for its backoff to restart */
+    static uint16_t restartStamp; /*!< TWI_TIMER when the backoff started */
+    static uint16_t restartBackoff; /*!< Length of the backoff in TWI_TIMER ticks */
+    static uint16_t restartPolls; /*!< checkRestart() calls while TWI_TIMER stood still since the backoff started */
+    static const uint8_t STOPPED_TIMER_POLLS = 16; /*!< Calls without a TWI_TIMER tick until it is taken as stopped */
+    static const uint8_t WAKEUP_MARGIN = 8; /*!< TWI_TIMER ticks a sleep needs left to arm the compare in time */
+    static volatile bool recovering; /*!< checkTimeout() is recovering the bus, it owns the stuck transaction */
+    static uint16_t sclReleased; /*!< TWI_TIMER when checkTimeout() last saw SCL high, or the START was issued */
+    static uint16_t sdaReleased; /*!< TWI_TIMER when checkTimeout() last saw SDA high, or the START was issued */
+    static uint16_t backoffSeed; /*!< State of the random generator of the backoff */
+    static uint8_t bitRateValue; /*!< TWBR of configure(), used for devices without a profile */
+    static PrescalerValue prescalerValue; /*!< TWPS of configure(), used for devices without a profile */
+    static TWIWaitMode waitMode; /*!< Wait mode of the blocking functions */
+    static TWIYieldHook yieldHook; /*!< Called while waiting in TWIWaitMode::Yield, may be nullptr */
+    static TWIDeviceProfile *deviceProfiles; /*!< Speed of each device, nullptr if the whole bus runs at one speed */
+    static uint8_t deviceProfileCount; /*!< Number of entries of deviceProfiles */
+    static uint8_t activeBitRate; /*!< TWBR currently programmed */
+    static PrescalerValue activePrescaler; /*!< TWPS currently programmed */
+
+#if TWI_TRACE_SIZE
+    static_assert(((TWI_TRACE_SIZE & (TWI_TRACE_SIZE - 1)) == 0) && (TWI_TRACE_SIZE <= 256),
+                  "TWI_TRACE_SIZE has to be a power of two up to 256");
+    static TWITraceEntry trace[TWI_TRACE_SIZE]; /*!< Ring of the latest interrupts */
+    static uint8_t traceNext; /*!< Entry written by the next interrupt */
+    static bool traceWrapped; /*!< All entries of the ring are valid */
+#endif
+
+#if TWI_STATISTICS
+    static TWIStatistics statistics; /*!< Counters updated from the interrupt */
+    static uint16_t transactionStart; /*!< TWI_TIMER when the current transaction was started */
+#endif
 };
+#if TWI_GLOBAL_INSTANCE
 extern TWI twi;
+#endif
 
 #endif //ATMEGA_TWI_TWI_H
\ No newline at end of file
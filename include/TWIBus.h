@@ -0,0 +1,76 @@
+//
+// Master side of a TWI bus, implemented by the TWI peripheral and by software buses.
+//
+
+#ifndef ATMEGA_TWI_TWIBUS_H
+#define ATMEGA_TWI_TWIBUS_H
+
+#include "TWI.h"
+
+/****************************************************************/
+/* Transaction interface of a bus master. The device drivers    */
+/* (TWIEeprom, TWIRegisterCache, TWIScheduler) work on any bus, */
+/* so devices can be spread over the TWI peripheral and         */
+/* software buses that all transfer at the same time.           */
+/****************************************************************/
+class TWIBus {
+public:
+    /** Queues a transaction, false if the queue is full or the bus cannot run it **/
+    virtual bool submit(TWITransaction &transaction) = 0;
+
+    /** Whether a submitted transaction is finished **/
+    virtual bool poll(const TWITransaction &transaction) = 0;
+
+    /** Waits until a submitted transaction is finished **/
+    virtual TWIResult wait(const TWITransaction &transaction) = 0;
+
+    /** Whether the bus can run the transaction at all, submit() refuses it otherwise **/
+    virtual bool supports(const TWITransaction &transaction) const;
+
+    /** Timeouts and restarts of transactions nobody waits for, to be called periodically, e.g. from a timer **/
+    virtual void service();
+
+    /** Blocking transfers **/
+    TWIResult write(uint8_t slaveAddress, const uint8_t *data, uint16_t length);
+
+    TWIResult read(uint8_t slaveAddress, uint8_t *data, uint16_t length);
+
+    TWIResult writeRegister(uint8_t slaveAddress,
+                            uint16_t reg,
+                            const uint8_t *data,
+                            uint16_t length,
+                            TWIRegisterSize registerSize = TWIRegisterSize::Byte);
+
+    TWIResult readRegister(uint8_t slaveAddress,
+                           uint16_t reg,
+                           uint8_t *data,
+                           uint16_t length,
+                           TWIRegisterSize registerSize = TWIRegisterSize::Byte);
+
+    /** Submits a transaction on caller owned memory and waits for it **/
+    virtual TWIResult transfer(TWITransaction &transaction);
+
+protected:
+    ~TWIBus() = default;
+};
+
+/****************************************************************/
+/* The TWI peripheral as TWIBus. The ATmega has a single TWI,   */
+/* its state is shared by all TWI objects, so there is a single */
+/* hardware bus as well.                                        */
+/****************************************************************/
+class TWIHardwareBus : public TWIBus {
+public:
+    bool submit(TWITransaction &transaction) override { return bus.submit(transaction); }
+    bool poll(const TWITransaction &transaction) override { return bus.poll(transaction); }
+    TWIResult wait(const TWITransaction &transaction) override { return bus.wait(transaction); }
+    TWIResult transfer(TWITransaction &transaction) override { return bus.transfer(transaction); }
+    void service() override { bus.service(); }
+
+    static TWIHardwareBus &instance();
+
+private:
+    TWI bus;
+};
+
+#endif //ATMEGA_TWI_TWIBUS_H
@@ -0,0 +1,60 @@
+//
+// Compile time configured front-end of the TWI driver.
+//
+
+#ifndef ATMEGA_TWI_TWICONFIG_H
+#define ATMEGA_TWI_TWICONFIG_H
+
+#include "TWI.h"
+
+/****************************************************************/
+/* TWI configuration resolved at compile time. TWBR and TWPS    */
+/* are computed by the compiler, unreachable frequencies are    */
+/* rejected and the buffers are sized per firmware image. TWPS  */
+/* is the smallest prescaler keeping TWBR within 255 unless it  */
+/* is given explicitly.                                         */
+/*                                                              */
+/*   typedef TWIConfig<TWIMode::Master, 400000> Bus;            */
+/*   Bus::begin();                                              */
+/****************************************************************/
+template <TWIMode Mode,
+          uint32_t Frequency = 100000,
+          PrescalerValue Prescaler = TWI::prescalerFor(Frequency),
+          uint8_t TxBufferSize = 32,
+          uint8_t RxBufferSize = 32>
+class TWIConfig {
+    static_assert(Frequency <= 400000, "TWI frequency above 400 kHz");
+    static_assert(F_CPU / Frequency > 16, "TWI frequency too high for F_CPU");
+    static_assert(TWI::bitRateDivider(Frequency, Prescaler) <= 0xFF,
+                  "TWI frequency too low for this prescaler, select a larger prescaler");
+    static_assert((Mode == TWIMode::Slave) || (TWI::bitRateDivider(Frequency, Prescaler) >= 10),
+                  "TWBR has to be at least 10 in master mode, select a smaller prescaler");
+    static_assert((TxBufferSize > 0) && (RxBufferSize > 0), "TWI buffers cannot be empty");
+
+public:
+    static constexpr uint8_t bitRate = static_cast<uint8_t>(TWI::bitRateDivider(Frequency, Prescaler));
+    static constexpr PrescalerValue prescaler = Prescaler;
+
+    /*!
+     * Sets up the TWI without any runtime bit rate computation
+     * @param slaveAddress Address when slave mode is selected
+     */
+    static void begin(uint8_t slaveAddress = 0x01)
+    {
+        TWI bus;
+        bus.setBuffers(txBuffer, TxBufferSize, rxBuffer, RxBufferSize);
+        bus.configure(Mode, slaveAddress, bitRate, Prescaler);
+    }
+
+private:
+    static uint8_t txBuffer[TxBufferSize];
+    static uint8_t rxBuffer[RxBufferSize];
+};
+
+template <TWIMode Mode, uint32_t Frequency, PrescalerValue Prescaler, uint8_t TxBufferSize, uint8_t RxBufferSize>
+uint8_t TWIConfig<Mode, Frequency, Prescaler, TxBufferSize, RxBufferSize>::txBuffer[TxBufferSize];
+
+template <TWIMode Mode, uint32_t Frequency, PrescalerValue Prescaler, uint8_t TxBufferSize, uint8_t RxBufferSize>
+uint8_t TWIConfig<Mode, Frequency, Prescaler, TxBufferSize, RxBufferSize>::rxBuffer[RxBufferSize];
+
+#endif //ATMEGA_TWI_TWICONFIG_H
@@ -0,0 +1,74 @@
+//
+// Storage driver for AT24Cxx EEPROMs and I2C FRAMs.
+//
+
+#ifndef ATMEGA_TWI_TWIEEPROM_H
+#define ATMEGA_TWI_TWIEEPROM_H
+
+#include "TWIBus.h"
+
+/****************************************************************/
+/* ACK polls after a page write until the chip is considered    */
+/* dead, about 25 us each at 400 kHz                            */
+/****************************************************************/
+#ifndef TWI_EEPROM_POLL_LIMIT
+#define TWI_EEPROM_POLL_LIMIT 1000
+#endif
+
+/****************************************************************/
+/* Linear memory on one or more chips at consecutive slave      */
+/* addresses. Writes are split along pages and chips, the write */
+/* cycle is waited for by ACK polling right before the chip is  */
+/* accessed next, so the CPU is free while the chip programs.   */
+/*                                                              */
+/*   TWIEeprom log(0x50, 32768, 64, TWIRegisterSize::Word, 2);  */
+/*   log.write(address, record, sizeof(record));                */
+/*                                                              */
+/* Examples of the geometry:                                    */
+/*   24C02      chipSize 256,   pageSize 8,  Byte, 1 chip       */
+/*   24C16      chipSize 256,   pageSize 16, Byte, 8 chips (the */
+/*              block select bits are part of the slave address)*/
+/*   24C256     chipSize 32768, pageSize 64, Word               */
+/*   FM24CL64   chipSize 8192,  pageSize 0,  Word (FRAM, no     */
+/*              pages and no write cycle)                       */
+/****************************************************************/
+class TWIEeprom {
+public:
+    /** Chips at consecutive addresses, the 3 address pins of an AT24Cxx select one of 8 **/
+    static const uint8_t MAX_CHIPS = 8;
+
+    TWIEeprom(uint8_t address,
+              uint32_t chipSize,
+              uint16_t pageSize,
+              TWIRegisterSize addressSize = TWIRegisterSize::Word,
+              uint8_t chips = 1,
+              TWIBus &bus = TWIHardwareBus::instance());
+
+    /** Size of the whole memory in bytes **/
+    uint32_t size() const { return chipSize * chips; }
+
+    TWIResult write(uint32_t address, const uint8_t *data, uint16_t length);
+
+    TWIResult read(uint32_t address, uint8_t *data, uint16_t length);
+
+    /** Waits for the write cycles of all chips **/
+    TWIResult sync();
+
+    /** ACK polls of the last write cycles, for tuning **/
+    uint32_t getPolls() const { return polls; }
+
+private:
+    // Waits until the write cycle of a chip is over
+    TWIResult ready(uint8_t chip);
+
+    TWIBus &bus;
+    uint8_t baseAddress;
+    uint32_t chipSize;
+    uint16_t pageSize;
+    TWIRegisterSize addressSize;
+    uint8_t chips;
+    uint8_t writeCycles;        /*!< Bit n is set while chip n may still be programming, one bit per chip */
+    uint32_t polls;
+};
+
+#endif //ATMEGA_TWI_TWIEEPROM_H
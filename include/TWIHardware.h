@@ -0,0 +1,174 @@
+//
+// Register access layer of the TWI driver.
+//
+
+#ifndef ATMEGA_TWI_TWIHARDWARE_H
+#define ATMEGA_TWI_TWIHARDWARE_H
+
+/****************************************************************/
+/* The register access is selected at compile time. Defining    */
+/* TWI_HOST builds the driver against the simulated peripheral  */
+/* of the virtual bus, otherwise the AVR registers are used.    */
+/****************************************************************/
+#ifdef TWI_HOST
+#include "TWIHostHardware.h"
+#else
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <stdint.h>
+#include "util/delay.h"
+
+/** Free running 16 bit timer of the driver: transaction timeouts, the backoff after lost arbitration, the statistics
+ * and the trace are timed with it. configure() runs TWI_TIMER_START, which starts Timer1 at F_CPU / 8 unless it is
+ * running already. An application timing the driver with another timer defines both.
+ * TWI_TIMER_WAKEUP arms a compare interrupt at a count of TWI_TIMER, which wakes TWIWaitMode::Sleep when a transaction
+ * times out, TWI_TIMER_NO_WAKEUP disarms it. With Timer1 these use the compare unit B and TWI_TIMER_VECT, the empty
+ * handler is defined in TWI.cpp. With another timer the application may define both along with its own handler,
+ * otherwise a hung bus is detected on the next interrupt of any source **/
+#ifndef TWI_TIMER
+#define TWI_TIMER TCNT1
+#define TWI_TIMER_START()                                                           \
+    do {                                                                            \
+        if ((TCCR1B & ((1 << CS12) | (1 << CS11) | (1 << CS10))) == 0) {            \
+            TCCR1B |= (1 << CS11);                                                  \
+        }                                                                           \
+    } while (0)
+#define TWI_TIMER_WAKEUP(count)                                                     \
+    do {                                                                            \
+        OCR1B = (count);                                                            \
+        TIFR1 = (1 << OCF1B);                                                       \
+        TIMSK1 |= (1 << OCIE1B);                                                    \
+    } while (0)
+#define TWI_TIMER_NO_WAKEUP() (TIMSK1 &= ~(1 << OCIE1B))
+#define TWI_TIMER_VECT TIMER1_COMPB_vect
+#endif
+#ifndef TWI_TIMER_START
+#define TWI_TIMER_START()
+#endif
+#ifndef TWI_TIMER_WAKEUP
+#define TWI_TIMER_WAKEUP(count) ((void)(count))
+#define TWI_TIMER_NO_WAKEUP()
+#endif
+
+/** Port pins of SCL and SDA, driven directly during a bus recovery **/
+#ifndef TWI_SCL_BIT
+#if defined(__AVR_ATmega640__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega1281__) || \
+    defined(__AVR_ATmega2560__) || defined(__AVR_ATmega2561__)
+#define TWI_PORT_DDR    DDRD
+#define TWI_PORT_OUT    PORTD
+#define TWI_PORT_IN     PIND
+#define TWI_SCL_BIT     0
+#define TWI_SDA_BIT     1
+#else
+#define TWI_PORT_DDR    DDRC
+#define TWI_PORT_OUT    PORTC
+#define TWI_PORT_IN     PINC
+#define TWI_SCL_BIT     5
+#define TWI_SDA_BIT     4
+#endif
+#endif
+
+/** Program memory address, 32 bit to reach beyond 64 KB on the ATmega1280/2560. pgm_get_far_address() gives the
+ * address of a table placed there, a PROGMEM pointer converts to it for the lower 64 KB **/
+typedef uint32_t TWIFlashAddress;
+
+/** Port pin of a software TWI line, e.g. {&DDRB, &PORTB, &PINB, 1 << PB0}. The line is open drain: pulled low through
+ * the data direction register with the output latch at 0, released to the external pull-up resistor **/
+typedef struct TWIPin {
+    volatile uint8_t *ddr;
+    volatile uint8_t *port;
+    volatile uint8_t *pin;
+    uint8_t mask;
+} TWIPin;
+
+namespace TWIHardware {
+
+    /** TWCR – TWI Control Register **/
+    inline uint8_t readControl() { return TWCR; }
+    inline void writeControl(uint8_t value) { TWCR = value; }
+
+    /** TWSR – TWI Status Register, status bits and TWPS prescaler bits **/
+    inline uint8_t readStatus() { return TWSR; }
+    inline void writeStatus(uint8_t value) { TWSR = value; }
+
+    /** TWDR – TWI Data Register **/
+    inline uint8_t readData() { return TWDR; }
+    inline void writeData(uint8_t value) { TWDR = value; }
+
+    /** TWBR – TWI Bit Rate Register **/
+    inline void writeBitRate(uint8_t value) { TWBR = value; }
+
+    /** TWAR – TWI (Slave) Address Register **/
+    inline void writeAddress(uint8_t value) { TWAR = value; }
+
+    /** Byte of program memory, ELPM where RAMPZ exists **/
+#ifdef RAMPZ
+    inline uint8_t readFlash(TWIFlashAddress address) { return pgm_read_byte_far(address); }
+#else
+    inline uint8_t readFlash(TWIFlashAddress address) { return pgm_read_byte(static_cast<uint16_t>(address)); }
+#endif
+
+    /** Entry of a PROGMEM table of the driver, LPM only since the linker places .progmem in the lower 64 KB **/
+    inline uint8_t readTable(const uint8_t *entry) { return pgm_read_byte(entry); }
+
+    /** Function pointer of a PROGMEM table of the driver, 16 bit wide on the AVR **/
+    template <typename Function>
+    inline Function readFunction(const Function *entry) { return reinterpret_cast<Function>(pgm_read_word(entry)); }
+
+    /** Current count of TWI_TIMER **/
+    inline uint16_t readTimer() { return TWI_TIMER; }
+    inline void startTimer() { TWI_TIMER_START(); }
+    /** Compare interrupt of TWI_TIMER at count, only while interrupts are disabled **/
+    inline void armWakeup(uint16_t count) { TWI_TIMER_WAKEUP(count); }
+    inline void disarmWakeup() { TWI_TIMER_NO_WAKEUP(); }
+
+    /** SCL and SDA as open drain port pins, only while the TWI is disabled. Pulling drives the line low, releasing
+     * leaves it to the pull-up resistors **/
+    inline void pullSCL() { TWI_PORT_OUT &= ~(1 << TWI_SCL_BIT); TWI_PORT_DDR |= (1 << TWI_SCL_BIT); }
+    inline void releaseSCL() { TWI_PORT_DDR &= ~(1 << TWI_SCL_BIT); }
+    inline void pullSDA() { TWI_PORT_OUT &= ~(1 << TWI_SDA_BIT); TWI_PORT_DDR |= (1 << TWI_SDA_BIT); }
+    inline void releaseSDA() { TWI_PORT_DDR &= ~(1 << TWI_SDA_BIT); }
+    inline bool readSDA() { return (TWI_PORT_IN & (1 << TWI_SDA_BIT)) != 0; }
+    /** The pin registers follow the lines also while the TWI drives them **/
+    inline bool readSCL() { return (TWI_PORT_IN & (1 << TWI_SCL_BIT)) != 0; }
+
+    /** Lines of a software TWI, see TWIPin **/
+    inline void initPin(const TWIPin &pin) { *pin.ddr &= ~pin.mask; *pin.port &= ~pin.mask; }
+    inline void pullPin(const TWIPin &pin) { *pin.ddr |= pin.mask; }
+    inline void releasePin(const TWIPin &pin) { *pin.ddr &= ~pin.mask; }
+    inline bool readPin(const TWIPin &pin) { return (*pin.pin & pin.mask) != 0; }
+
+    /** Half period of the recovery clock, 100 kHz **/
+    inline void recoveryDelay() { _delay_us(5); }
+
+    /** Called by busy-wait loops while the peripheral is working **/
+    inline void idle() { _delay_us(1); }
+
+    /** Idle sleep until the next interrupt, the TWI keeps running. Called with interrupts disabled, returns with them
+     * enabled. sleep_cpu() directly follows sei(), so an interrupt pending at that point ends the sleep **/
+    inline void sleep()
+    {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+
+    /** Disables interrupts for the lifetime of the object and restores the previous state afterwards **/
+    class InterruptGuard {
+    public:
+        InterruptGuard() : sreg(SREG) { cli(); }
+        ~InterruptGuard() { SREG = sreg; }
+    private:
+        uint8_t sreg;
+    };
+}
+#endif
+
+// Defining the TWI status
+#define TWI_STATUS	(TWIHardware::readStatus() & 0xF8)
+
+#endif //ATMEGA_TWI_TWIHARDWARE_H
@@ -0,0 +1,56 @@
+//
+// Single-producer/single-consumer ring of framed messages.
+//
+
+#ifndef ATMEGA_TWI_TWIMESSAGERING_H
+#define ATMEGA_TWI_TWIMESSAGERING_H
+
+#include <stdint.h>
+
+/****************************************************************/
+/* Ring of framed messages, each stored as a length byte        */
+/* followed by the payload. One side produces, the other side   */
+/* consumes; neither needs to disable interrupts since each     */
+/* index is only written by one side and fits into one byte.    */
+/****************************************************************/
+class TWIMessageRing {
+public:
+    TWIMessageRing();
+
+    /** Sets the storage of the ring and empties it **/
+    void attach(uint8_t *storage, uint8_t storageSize);
+
+    /** Producer side **/
+    bool start();               /*!< Opens a new frame, false if not even the length byte fits */
+    bool put(uint8_t data);     /*!< Appends to the open frame, false if the ring is full */
+    bool hasRoom() const;       /*!< true if one more byte fits into the open frame */
+    void commit();              /*!< Publishes the open frame to the consumer */
+    void discard();             /*!< Drops the open frame */
+    uint8_t frameSize() const;  /*!< Bytes put into the open frame, 0 if none is open */
+    void unput();               /*!< Removes the last byte of the open frame */
+    bool write(const uint8_t *data, uint8_t length); /*!< Writes a complete frame, false if it does not fit */
+
+    /** Consumer side **/
+    bool available() const;     /*!< true if a frame has been published */
+    uint8_t open();             /*!< Length of the oldest frame, its payload is returned by next() */
+    uint8_t next();             /*!< Next payload byte of the opened frame */
+    void release();             /*!< Drops the oldest frame */
+    uint8_t read(uint8_t *data, uint8_t maxLength); /*!< Copies and drops the oldest frame, 0 if none */
+
+    volatile uint8_t overflows; /*!< Frames dropped by the producer because the ring was full */
+
+private:
+    uint8_t advance(uint8_t index) const { return static_cast<uint8_t>((index + 1 < size) ? (index + 1) : 0); }
+
+    uint8_t *buffer;
+    uint8_t size;
+    volatile uint8_t head;      /*!< Length byte of the oldest frame, written by the consumer only */
+    volatile uint8_t tail;      /*!< End of the published frames, written by the producer only */
+    uint8_t frameStart;         /*!< Producer: length byte of the open frame */
+    uint8_t writeIndex;         /*!< Producer: next free byte of the open frame */
+    uint8_t frameLength;        /*!< Producer: payload length of the open frame */
+    bool frameOpen;             /*!< Producer: a frame has been started */
+    uint8_t readIndex;          /*!< Consumer: next payload byte of the opened frame */
+};
+
+#endif //ATMEGA_TWI_TWIMESSAGERING_H
@@ -0,0 +1,81 @@
+//
+// Shadow copy of the registers of a slave device.
+//
+
+#ifndef ATMEGA_TWI_TWIREGISTERCACHE_H
+#define ATMEGA_TWI_TWIREGISTERCACHE_H
+
+#include "TWIBus.h"
+
+/** Bytes of the flag storage of a cache of count registers: valid, dirty and cacheable bitmaps **/
+#define TWI_CACHE_FLAG_BYTES(count) (3 * (((count) + 7) / 8))
+
+/****************************************************************/
+/* Registers 0 to count - 1 of a device mirrored in RAM. Writes */
+/* of values the device already holds are left out, reads of    */
+/* cacheable registers are served from the shadow once known.   */
+/* Staged writes are collected and flushed as burst writes.     */
+/* Only registers that change by writes of the master alone     */
+/* may be marked cacheable, not status or data registers.       */
+/*                                                              */
+/*   static uint8_t shadow[0x40];                               */
+/*   static uint8_t flags[TWI_CACHE_FLAG_BYTES(0x40)];          */
+/*   TWIRegisterCache imu(0x68, shadow, flags, 0x40);           */
+/*   imu.setCacheable(0x19, 4);                                 */
+/****************************************************************/
+class TWIRegisterCache {
+public:
+    TWIRegisterCache(uint8_t address,
+                     uint8_t *shadow,
+                     uint8_t *flags,
+                     uint16_t count,
+                     TWIRegisterSize registerSize = TWIRegisterSize::Byte,
+                     TWIBus &bus = TWIHardwareBus::instance());
+
+    /** Marks registers as cacheable, or as volatile which also forgets their values **/
+    void setCacheable(uint16_t first, uint16_t count, bool cacheable = true);
+
+    /** Write-through, only the changed part of the range goes over the bus **/
+    TWIResult write(uint16_t reg, const uint8_t *data, uint16_t length);
+
+    /** Reads from the shadow if all registers are cacheable and known, from the device otherwise **/
+    TWIResult read(uint16_t reg, uint8_t *data, uint16_t length);
+
+    /** Write-back: updates the shadow only, the device is written by flush() **/
+    TWIResult stage(uint16_t reg, const uint8_t *data, uint16_t length);
+
+    /** Writes all staged registers, runs of them as burst writes **/
+    TWIResult flush();
+
+    /** Forgets all values, e.g. after a reset of the device. Staged registers are dropped **/
+    void invalidate();
+
+    /** Bytes served from the shadow and bytes of writes left out **/
+    uint32_t getHits() const { return hits; }
+    uint32_t getSkipped() const { return skipped; }
+
+private:
+    enum Flag : uint8_t
+    {
+        Valid = 0,
+        Dirty = 1,
+        Cacheable = 2
+    };
+
+    bool test(Flag flag, uint16_t reg) const;
+    void assign(Flag flag, uint16_t reg, bool value);
+    bool known(uint16_t reg) const { return test(Cacheable, reg) && test(Valid, reg); }
+    bool unchanged(uint16_t reg, uint8_t value) const;
+
+    TWIBus &bus;
+    uint8_t address;
+    uint8_t *shadow;
+    uint8_t *flags;
+    uint16_t count;
+    TWIRegisterSize registerSize;
+    uint16_t mapBytes;          /*!< Bytes of one bitmap */
+    uint32_t hits;
+    uint32_t skipped;
+};
+
+#endif //ATMEGA_TWI_TWIREGISTERCACHE_H
@@ -0,0 +1,131 @@
+//
+// Periodic background reads of sensor registers.
+//
+
+#ifndef ATMEGA_TWI_TWISCHEDULER_H
+#define ATMEGA_TWI_TWISCHEDULER_H
+
+#include "TWIBus.h"
+
+/****************************************************************/
+/* Longest read of a TWIPollJob. Every job receives into its    */
+/* own buffer of this size, finished reads are copied to data.  */
+/****************************************************************/
+#ifndef TWI_POLL_LENGTH
+#define TWI_POLL_LENGTH 16
+#endif
+
+/****************************************************************/
+/* Periodic register read. The application fills in the first   */
+/* fields, the rest is owned by the scheduler.                  */
+/*                                                              */
+/*   static uint8_t accel[6];                                   */
+/*   static TWIPollJob jobs[] = {                               */
+/*       {0x68, TWIRegisterSize::Byte, 0x3B, accel, 6, 10},     */
+/*   };                                                         */
+/****************************************************************/
+typedef struct TWIPollJob {
+    uint8_t address;            /*!< 7 bit address of the slave device */
+    TWIRegisterSize registerSize; /*!< Size of the register address, None for plain reads */
+    uint16_t reg;               /*!< First register to read */
+    uint8_t *data;              /*!< Destination of the register contents, read it through TWIScheduler::read() */
+    uint8_t length;             /*!< Number of registers to read, up to TWI_POLL_LENGTH */
+    uint16_t period;            /*!< Ticks between two reads, 0 disables the job */
+
+    /** Set by the scheduler **/
+    uint16_t countdown;         /*!< Ticks until the next read */
+    volatile uint8_t sequence;  /*!< Odd while a finished read is copied to data, incremented by 2 per copy */
+    volatile TWIResult lastResult; /*!< Result of the last finished read */
+    uint16_t overruns;          /*!< Reads skipped because the previous one was still queued */
+    uint16_t errors;            /*!< Reads that did not finish with TWIResult::Success */
+    TWITransaction transaction;
+    uint8_t received[TWI_POLL_LENGTH]; /*!< The read on the bus writes here, data keeps the last snapshot meanwhile */
+} TWIPollJob;
+
+struct TWIReadyPoll;
+
+/*!
+ * Called from within the TWI interrupt when a ready poll finished
+ * @param poll Poll passed to TWIScheduler::pollUntil(), its result is set
+ */
+typedef void (*TWIReadyCallback)(TWIReadyPoll *poll);
+
+/****************************************************************/
+/* Status register polled until (status & mask) == expected,    */
+/* followed by the read of the data registers. The status reads */
+/* are repeated by the scheduler, the data read is queued from  */
+/* the interrupt that read the matching status.                 */
+/*                                                              */
+/*   static uint8_t sample[6];                                  */
+/*   static TWIReadyPoll ready = {                              */
+/*       0x1E, TWIRegisterSize::Byte, 0x09, 0x01, 0x01, 1, 50,  */
+/*       0x03, sample, 6, sampleRead};                          */
+/****************************************************************/
+typedef struct TWIReadyPoll {
+    uint8_t address;            /*!< 7 bit address of the slave device */
+    TWIRegisterSize registerSize; /*!< Size of the register addresses */
+    uint16_t statusReg;         /*!< Status register, read as 1 byte */
+    uint8_t mask;               /*!< Status bits compared */
+    uint8_t expected;           /*!< Value of the masked status bits that ends the polling */
+    uint16_t interval;          /*!< Ticks between two status reads, 0 repeats them back-to-back from the interrupt */
+    uint16_t maxTries;          /*!< Status reads until the poll fails with TWIResult::Timeout, 0 for no limit */
+    uint16_t dataReg;           /*!< First data register */
+    uint8_t *data;              /*!< Destination of the data registers */
+    uint16_t length;            /*!< Number of data registers, 0 ends the poll with the matching status read */
+    TWIReadyCallback callback;  /*!< Completion callback, may be nullptr */
+    void *context;              /*!< User data for the callback */
+
+    /** Set by the scheduler **/
+    volatile TWIResult result;  /*!< Pending until the data has been read or the poll failed */
+    uint16_t tries;             /*!< Status reads so far */
+    uint8_t status;             /*!< Last status read */
+    bool ready;                 /*!< Status matched, the data read is queued or waits for room in the queue */
+    uint16_t countdown;         /*!< Ticks until the next read, 0 while a read is queued */
+    TWIReadyPoll *next;         /*!< Next poll of the scheduler */
+    TWIBus *bus;                /*!< Bus of the scheduler */
+    TWITransaction transaction;
+} TWIReadyPoll;
+
+/****************************************************************/
+/* Runs a table of TWIPollJob from a timer interrupt. All jobs  */
+/* due in a tick are submitted at once and the TWI interrupt    */
+/* chains them back-to-back, the main loop only reads the       */
+/* snapshots and calls service().                               */
+/****************************************************************/
+class TWIScheduler {
+public:
+    explicit TWIScheduler(TWIBus &bus = TWIHardwareBus::instance());
+
+    /** Sets the job table and staggers the first reads **/
+    void start(TWIPollJob *jobs, uint8_t count);
+
+    /** Stops submitting reads, reads already queued still finish **/
+    void stop();
+
+    /** Submits the due jobs, to be called from a timer interrupt **/
+    void tick();
+
+    /** Services the bus if a tick passed since the last call, to be called from the main loop **/
+    void service();
+
+    /** Starts polling a status register, the data is read once the status matches **/
+    bool pollUntil(TWIReadyPoll &poll);
+
+    /** Copies the latest complete snapshot of a job, not to be called from interrupts **/
+    bool read(const TWIPollJob &job, uint8_t *data, uint8_t *sequence = nullptr) const;
+
+private:
+    static void finished(TWITransaction *transaction);
+    static void statusRead(TWITransaction *transaction);
+    static void dataRead(TWITransaction *transaction);
+    static void submitRead(TWIReadyPoll &poll);
+    static void finishPoll(TWIReadyPoll &poll, TWIResult result);
+
+    TWIBus &bus;
+    TWIPollJob *volatile jobTable;
+    volatile uint8_t jobCount;
+    TWIReadyPoll *volatile readyPolls;
+    volatile bool serviceDue;   /*!< A tick passed since the last service() */
+};
+
+#endif //ATMEGA_TWI_TWISCHEDULER_H
@@ -0,0 +1,103 @@
+//
+// TWI master bit-banged on two port pins, clocked by a timer interrupt.
+//
+
+#ifndef ATMEGA_TWI_TWISOFTBUS_H
+#define ATMEGA_TWI_TWISOFTBUS_H
+
+#include "TWIBus.h"
+
+/****************************************************************/
+/* Ticks SCL may be held low by a slave, or the bus may stay    */
+/* busy before a START, until a transaction of a software bus   */
+/* fails with TWIResult::Timeout. TWITransaction::timeout       */
+/* overrides it, counted in ticks of the software bus as well.  */
+/****************************************************************/
+#ifndef TWI_SOFT_TIMEOUT
+#define TWI_SOFT_TIMEOUT 1000
+#endif
+
+/****************************************************************/
+/* Software TWI master on any two port pins with external       */
+/* pull-ups. tick() is called from a timer interrupt and does   */
+/* one step on the bus, SCL runs at half the tick rate. Each    */
+/* bus has its own queue and transfer state, so several buses   */
+/* and the TWI peripheral transfer at the same time.            */
+/* Segments and SMBus PEC need the TWI peripheral, submit()     */
+/* refuses them and transfer() reports TWIResult::Unsupported.  */
+/* Reads of 0 bytes are refused too, probe with a 0 byte write. */
+/*                                                              */
+/*   TWISoftBus sensors({&DDRB, &PORTB, &PINB, 1 << PB0},       */
+/*                      {&DDRB, &PORTB, &PINB, 1 << PB1});      */
+/*   ISR(TIMER2_COMPA_vect) { sensors.tick(); }                 */
+/****************************************************************/
+class TWISoftBus : public TWIBus {
+public:
+    TWISoftBus(const TWIPin &scl, const TWIPin &sda);
+
+    bool submit(TWITransaction &transaction) override;
+    bool poll(const TWITransaction &transaction) override;
+    TWIResult wait(const TWITransaction &transaction) override;
+    bool supports(const TWITransaction &transaction) const override;
+
+    /** One step on the bus, to be called from a timer interrupt at twice the SCL frequency **/
+    void tick();
+
+    /** Whether the queue is empty and the bus has been released **/
+    bool isIdle() const;
+
+private:
+    enum class Step : uint8_t {
+        Idle,           /*!< Bus released, the next transaction starts with a START */
+        Held,           /*!< SCL low after a transaction with repeatedStart, the next one starts with a repeated START */
+        Started,        /*!< SDA pulled while SCL is high */
+        ClockLow,       /*!< SCL low, SDA set for the current bit */
+        ClockHigh,      /*!< SCL released, SDA is sampled once it is high */
+        RestartLow,     /*!< SCL low, SDA released for a repeated START */
+        RestartHigh,    /*!< SCL released, SDA is pulled once it is high */
+        StopLow,        /*!< SCL low, SDA pulled for the STOP */
+        StopHigh        /*!< SCL released, SDA is released once it is high */
+    };
+
+    enum class Phase : uint8_t {
+        Address,        /*!< SLA+R/W */
+        Register,       /*!< Register address bytes */
+        Data            /*!< Data bytes */
+    };
+
+    void load(TWITransaction *transaction);
+    void clockOut();
+    void sample();
+    void byteDone(bool acknowledged);
+    void startData();
+    void loadByte();
+    void restart();
+    void end(TWIResult result);
+    bool stretched();
+    void complete(TWIResult result);
+
+    TWIPin sclPin;
+    TWIPin sdaPin;
+
+    // Transaction queue
+    static_assert((TWI_QUEUE_SIZE & (TWI_QUEUE_SIZE - 1)) == 0, "TWI_QUEUE_SIZE has to be a power of two");
+    TWITransaction *queue[TWI_QUEUE_SIZE]; /*!< Submitted transactions, head is the one on the bus */
+    volatile uint8_t queueHead;
+    volatile uint8_t queueTail;
+    TWITransaction *volatile current; /*!< Transaction on the bus, nullptr between transactions */
+
+    // Transfer state, only touched by tick()
+    volatile Step step;
+    Phase phase;
+    bool reading;               /*!< Current SLA+R/W is a read */
+    uint8_t shift;              /*!< Byte being clocked out or in */
+    uint8_t bit;                /*!< Bit of the byte on the bus, 8 is the ACK */
+    uint8_t *cursor;            /*!< Next byte in the caller's buffer */
+    TWIFlashAddress flashCursor; /*!< Next byte of a write from program memory, 0 if writing from RAM */
+    uint16_t remaining;         /*!< Data bytes left */
+    uint8_t registerRemaining;  /*!< Register address bytes left */
+    uint16_t waited;            /*!< Ticks the bus did not follow the master, see TWI_SOFT_TIMEOUT */
+    TWIResult stopResult;       /*!< Result reported once the STOP is on the bus */
+};
+
+#endif //ATMEGA_TWI_TWISOFTBUS_H
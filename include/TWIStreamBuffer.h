@@ -0,0 +1,54 @@
+//
+// Double buffer feeding the slave transmitter with a stream of any length.
+//
+
+#ifndef ATMEGA_TWI_TWISTREAMBUFFER_H
+#define ATMEGA_TWI_TWISTREAMBUFFER_H
+
+#include <stdint.h>
+
+/*!
+ * Called from within the TWI interrupt when a block has been sent, refills it with the next part of the stream
+ * @param block Block to fill
+ * @param size Size of the block
+ * @return Number of bytes written to block, 0 if no data is available yet
+ */
+typedef uint8_t (*TWIStreamRefill)(uint8_t *block, uint8_t size);
+
+/****************************************************************/
+/* Two blocks served to the master one after the other. While   */
+/* the ISR sends one block the application fills the other, or  */
+/* the ISR refills a block through a callback once it has been  */
+/* sent. A block is owned by the application while its length   */
+/* is 0 and by the ISR otherwise, so neither side disables      */
+/* interrupts. Read transfers continue where the last one       */
+/* stopped; the stream is not tied to transfer boundaries.      */
+/****************************************************************/
+class TWIStreamBuffer {
+public:
+    TWIStreamBuffer();
+
+    /** Sets the blocks and empties the stream, with a refill callback both blocks are filled right away **/
+    void attach(uint8_t *first, uint8_t *second, uint8_t blockSize, TWIStreamRefill refill = nullptr);
+
+    /** Producer side **/
+    uint8_t *acquire();             /*!< Block to fill next, nullptr while both blocks are queued */
+    void publish(uint8_t length);   /*!< Queues the acquired block with length bytes */
+    uint8_t getBlockSize() const { return size; }
+
+    /** Consumer side **/
+    bool next(uint8_t &data);       /*!< Next byte of the stream, false if both blocks are empty */
+
+    volatile uint16_t underruns;    /*!< Bytes requested by a master while both blocks were empty */
+
+private:
+    uint8_t *blocks[2];
+    uint8_t size;
+    TWIStreamRefill refill;
+    volatile uint8_t lengths[2];    /*!< Bytes queued in each block, 0 hands the block to the application */
+    volatile uint8_t active;        /*!< Block being sent, written by the consumer only */
+    uint8_t index;                  /*!< Consumer: next byte of the active block */
+    uint8_t acquired;               /*!< Producer: block returned by acquire() */
+};
+
+#endif //ATMEGA_TWI_TWISTREAMBUFFER_H
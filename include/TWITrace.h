@@ -0,0 +1,32 @@
+//
+// Decoder of the TWI event trace.
+//
+
+#ifndef ATMEGA_TWI_TWITRACE_H
+#define ATMEGA_TWI_TWITRACE_H
+
+#include "TWI.h"
+
+/****************************************************************/
+/* Turns the entries returned by TWI::getTrace() into text.     */
+/* The output is passed line by line to a writer, e.g. a UART   */
+/* or the console, so no buffer for the whole dump is needed.   */
+/****************************************************************/
+typedef void (*TWITraceWriter)(const char *line);
+
+namespace TWITrace {
+
+    /** Name of a TWSR status code in program memory, e.g. "TWI_MT_SLA_NACK" **/
+    const char *statusName(uint8_t status);
+
+    /** Name of a TWIState in program memory, e.g. "MasterTransmitter" **/
+    const char *stateName(uint8_t state);
+
+    /** One line per entry: time in ticks, status code, status name, state and data byte **/
+    void printListing(const TWITraceEntry *entries, uint8_t count, TWITraceWriter write);
+
+    /** Value change dump of the status, state and data, readable by GTKWave and PulseView **/
+    void printVCD(const TWITraceEntry *entries, uint8_t count, uint32_t tickNs, TWITraceWriter write);
+}
+
+#endif //ATMEGA_TWI_TWITRACE_H
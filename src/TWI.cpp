@@ -3,25 +3,124 @@
 //
 
 #include <TWI.h>
-#include "util/delay.h"
 
+#if TWI_STATISTICS
+#define TWI_COUNT(counter) (statistics.counter++)
+#else
+#define TWI_COUNT(counter) ((void)0)
+#endif
+
+#if TWI_GLOBAL_INSTANCE
 TWI twi;
+#endif
+
+#if TWI_PEC
+/** CRC-8 with the polynomial x^8 + x^2 + x + 1 of every byte value, SMBus PEC **/
+static const uint8_t pecTable[256] PROGMEM = {
+        0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+        0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+        0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+        0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+        0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+        0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+        0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+        0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+        0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+        0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+        0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+        0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+        0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+        0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+        0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+        0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3
+};
 
-uint8_t TWI::txBuffer[TX_BUFFER_SIZE] = {0};
+#define TWI_PEC_UPDATE(crc, data) ((crc) = TWIHardware::readTable(&pecTable[(crc) ^ (data)]))
+#endif
+
+uint8_t TWI::defaultTxBuffer[TX_BUFFER_SIZE] = {0};
+uint8_t *TWI::txBuffer = nullptr;
+uint8_t TWI::txBufferSize = 0;
 uint8_t TWI::txIndex = 0;
 uint8_t TWI::txBufferLen = 0;
-uint8_t TWI::rxBuffer[TX_BUFFER_SIZE] = {0};
-uint8_t TWI::rxIndex = 0;
-uint8_t TWI::rxBufferLen = 0;
+uint8_t *TWI::rxBuffer = nullptr;
+uint8_t TWI::rxBufferSize = 0;
+uint8_t TWI::TWIPrescalerValue = 1;
+TWIMode TWI::mode = TWIMode::Master;
+uint8_t TWI::slaveModeAddress = 0;
 TWIInfoStruct TWI::TWIInfo = {Available, None, false};
-
-TWI::TWI()
-{
-
-}
+volatile uint16_t TWI::lastActivity = 0;
+uint8_t TWI::bitRateValue = 0;
+PrescalerValue TWI::prescalerValue = PrescalerValue::PRESCALE_VALUE_1;
+uint8_t TWI::activeBitRate = 0;
+PrescalerValue TWI::activePrescaler = PrescalerValue::PRESCALE_VALUE_1;
+#if TWI_MASTER
+TWITransaction *TWI::queue[TWI_QUEUE_SIZE] = {nullptr};
+volatile uint8_t TWI::queueHead = 0;
+volatile uint8_t TWI::queueTail = 0;
+TWITransaction *volatile TWI::current = nullptr;
+uint8_t *TWI::transferCursor = nullptr;
+TWIFlashAddress TWI::flashCursor = 0;
+uint16_t TWI::transferRemaining = 0;
+uint8_t TWI::registerRemaining = 0;
+TWIDirection TWI::transferDirection = TWIDirection::Write;
+const TWISegment *TWI::segment = nullptr;
+uint8_t TWI::segmentsRemaining = 0;
+uint16_t TWI::readAhead = 0;
+TWITransaction TWI::bufferTransaction = {};
+volatile bool TWI::restartPending = false;
+uint16_t TWI::restartStamp = 0;
+uint16_t TWI::restartBackoff = 0;
+uint16_t TWI::restartPolls = 0;
+volatile bool TWI::recovering = false;
+uint16_t TWI::sclReleased = 0;
+uint16_t TWI::sdaReleased = 0;
+uint16_t TWI::backoffSeed = 0xACE1;
+TWIWaitMode TWI::waitMode = TWI_WAIT_MODE;
+TWIYieldHook TWI::yieldHook = nullptr;
+TWIDeviceProfile *TWI::deviceProfiles = nullptr;
+uint8_t TWI::deviceProfileCount = 0;
+#if TWI_PEC
+uint8_t TWI::pecCrc = 0;
+bool TWI::pecTrailer = false;
+uint8_t TWI::readTrailer = 0;
+bool TWI::blockCountPending = false;
+bool TWI::blockOverflow = false;
+#endif
+#endif
+#if TWI_SLAVE
+uint8_t TWI::defaultRxBuffer[RX_BUFFER_SIZE] = {0};
+TWIMessageRing TWI::rxRing;
+TWIMessageRing TWI::txRing;
+uint8_t TWI::replyRemaining = 0;
+bool TWI::replyActive = false;
+TWIRegisterMap *TWI::registerMap = nullptr;
+bool TWI::registerPointerPending = false;
+uint8_t TWI::registerWriteFirst = 0;
+uint8_t TWI::registerWriteCount = 0;
+TWIStreamBuffer *TWI::slaveStream = nullptr;
+#if TWI_PEC
+bool TWI::slavePec = false;
+uint8_t TWI::slavePecCrc = 0;
+bool TWI::slavePecCarry = false;
+bool TWI::slavePecNext = false;
+volatile uint8_t TWI::slavePecErrors = 0;
+#endif
+#endif
+#if TWI_TRACE_SIZE
+TWITraceEntry TWI::trace[TWI_TRACE_SIZE] = {};
+uint8_t TWI::traceNext = 0;
+bool TWI::traceWrapped = false;
+#endif
+#if TWI_STATISTICS
+TWIStatistics TWI::statistics = {};
+uint16_t TWI::transactionStart = 0;
+#endif
 
 /*!
  * Function to set the transmission mode - Master or Slave
+ * Runtime wrapper of configure(), the bit rate is calculated from twiFrequency. The default buffers are used unless
+ * setBuffers() has been called before.
  * @param requestedMode Sets the transmission mode. Default mode is set to Master. For master - TWIMode::Slave, for
  * slave - TWIMode::Slave
  * @param setSlaveAddress Sets the address when slave mode is selected. Default value is set to 0x01. Value should be
@@ -37,100 +136,146 @@ void TWI::TWISetMode(TWIMode requestedMode,
                      uint8_t setSlaveAddress,
                      PrescalerValue value,
                      uint32_t twiFrequency)
+{
+    if (txBuffer == nullptr) {
+#if TWI_SLAVE
+        setBuffers(defaultTxBuffer, TX_BUFFER_SIZE, defaultRxBuffer, RX_BUFFER_SIZE);
+#else
+        // Master reads go straight into the caller's buffer
+        setBuffers(defaultTxBuffer, TX_BUFFER_SIZE, nullptr, 0);
+#endif
+    }
+    configure(requestedMode,
+              setSlaveAddress,
+              static_cast<uint8_t>(bitRateDivider(twiFrequency, value)),
+              value);
+}
+
+/*!
+ * Function to set the transmission mode with a precomputed bit rate
+ * @param requestedMode Master or slave
+ * @param setSlaveAddress Address when slave mode is selected
+ * @param bitRate Value of the TWBR register, see bitRateDivider()
+ * @param value Prescaler value
+ */
+void TWI::configure(TWIMode requestedMode,
+                    uint8_t setSlaveAddress,
+                    uint8_t bitRate,
+                    PrescalerValue value)
 {
     /* Set indexes to 0 */
     txIndex = 0;
     txBufferLen = 0;
-    rxIndex = 0;
-    rxBufferLen = 0;
+#if TWI_SLAVE
+    replyActive = false;
+    rxRing.attach(rxBuffer, rxBufferSize);
+#endif
     TWIInfo.state = Available;
     TWIInfo.repStart = false;
+    // Timeouts and the backoff after lost arbitration are measured with TWI_TIMER
+    TWIHardware::startTimer();
 
     /** default communication settings **/
-    //Set value of pre-scaler to 0
     this->setPrescaler(value);
-    //Set frequency of TWI communication
-    //Default value of 100kHz is set in the constructor call
-    this->setBitRate(twiFrequency);
+    TWIHardware::writeBitRate(bitRate);
+    bitRateValue = bitRate;
+    activeBitRate = bitRate;
     this->mode = requestedMode;
 
     if (requestedMode == TWIMode::Master) {
         /** Clear any address present in the TWAR register **/
-        TWAR = 0;
+        TWIHardware::writeAddress(0);
         /** Enable TWI communication **/
-        TWCR = (1 << TWEN) | (1 << TWIE);
+        TWIHardware::writeControl((1 << TWEN) | (1 << TWIE));
     }
     else {
 
         this->slaveModeAddress = setSlaveAddress;
-        TWAR = slaveModeAddress << 1;
+        TWIHardware::writeAddress(static_cast<uint8_t>(slaveModeAddress << 1));
         TWI::TWIPerform(TWICommand::ENABLE_SLAVE);
     }
 
 }
 
+/*!
+ * Sets the buffers used by the buffered Write() function and by the slave mode. The receiver buffer holds the ring of
+ * messages written by a master
+ * @param transmitBuffer Transmission buffer
+ * @param transmitBufferSize Size of the transmission buffer
+ * @param receiveBuffer Receiver buffer
+ * @param receiveBufferSize Size of the receiver buffer
+ */
+void TWI::setBuffers(uint8_t *transmitBuffer,
+                     uint8_t transmitBufferSize,
+                     uint8_t *receiveBuffer,
+                     uint8_t receiveBufferSize)
+{
+    txBuffer = transmitBuffer;
+    txBufferSize = transmitBufferSize;
+    rxBuffer = receiveBuffer;
+    rxBufferSize = receiveBufferSize;
+#if TWI_SLAVE
+    TWIHardware::InterruptGuard guard;
+    rxRing.attach(receiveBuffer, receiveBufferSize);
+#endif
+}
+
 void TWI::setPrescaler(PrescalerValue value)
 {
     /** TWPS: TWI Prescaler Bits **/
-    switch(value) {
-        case PrescalerValue::PRESCALE_VALUE_1:
-            TWSR |= 0;
-            this->TWIPrescalerValue = 1;
-            break;
-
-        case PrescalerValue::PRESCALE_VALUE_4:
-            TWSR |= 1;
-            this->TWIPrescalerValue = 4;
-            break;
-
-        case PrescalerValue::PRESCALE_VALUE_16:
-            TWSR |= 2;
-            this->TWIPrescalerValue = 16;
-            break;
-
-        case PrescalerValue::PRESCALE_VALUE_64:
-            TWSR |= 3;
-            this->TWIPrescalerValue = 64;
-            break;
-    }
+    // The status bits are read only, assigning clears a previously set prescaler
+    TWIHardware::writeStatus(static_cast<uint8_t>(value));
+    this->TWIPrescalerValue = prescalerFactor(value);
+    prescalerValue = value;
+    activePrescaler = value;
 }
 
 void TWI::setBitRate(uint32_t twiFrequency)
 {
     /** TWBR – TWI Bit Rate Register **/
     //TWBR selects the division factor for the bit rate generator.
-    TWBR = static_cast<uint8_t>(((F_CPU / twiFrequency) - 16) / (2 * this->TWIPrescalerValue));
+    bitRateValue = static_cast<uint8_t>(((F_CPU / twiFrequency) - 16) / (2 * this->TWIPrescalerValue));
+    TWIHardware::writeBitRate(bitRateValue);
+    activeBitRate = bitRateValue;
 }
 
 void TWI::TWIPerform(TWICommand command)
 {
     switch (command) {
         case TWICommand::START:
-            TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN) | (1<<TWIE);
+            TWIHardware::writeControl(TWIControl::START);
             break;
 
         case TWICommand::STOP:
-            TWCR = (1<<TWINT) | (1<<TWEN)| (1<<TWSTO);
+            TWIHardware::writeControl(TWIControl::STOP);
             break;
 
         case TWICommand::TRANSMIT_DATA:
+            TWIHardware::writeControl(TWIControl::TRANSMIT);
+            break;
+
         case TWICommand::TRANSMIT_NACK:
-            TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
+            TWIHardware::writeControl(TWIControl::NACK);
             break;
 
         case TWICommand::TRANSMIT_ACK:
-            TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE) | (1<<TWEA);
+            TWIHardware::writeControl(TWIControl::ACK);
             break;
 
         case TWICommand::ENABLE_SLAVE:
-            TWCR =  (1 << TWEN) |                               /* Enable TWI-interface and release TWI pins */
-                    (1 << TWIE) | (1 << TWINT) |                /* Keep interrupt enabled and clear the flag */
-                    (1 << TWEA) | (0 << TWSTA) | (0 << TWSTO) | /* Acknowledge on any new requests */
-                    (0 << TWWC);
+            TWIHardware::writeControl(TWIControl::SLAVE);
             break;
 
         case TWICommand::RESET:
-            TWCR = ((1 << TWSTO) | (1 << TWINT));
+            TWIHardware::writeControl(TWIControl::RESET);
+            break;
+
+        case TWICommand::STOP_START:
+            TWIHardware::writeControl(TWIControl::STOP_START);
+            break;
+
+        case TWICommand::HOLD:
+            TWIHardware::writeControl(TWIControl::HOLD);
             break;
 
         default:
@@ -149,13 +294,336 @@ bool TWI::isTWIReady()
     || (TWIInfo.state == RepeatedStartSent);
 }
 
+#if TWI_MASTER
+/*!
+ * Queues a master transaction. The transaction is started right away if the bus is idle, otherwise it is started
+ * from within the interrupt as soon as the transactions ahead of it are finished.
+ * The descriptor and its data buffer are owned by the caller and have to stay valid until the transaction is finished.
+ * @param transaction Descriptor of the transaction
+ * @return false if the queue is full or the transaction is still pending, true otherwise
+ */
+bool TWI::submit(TWITransaction &transaction)
+{
+    bool queued = false;
+    TWIHardware::InterruptGuard guard;
+    auto next = static_cast<uint8_t>((queueTail + 1) & (TWI_QUEUE_SIZE - 1));
+    if ((next != queueHead) && (transaction.result != TWIResult::Pending)) {
+        transaction.result = TWIResult::Pending;
+        transaction.retries = 0;
+        queue[queueTail] = &transaction;
+        queueTail = next;
+        queued = true;
+        // Start the transaction if the bus is not working on another one
+        if (current == nullptr) {
+            loadTransaction(&transaction);
+            TWIInfo.state = Initializing;
+            TWIPerform(TWICommand::START);
+        }
+    }
+    return queued;
+}
+
+/*!
+ * Checks whether a submitted transaction is finished. Also aborts the transaction on the bus if it timed out, so
+ * applications working with non-blocking transactions have to poll regularly
+ * @param transaction Descriptor of the transaction
+ * @return true if the transaction is not pending anymore
+ */
+bool TWI::poll(const TWITransaction &transaction)
+{
+    if (transaction.result == TWIResult::Pending) {
+        checkRestart();
+        checkTimeout();
+    }
+    return transaction.result != TWIResult::Pending;
+}
+
+/*!
+ * Aborts the transaction on the bus if it timed out and restarts one that lost arbitration once its backoff passed.
+ * poll() and wait() do this for the transaction they are asked about. Applications that submit from interrupts and do
+ * not poll call it regularly from the main loop instead. Not from an interrupt: a bus recovery drives the lines for
+ * about 100 us with interrupts enabled.
+ */
+void TWI::service()
+{
+    checkRestart();
+    checkTimeout();
+}
+
+/*!
+ * Waits until a submitted transaction is finished
+ * @param transaction Descriptor of the transaction
+ * @return Result of the transaction, TWIResult::Timeout if the bus hung
+ */
+TWIResult TWI::wait(const TWITransaction &transaction)
+{
+    return wait(transaction, waitMode);
+}
+
+/*!
+ * Waits until a submitted transaction is finished
+ * @param transaction Descriptor of the transaction
+ * @param waitMode How to wait, independent of setWaitMode()
+ * @return Result of the transaction, TWIResult::Timeout if the bus hung
+ */
+TWIResult TWI::wait(const TWITransaction &transaction, TWIWaitMode waitMode)
+{
+    while (!poll(transaction)) {
+        pause(waitMode, &transaction);
+    }
+    return transaction.result;
+}
+
+/*!
+ * Selects how wait() and the blocking functions wait for the peripheral. TWIWaitMode::Sleep needs the global
+ * interrupts enabled. The timeout of a transaction is only checked when the CPU wakes up, the compare interrupt of
+ * TWI_TIMER wakes it while the bus is hung, see pause().
+ * @param mode Wait mode, the default is TWI_WAIT_MODE
+ * @param hook Called in TWIWaitMode::Yield until the transaction is finished, nullptr spins
+ */
+void TWI::setWaitMode(TWIWaitMode mode, TWIYieldHook hook)
+{
+    waitMode = mode;
+    yieldHook = hook;
+}
+
+/*!
+ * Waits for the next event of a transaction in the mode set by setWaitMode(). Used by the software buses, so that
+ * TWIBus::wait() waits the same way on every bus. Sleep is woken by the timer interrupt ticking the bus.
+ * @param transaction Transaction waited for
+ */
+void TWI::pause(const TWITransaction &transaction)
+{
+    pause(waitMode, &transaction);
+}
+
+/*!
+ * Waits for the next bus event. Sleeping is decided with interrupts disabled, so a TWI interrupt completing the
+ * transaction right before cannot be missed; the AVR enters sleep before handling an interrupt enabled by the
+ * preceding sei. While a restart waits for its backoff no interrupt will come, then it spins.
+ * A hung bus raises no interrupt either: the compare interrupt of TWI_TIMER wakes the CPU after a quarter of the
+ * timeout of the transaction on the bus without an interrupt, so checkTimeout() samples the lines a few times before
+ * it aborts. Close to the timeout it spins, a compare value already passed would only match after a timer overflow.
+ * @param waitMode How to wait
+ * @param transaction Transaction waited for, nullptr while waiting for room in the queue
+ */
+void TWI::pause(TWIWaitMode waitMode, const TWITransaction *transaction)
+{
+    switch (waitMode) {
+        case TWIWaitMode::Sleep: {
+            TWIHardware::InterruptGuard guard;
+            bool busy = (transaction != nullptr) ? (transaction->result == TWIResult::Pending) : (current != nullptr);
+            if (!busy || restartPending) {
+                break;
+            }
+            if (current != nullptr) {
+                uint16_t limit = (current->timeout != 0) ? current->timeout : TWI_TIMEOUT;
+                uint16_t now = TWIHardware::readTimer();
+                uint16_t left = limit - static_cast<uint16_t>(now - lastActivity);
+                if ((left > limit) || (left < WAKEUP_MARGIN)) {
+                    break;
+                }
+                TWIHardware::armWakeup(now + ((left > limit / 4) ? limit / 4 : left));
+            }
+            TWIHardware::sleep();
+            TWIHardware::InterruptGuard wakeup;
+            TWIHardware::disarmWakeup();
+            return;
+        }
+        case TWIWaitMode::Yield:
+            if (yieldHook != nullptr) {
+                yieldHook();
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+    TWIHardware::idle();
+}
+
+/*!
+ * Aborts the transaction on the bus if no interrupt occurred for its timeout, measured with TWI_TIMER. The bus is
+ * recovered with recoverBus(), the TWI is set up again by restoreHardware() and the next queued transaction is
+ * started. The aborted transaction finishes with TWIResult::Timeout.
+ * A transaction whose START has not been acknowledged is held up by another master using the bus, which drives the
+ * lines. Every call samples SCL and SDA: unless one of them stayed low for the whole timeout the transaction finishes
+ * without a bus recovery, with TWIResult::ArbitrationLost if it lost arbitration before and TWIResult::Timeout if not.
+ * Nothing times out while TWI_TIMER is not running. The recovery runs with interrupts enabled, calls from an interrupt
+ * meanwhile do nothing. It is not meant to be called from interrupts itself, see service().
+ * @return true if a transaction has been aborted
+ */
+bool TWI::checkTimeout()
+{
+    TWITransaction *stuck;
+    {
+        TWIHardware::InterruptGuard guard;
+        if ((current == nullptr) || recovering) {
+            return false;
+        }
+        uint16_t now = TWIHardware::readTimer();
+        if (TWIHardware::readSCL()) {
+            sclReleased = now;
+        }
+        if (TWIHardware::readSDA()) {
+            sdaReleased = now;
+        }
+        uint16_t limit = (current->timeout != 0) ? current->timeout : TWI_TIMEOUT;
+        if (static_cast<uint16_t>(now - lastActivity) < limit) {
+            return false;
+        }
+        // A START that was never acknowledged waits for the STOP of another master, unless a line stayed low all along
+        bool held = (static_cast<uint16_t>(now - sclReleased) >= limit) ||
+                    (static_cast<uint16_t>(now - sdaReleased) >= limit);
+        bool lost = restartPending || (current->retries > 0);
+        bool contended = restartPending || ((TWIInfo.state == Initializing) && !held);
+        restartPending = false;
+        // Disabling the TWI hands SCL and SDA to the port and masks the TWI interrupt, a pending START is dropped
+        TWIHardware::writeControl(0);
+        if (contended) {
+            restoreHardware();
+            TWIInfo.status = Error;
+            if (!lost) {
+                TWI_COUNT(timeouts);
+            }
+            completeTransaction(lost ? TWIResult::ArbitrationLost : TWIResult::Timeout, false);
+            return true;
+        }
+        // Owned by this call until the recovery is done, an interrupt calling service() meanwhile returns right away
+        recovering = true;
+        stuck = current;
+    }
+
+    // Other interrupts keep running during the recovery
+    recoverBus();
+
+    TWIHardware::InterruptGuard guard;
+    recovering = false;
+    restoreHardware();
+    if (current != stuck) {
+        // Finished by someone else meanwhile, there is nothing left to abort
+        return false;
+    }
+    TWI_COUNT(timeouts);
+    TWIInfo.status = Error;
+    completeTransaction(TWIResult::Timeout, false);
+    return true;
+}
+
+/*!
+ * Multi-master: starts the current transaction again once the backoff after lost arbitration has passed and the
+ * driver is not addressed as slave by the master that won. Called from poll() and wait(), the backoff is measured with
+ * TWI_TIMER. A running timer moves within a few calls, so once TWI_TIMER has stood still for STOPPED_TIMER_POLLS calls
+ * since the backoff started, every further call counts as one tick: a stopped timer delays the restart by the backoff
+ * in polls instead of blocking it.
+ */
+void TWI::checkRestart()
+{
+    TWIHardware::InterruptGuard guard;
+    if (!restartPending || (TWIInfo.state == SlaveTransmitter) || (TWIInfo.state == SlaveReciever)) {
+        return;
+    }
+    uint16_t now = TWIHardware::readTimer();
+    if (now == restartStamp) {
+        restartPolls++;
+    }
+    if ((static_cast<uint16_t>(now - restartStamp) < restartBackoff) &&
+        (restartPolls < static_cast<uint32_t>(restartBackoff) + STOPPED_TIMER_POLLS)) {
+        return;
+    }
+    restartPending = false;
+    lastActivity = now;
+    sclReleased = now;
+    sdaReleased = now;
+    TWIInfo.state = Initializing;
+    // The hardware waits for the STOP of the other master before it sends the START
+    TWIHardware::writeControl(TWIControl::START);
+}
+
+/*!
+ * Rewinds the current transaction after lost arbitration and draws a random backoff, which grows with every retry so
+ * that two masters restarting at the same time drift apart. Called from within the interrupt only.
+ * @return false if the transaction has used up its TWI_ARBITRATION_RETRIES
+ */
+bool TWI::scheduleRetry()
+{
+    if (current->retries >= TWI_ARBITRATION_RETRIES) {
+        return false;
+    }
+    current->retries++;
+    loadTransaction(current);
+
+    // 16 bit Galois LFSR, stirred with the timer so that boards with the same firmware do not draw the same sequence
+    backoffSeed ^= TWIHardware::readTimer();
+    backoffSeed = static_cast<uint16_t>((backoffSeed >> 1) ^ ((backoffSeed & 1) ? 0xB400 : 0));
+    uint16_t window = static_cast<uint16_t>(TWI_BACKOFF_TICKS << current->retries);
+    restartBackoff = (window != 0) ? static_cast<uint16_t>(backoffSeed % window) : 0;
+    restartStamp = TWIHardware::readTimer();
+    restartPolls = 0;
+    restartPending = true;
+    return true;
+}
+
+/*!
+ * Standard I2C bus recovery, done with the TWI disabled: SCL is clocked up to 9 times until a slave holding SDA low
+ * has shifted out the rest of its byte and releases it, followed by a STOP condition. Takes about 100 us.
+ */
+void TWI::recoverBus()
+{
+    TWIHardware::releaseSDA();
+    TWIHardware::releaseSCL();
+    TWIHardware::recoveryDelay();
+    for (uint8_t pulse = 0; (pulse < 9) && !TWIHardware::readSDA(); pulse++) {
+        TWIHardware::pullSCL();
+        TWIHardware::recoveryDelay();
+        TWIHardware::releaseSCL();
+        TWIHardware::recoveryDelay();
+    }
+    // STOP: SDA rises while SCL is high
+    TWIHardware::pullSCL();
+    TWIHardware::recoveryDelay();
+    TWIHardware::pullSDA();
+    TWIHardware::recoveryDelay();
+    TWIHardware::releaseSCL();
+    TWIHardware::recoveryDelay();
+    TWIHardware::releaseSDA();
+    TWIHardware::recoveryDelay();
+}
+
+/*!
+ * Sets the TWI up again with the bit rate, prescaler, mode and slave address of the last configure(). The buffers are
+ * left alone: received messages, the overflow count and the queued replies are kept. A message being received is
+ * dropped, a reply being read is sent from its first byte by the next read.
+ */
+void TWI::restoreHardware()
+{
+#if TWI_SLAVE
+    rxRing.discard();
+    replyActive = false;
+#endif
+    TWIInfo.state = Available;
+    TWIInfo.repStart = false;
+    TWIHardware::writeStatus(static_cast<uint8_t>(prescalerValue));
+    TWIHardware::writeBitRate(bitRateValue);
+    activePrescaler = prescalerValue;
+    activeBitRate = bitRateValue;
+    if (mode == TWIMode::Master) {
+        TWIHardware::writeAddress(0);
+        TWIHardware::writeControl((1 << TWEN) | (1 << TWIE));
+    }
+    else {
+        TWIHardware::writeAddress(static_cast<uint8_t>(slaveModeAddress << 1));
+        TWIPerform(TWICommand::ENABLE_SLAVE);
+    }
+}
+
 /*!
  * Master transmitter function to write data into the TWI bus
  * @param slaveAddress Address of the TWI slave device (7 bit wide)
  * @param data Data to be transmitted. Sent in as an array
  * @param dataLen Length of the data to be transmitted
  * @param repeatedStart Boolean value, set as default to false. To be set to true if a repeated start is performed
- * @param TWIReadRequest Boolean value, set as default to false. This value is used by the TWIRead function only!
+ * @param TWIReadRequest Boolean value, set as default to false. If set, slaveAddress already holds the R/W bit
  */
 
 void TWI::Write(uint8_t slaveAddress,
@@ -166,41 +634,33 @@ void TWI::Write(uint8_t slaveAddress,
 {
     // Transmission shall only be performed as long as dataLen is lesser
     // than the buffer size
-    if (dataLen <= TX_BUFFER_SIZE) {
-        while (!isTWIReady()) {
-            _delay_us(1);
-        }
-        // Set repeated start state
-        TWIInfo.repStart = repeatedStart;
-        if (TWIReadRequest) {
-            //In case the Write function is called from the Read function, the slave address with the read
-            // command is already sent. Hence it is not necessary to perform the shift operation again
-            txBuffer[0] = slaveAddress;
-        }
-        else {
-            // Copy slave address into the tx buffer.
-            txBuffer[0] = slaveAddress << 1;
-        }
+    if (dataLen <= txBufferSize) {
+        // The buffer is shared, wait until the previous buffered write is on the bus
+        wait(bufferTransaction);
 
         //Copy all information in data to txBuffer.
-        //Start for loop from index 1 since, 0 has the address
-        for (uint8_t index = 0; index <= dataLen; index++) {
-            txBuffer[index + 1] = data[index];
+        for (uint8_t index = 0; index < dataLen; index++) {
+            txBuffer[index] = data[index];
         }
         //Set the data length for transmission now
-        txBufferLen = static_cast<uint8_t>(dataLen + 1);
-        txIndex = 0;
+        txBufferLen = dataLen;
 
-        // If a repeated stop is already send, devices are expecting data
-        // and not another start condition
-        if (TWIInfo.state == RepeatedStartSent) {
-            TWIInfo.state = Initializing;
-            TWDR = txBuffer[txIndex++];
-            TWIPerform(TWICommand::TRANSMIT_DATA);
+        if (TWIReadRequest) {
+            bufferTransaction.address = static_cast<uint8_t>(slaveAddress >> 1);
+            bufferTransaction.direction = static_cast<TWIDirection>(slaveAddress & 0x01);
         }
         else {
-            TWIInfo.state = Initializing;
-            TWIPerform(TWICommand::START);
+            bufferTransaction.address = slaveAddress;
+            bufferTransaction.direction = TWIDirection::Write;
+        }
+        bufferTransaction.data = txBuffer;
+        bufferTransaction.length = txBufferLen;
+        bufferTransaction.repeatedStart = repeatedStart;
+        bufferTransaction.callback = nullptr;
+
+        while (!submit(bufferTransaction)) {
+            checkTimeout();
+            pause(waitMode, nullptr);
         }
     }
 }
@@ -222,12 +682,15 @@ void TWI::Write(const uint8_t slaveAddress,
     ptr = data;
     // Count number of elements present in the input char array
     while (  ((*ptr) != '\0')   // Looping until end of char array '\0' is encountered
-           &&(dataLen < TX_BUFFER_SIZE)) { // or until the buffer size
+           &&(dataLen < txBufferSize)) { // or until the buffer size
         dataLen++;
         ptr++;
     };
     Write(slaveAddress, reinterpret_cast<const uint8_t *>(data), dataLen, repeatedStart, false);
 }
+#endif
+
+#if TWI_SLAVE
 
 /*!
  * Slave transmitter function to write data into the TWI bus when requested by master
@@ -240,215 +703,1312 @@ void TWI::Write(const char *const data)
     const char * ptr;
     ptr = data;
     while (  ((*ptr) != '\0')
-        &&(txBufferLen < TX_BUFFER_SIZE)) {
+        &&(txBufferLen < txBufferSize)) {
         txBuffer[txBufferLen++] = static_cast<uint8_t>(*ptr);
         ptr++;
     };
 }
+#endif
+
+#if TWI_MASTER
+
+/*!
+ * Zero-copy master transmitter function. The interrupt sends the bytes straight from data, the function returns once
+ * the transmission is finished
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param data Data to be transmitted, not copied
+ * @param dataLen Length of the data to be transmitted, not limited by the transmission buffer
+ * @param repeatedStart Boolean value, set as default to false. To be set to true if a repeated start is performed
+ * @return Result of the transmission
+ */
+TWIResult TWI::WriteDirect(uint8_t slaveAddress,
+                           const uint8_t *data,
+                           uint16_t dataLen,
+                           bool repeatedStart)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Write;
+    // The buffer is only read from for write transactions
+    transaction.data = const_cast<uint8_t *>(data);
+    transaction.length = dataLen;
+    transaction.repeatedStart = repeatedStart;
+    return transfer(transaction);
+}
+
+/*!
+ * Master transmitter function writing straight from program memory. The interrupt fetches every byte with
+ * pgm_read_byte, the data is neither copied into RAM nor limited by the transmission buffer. Blocks until done.
+ *
+ *   static const uint8_t init[] PROGMEM = {0x00, 0xAE, 0xD5, 0x80};
+ *   twi.WriteP(0x3C, init, sizeof(init));
+ *
+ * @param slaveAddress Address of the TWI slave device
+ * @param data PROGMEM array in the lower 64 KB of program memory, WriteFarP() reaches beyond
+ * @param dataLen Number of bytes to write
+ * @param repeatedStart Keep the bus and continue with a repeated START
+ * @return Result of the transaction
+ */
+TWIResult TWI::WriteP(uint8_t slaveAddress,
+                      const uint8_t *data,
+                      uint16_t dataLen,
+                      bool repeatedStart)
+{
+    return WriteFarP(slaveAddress, reinterpret_cast<uintptr_t>(data), dataLen, repeatedStart);
+}
+
+/*!
+ * Master transmitter function writing straight from program memory anywhere in the flash of the ATmega1280/2560
+ *
+ *   twi.WriteFarP(0x1A, pgm_get_far_address(codecInit), sizeof(codecInit));
+ *
+ * @param slaveAddress Address of the TWI slave device
+ * @param data Program memory address of the data
+ * @param dataLen Number of bytes to write
+ * @param repeatedStart Keep the bus and continue with a repeated START
+ * @return Result of the transaction
+ */
+TWIResult TWI::WriteFarP(uint8_t slaveAddress,
+                         TWIFlashAddress data,
+                         uint16_t dataLen,
+                         bool repeatedStart)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Write;
+    transaction.flashData = data;
+    transaction.length = dataLen;
+    transaction.repeatedStart = repeatedStart;
+    return transfer(transaction);
+}
 
 /**
  * Function to read data in Master Receiver mode
+ * The interrupt stores the received bytes straight into data
  */
 //!
 //! \param slaveAddress Address of the TWI slave device
 //! \param data pointer to the array where the data shall be saved to
-//! \param readBytesLen Number of bytes the received data shall be
+//! \param readBytesLen Number of bytes the received data shall be, not limited by the receiver buffer
 //! \param repeatedStart Boolean value, set as default to false. To be set to true if a repeated start is performed
-void TWI::Read(const uint8_t slaveAddress,
-               uint8_t *data,
-               uint8_t readBytesLen,
-               const bool repeatedStart)
+//! \return Result of the reception
+TWIResult TWI::Read(const uint8_t slaveAddress,
+                    uint8_t *data,
+                    uint16_t readBytesLen,
+                    const bool repeatedStart)
 {
-    if (readBytesLen <= RX_BUFFER_SIZE) {
-        rxIndex = 0;
-        rxBufferLen = readBytesLen;
-        //Create a temp variable to send
-        // Slave address + Write
-        auto slaveAddressWrite = static_cast<uint8_t>((slaveAddress << 1) | 0x01);
-        //Calling the Write function to transmit the data
-        Write(slaveAddressWrite, nullptr, 0, repeatedStart, true);
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Read;
+    transaction.data = data;
+    transaction.length = readBytesLen;
+    transaction.repeatedStart = repeatedStart;
+    return transfer(transaction);
+}
 
-        //Wait until buffer is filled with received data
-        while (rxIndex != rxBufferLen - 1) {
-            _delay_us(1);
-        }
-        for (uint8_t index = 0; index < rxBufferLen; index++) {
-            data[index] = rxBuffer[index];
-        }
-    }
+/*!
+ * Reads registers of a slave device in one combined transaction: the register address is written, followed by a
+ * repeated START and the read, without returning to the caller in between
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param reg Address of the first register
+ * @param data Buffer the register values are stored to
+ * @param length Number of bytes to be read
+ * @param registerSize 8 or 16 bit register address
+ * @return Result of the transaction
+ */
+TWIResult TWI::readRegister(uint8_t slaveAddress,
+                            uint16_t reg,
+                            uint8_t *data,
+                            uint16_t length,
+                            TWIRegisterSize registerSize)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Read;
+    transaction.data = data;
+    transaction.length = length;
+    transaction.registerSize = registerSize;
+    transaction.reg = reg;
+    return transfer(transaction);
 }
 
-void TWI::Read()
+/*!
+ * Transfers a list of buffer segments in one transaction from START to STOP, without copying them together first. A
+ * write segment following a write segment continues on the bus without a gap, a change of the direction or
+ * TWISegment::restart inserts a repeated START
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param segments Segments, not copied
+ * @param segmentCount Number of segments
+ * @return Result of the transaction
+ */
+TWIResult TWI::transferSegments(uint8_t slaveAddress, const TWISegment *segments, uint8_t segmentCount)
 {
-    TWI::TWIPerform(TWICommand::ENABLE_SLAVE);
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.segments = segments;
+    transaction.segmentCount = segmentCount;
+    return transfer(transaction);
 }
 
-void TWI::twi_interrupt_handler()
+/*!
+ * Writes registers of a slave device: the register address is sent ahead of the data in the same transmission
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param reg Address of the first register
+ * @param data Register values, not copied
+ * @param length Number of bytes to be written
+ * @param registerSize 8 or 16 bit register address
+ * @return Result of the transaction
+ */
+TWIResult TWI::writeRegister(uint8_t slaveAddress,
+                             uint16_t reg,
+                             const uint8_t *data,
+                             uint16_t length,
+                             TWIRegisterSize registerSize)
 {
-    switch (TWI_STATUS) {
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Write;
+    transaction.data = const_cast<uint8_t *>(data);
+    transaction.length = length;
+    transaction.registerSize = registerSize;
+    transaction.reg = reg;
+    return transfer(transaction);
+}
 
-        /** SLA+W has been transmitted; ACK has been received. **/
-        case TWI_MT_SLA_ACK:
-            TWIInfo.state = MasterTransmitter;
-            TWIInfo.status = Master_TX_Init;
+/*!
+ * Writes registers of a slave device from program memory, e.g. the initialisation table of a display or codec
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param reg Address of the first register
+ * @param data Register values, PROGMEM array in the lower 64 KB of program memory
+ * @param length Number of bytes to be written
+ * @param registerSize 8 or 16 bit register address
+ * @return Result of the transaction
+ */
+TWIResult TWI::writeRegisterP(uint8_t slaveAddress,
+                              uint16_t reg,
+                              const uint8_t *data,
+                              uint16_t length,
+                              TWIRegisterSize registerSize)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Write;
+    transaction.flashData = reinterpret_cast<uintptr_t>(data);
+    transaction.length = length;
+    transaction.registerSize = registerSize;
+    transaction.reg = reg;
+    return transfer(transaction);
+}
 
-        /** A START condition has been transmitted. **/
-        case TWI_START:
+#if TWI_PEC
+/*!
+ * SMBus block write: the command and the byte count are sent ahead of the data, followed by the PEC
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param command SMBus command code
+ * @param data Data bytes, not copied
+ * @param length Number of data bytes, the byte count sent to the slave
+ * @param pec Append the PEC
+ * @return Result of the transaction, PecError if the slave NACKed the PEC
+ */
+TWIResult TWI::smbusBlockWrite(uint8_t slaveAddress, uint8_t command, const uint8_t *data, uint8_t length, bool pec)
+{
+    uint8_t header[2] = {command, length};
+    TWISegment segments[2] = {
+            {header, sizeof(header), TWIDirection::Write, false},
+            {const_cast<uint8_t *>(data), length, TWIDirection::Write, false}
+    };
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.segments = segments;
+    transaction.segmentCount = 2;
+    transaction.pec = pec;
+    return transfer(transaction);
+}
 
-        /** A repeated START condition has been transmitted. **/
-        case TWI_RESTART:
-            TWIInfo.state = RepeatedStartSent;
-        break;
-
-        /****************************************************************/
-        /** MASTER TRANSMITTER **/
-        /****************************************************************/
-
-        /** Data byte has been transmitted; ACK has been received. **/
-        case TWI_MT_DATA_ACK:
-            if (txIndex < txBufferLen) {
-                TWDR = txBuffer[txIndex++];
-                TWIInfo.status = Master_TX_Progress;
-                TWIPerform(TWICommand::TRANSMIT_DATA);
-            }
-            else if (TWIInfo.repStart) {
-                TWIPerform(TWICommand::START);
-            }
-            else {
-                TWIInfo.state = Available;
-                TWIInfo.status = Master_TX_Complete;
-                TWIPerform(TWICommand::STOP);
-            }
-            break;
+/*!
+ * SMBus block read: the command is written, followed by a repeated START and the read of the byte count, the data
+ * and the PEC. The read ends after the number of bytes the slave reports
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param command SMBus command code
+ * @param block Receives the byte count in block[0] followed by the data
+ * @param size Size of block, the byte count has to be below it
+ * @param pec Receive and check the PEC
+ * @return Result of the transaction, PecError if the PEC did not match, BlockOverflow if the count does not fit
+ */
+TWIResult TWI::smbusBlockRead(uint8_t slaveAddress, uint8_t command, uint8_t *block, uint8_t size, bool pec)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Read;
+    transaction.data = block;
+    transaction.length = size;
+    transaction.registerSize = TWIRegisterSize::Byte;
+    transaction.reg = command;
+    transaction.pec = pec;
+    transaction.blockRead = true;
+    return transfer(transaction);
+}
 
-        /****************************************************************/
-        /** MASTER RECEIVER **/
-        /****************************************************************/
-
-        /** SLA+R has been transmitted; ACK has been received **/
-        case TWI_MR_SLA_ACK:
-            TWIInfo.state = MasterReceiver;
-            TWIInfo.status = Master_RX_Init;
-            // Checking if more than 1 byte is expected. If yes, send ACK, else send NACK
-            if (rxIndex < rxBufferLen - 1) {
-                TWIPerform(TWICommand::TRANSMIT_ACK);
-            }
-            else {
-                TWIPerform(TWICommand::TRANSMIT_NACK);
-            }
-            break;
+/*!
+ * SMBus process call: a word is written to the command and a word is read back after a repeated START, both LSB
+ * first. One PEC covers the whole transaction and follows the reply
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param command SMBus command code
+ * @param value Word written
+ * @param reply Word read back
+ * @param pec Receive and check the PEC
+ * @return Result of the transaction, PecError if the PEC did not match
+ */
+TWIResult TWI::smbusProcessCall(uint8_t slaveAddress, uint8_t command, uint16_t value, uint16_t &reply, bool pec)
+{
+    uint8_t request[3] = {command, static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8)};
+    uint8_t response[2] = {0, 0};
+    TWISegment segments[2] = {
+            {request, sizeof(request), TWIDirection::Write, false},
+            {response, sizeof(response), TWIDirection::Read, false}
+    };
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.segments = segments;
+    transaction.segmentCount = 2;
+    transaction.pec = pec;
+    TWIResult result = transfer(transaction);
+    reply = static_cast<uint16_t>(response[0] | (response[1] << 8));
+    return result;
+}
+#endif
 
-        /** Data byte has been received; ACK has been returned **/
-        case TWI_MR_DATA_ACK:
-            rxBuffer[rxIndex++] = TWDR;
-            // Checking if more than 1 byte is expected. If yes, send ACK, else send NACK
-            if (rxIndex < rxBufferLen - 1) {
-                TWIInfo.status = Master_RX_Progress;
-                TWIPerform(TWICommand::TRANSMIT_ACK);
-            }
-            else {
-                TWIInfo.status = Master_RX_Complete;
-                TWIPerform(TWICommand::TRANSMIT_NACK);
-            }
-            break;
+/*!
+ * Submits a transaction on caller owned memory and waits for it. While the queue is full the transaction on the bus is
+ * checked for its timeout and restart, so a hung bus cannot block the submission.
+ * @param transaction Descriptor of the transaction
+ * @return Result of the transaction
+ */
+TWIResult TWI::transfer(TWITransaction &transaction)
+{
+    while (!submit(transaction)) {
+        checkRestart();
+        checkTimeout();
+        pause(waitMode, nullptr);
+    }
+    return wait(transaction);
+}
+#endif
 
-        /** Data byte has been received; NOT ACK has been returned **/
-        case TWI_MR_DATA_NACK:
-            rxBuffer[rxIndex++] = TWDR;
-            if (TWIInfo.repStart) {
-                TWIPerform(TWICommand::START);
-            }
-            else {
-                TWIInfo.state = Available;
-                TWIPerform(TWICommand::STOP);
-                TWIInfo.status = Master_RX_Complete;
-            }
-            break;
+#if TWI_SLAVE
 
-        /****************************************************************/
-        /** SLAVE TRANSMITTER **/
-        /****************************************************************/
-
-        /** Own SLA+R has been received; ACK has been returned **/
-        case TWI_ST_SLA_ACK:
-            // Reset buffer pointer
-            txIndex = 0;
-            TWIInfo.state = SlaveTransmitter;
-
-        /** Data byte in TWDR has been transmitted; ACK has been received **/
-        case TWI_ST_DATA_ACK:
-            // Copy data from current buffer position
-            if (txIndex < txBufferLen) {
-                TWDR = txBuffer[txIndex++];
-            }
-            else {
-                TWDR = 0;
-            }
-            TWIPerform(TWICommand::ENABLE_SLAVE);
-            break;
+void TWI::Read()
+{
+    TWI::TWIPerform(TWICommand::ENABLE_SLAVE);
+}
 
-        /** Data byte in TWDR has been transmitted;  NOT ACK has been received */
-        case TWI_ST_DATA_NACK:
-            TWIInfo.state = Available;
-            TWIPerform(TWICommand::ENABLE_SLAVE);
-            break;
+/*!
+ * Slave receiver: fetches the oldest message written by a master. Every write transfer from SLA+W to STOP is stored
+ * as one message by the interrupt; messages that did not fit into the receiver buffer are NACKed and counted by
+ * getReceiveOverflows(). Does not disable interrupts.
+ * @param data Buffer the message is copied to
+ * @param maxLength Size of data, longer messages are truncated
+ * @return Number of bytes copied, 0 if no message is available
+ */
+uint8_t TWI::receiveMessage(uint8_t *data, uint8_t maxLength)
+{
+    return rxRing.read(data, maxLength);
+}
 
-        /****************************************************************/
-        /** SLAVE RECEIVER **/
-        /****************************************************************/
+/*!
+ * Slave transmitter: sets the storage of the reply ring. Without it, replies are served from the transmission buffer,
+ * see Write(const char *const data)
+ * @param storage Storage of the ring, owned by the application
+ * @param size Size of storage
+ */
+void TWI::setReplyBuffer(uint8_t *storage, uint8_t size)
+{
+    TWIHardware::InterruptGuard guard;
+    replyActive = false;
+    txRing.attach(storage, size);
+}
 
-        /** General call address has been received; ACK has been returned **/
-        case TWI_SR_GEN_ACK:
+/*!
+ * Slave transmitter: queues a reply. Each read transfer of a master is answered with the oldest queued reply, the
+ * transmission buffer is used once no reply is queued. Does not disable interrupts.
+ * @param data Reply
+ * @param length Length of the reply
+ * @return false if the reply does not fit into the reply ring
+ */
+bool TWI::sendMessage(const uint8_t *data, uint8_t length)
+{
+    return txRing.write(data, length);
+}
 
-        /** Arbitration lost in SLA+R/W as Master;  General call address has been received; ACK has been returned **/
-        case TWI_SR_GEN_ACK_M_ARB_LOST:
+/*!
+ * @return Number of messages of a master dropped because the receiver buffer was full
+ */
+uint8_t TWI::getReceiveOverflows() const
+{
+    return rxRing.overflows;
+}
 
-        /** Own SLA+W has been received; ACK has been returned **/
-        case TWI_SR_SLA_ACK:
+/*!
+ * Slave transmitter: serves read transfers of any length from a stream instead of the replies and the transmission
+ * buffer. Each byte is taken from the stream by the interrupt; while the stream is empty, 0 is sent and counted as
+ * underrun of the stream. Register maps take precedence.
+ * @param stream Double buffer filled by the application or its refill callback, nullptr to stop streaming
+ */
+void TWI::setSlaveStream(TWIStreamBuffer *stream)
+{
+    TWIHardware::InterruptGuard guard;
+    slaveStream = stream;
+}
 
-        /** Arbitration lost in  SLA+R/W as Master; own SLA+W has been received; ACK has been returned **/
-        case TWI_SR_SLA_ACK_M_ARB_LOST:
-            // Reset buffer pointer
-            rxIndex = 0;
-            TWIInfo.state = SlaveReciever;
-            TWIPerform(TWICommand::ENABLE_SLAVE);
-            break;
+#if TWI_PEC
+/*!
+ * Slave mode SMBus PEC for the message rings. A write of more than one byte ends with its PEC, which is checked
+ * and removed before the message is published; messages with a wrong PEC are dropped and counted by getPecErrors().
+ * A write of one byte is the command of a following read, whose CRC continues over the read. Replies get their PEC
+ * appended. The TWI acknowledges a byte before the ISR sees it, so a wrong PEC cannot be NACKed.
+ * @param enabled true to check and append the PEC
+ */
+void TWI::setSlavePec(bool enabled)
+{
+    TWIHardware::InterruptGuard guard;
+    slavePec = enabled;
+    slavePecCarry = false;
+    slavePecNext = false;
+}
 
-        /** Previously addressed with own SLA+W; data has been received; ACK has been returned **/
-        case TWI_SR_SLA_DATA_ACK:
+/*!
+ * @return Number of writes of a master dropped because of a wrong PEC
+ */
+uint8_t TWI::getPecErrors() const
+{
+    return slavePecErrors;
+}
+#endif
+#endif
 
-        /** Previously addressed with general call; data has been received; ACK has been returned **/
-        case TWI_SR_GEN_DATA_ACK:
-            // Copy data from TWDR into current buffer position
-            rxBuffer[rxIndex++] = TWDR;
-            TWIPerform(TWICommand::ENABLE_SLAVE);
-            break;
 
-        /** A STOP condition or repeated START condition has been received while still addressed as Slave Enter not
-         * addressed mode and listen to address match **/
-        case TWI_SR_STOP_RESTART:
-            TWIInfo.state = Available;
-            TWIPerform(TWICommand::ENABLE_SLAVE);
-            break;
+#if TWI_PEC
+/*!
+ * CRC-8 of SMBus packet error checking, e.g. to build a message for another driver
+ * @param data Bytes, including the address bytes the PEC covers
+ * @param length Number of bytes
+ * @param crc CRC of the bytes ahead of data, 0 to start
+ * @return CRC over crc and data
+ */
+uint8_t TWI::computePec(const uint8_t *data, uint16_t length, uint8_t crc)
+{
+    for (uint16_t index = 0; index < length; index++) {
+        TWI_PEC_UPDATE(crc, data[index]);
+    }
+    return crc;
+}
+#endif
 
-        /* Previously addressed with own SLA+W; data has been received; NOT ACK has been returned */
-        case TWI_SR_SLA_DATA_NACK:
+/*!
+ * Copies the statistics, which are only collected if TWI_STATISTICS is set to 1. The copy is consistent, the interrupt
+ * cannot update the counters in between
+ * @param snapshot Receives the counters, all zero if statistics are disabled
+ * @param reset Clears the counters together with taking the snapshot
+ */
+void TWI::getStatistics(TWIStatistics &snapshot, bool reset)
+{
+#if TWI_STATISTICS
+    TWIHardware::InterruptGuard guard;
+    snapshot = statistics;
+    if (reset) {
+        statistics = {};
+    }
+#else
+    (void)reset;
+    snapshot = {};
+#endif
+}
 
-        /* Previously addressed with general call; data has been received; NOT ACK has been returned */
-        case TWI_SR_GEN_DATA_NACK:
+/*!
+ * Copies the latest trace entries, oldest first. Tracing is only done if TWI_TRACE_SIZE is set, see TWITrace.h for
+ * decoding the entries
+ * @param entries Receives the entries
+ * @param maxEntries Size of entries, the latest maxEntries are copied if the trace holds more
+ * @param clear Empties the trace together with copying it
+ * @return Number of entries copied
+ */
+uint8_t TWI::getTrace(TWITraceEntry *entries, uint8_t maxEntries, bool clear)
+{
+#if TWI_TRACE_SIZE
+    TWIHardware::InterruptGuard guard;
+    uint16_t count = traceWrapped ? TWI_TRACE_SIZE : traceNext;
+    if (count > maxEntries) {
+        count = maxEntries;
+    }
+    uint8_t index = static_cast<uint8_t>((traceNext - count) & (TWI_TRACE_SIZE - 1));
+    for (uint16_t copied = 0; copied < count; copied++) {
+        entries[copied] = trace[index];
+        index = static_cast<uint8_t>((index + 1) & (TWI_TRACE_SIZE - 1));
+    }
+    if (clear) {
+        traceNext = 0;
+        traceWrapped = false;
+    }
+    return static_cast<uint8_t>(count);
+#else
+    (void)entries;
+    (void)maxEntries;
+    (void)clear;
+    return 0;
+#endif
+}
+
+#if TWI_MASTER
+/*!
+ * Sets the table of device speeds. Every transaction runs with the TWBR and TWPS of its slave device, the bit rate is
+ * reprogrammed between transactions when the speed changes. Devices not in the table run with the speed of
+ * TWISetMode() or configure().
+ *
+ *   static TWIDeviceProfile devices[] = {TWI::deviceProfile(0x50, 100000), TWI::deviceProfile(0x68, 400000)};
+ *   twi.setDeviceProfiles(devices, 2);
+ *
+ * @param profiles Table owned by the application, nullptr to run the whole bus at one speed
+ * @param count Number of entries
+ */
+void TWI::setDeviceProfiles(TWIDeviceProfile *profiles, uint8_t count)
+{
+    TWIHardware::InterruptGuard guard;
+    deviceProfiles = profiles;
+    deviceProfileCount = (profiles != nullptr) ? count : 0;
+}
 
-        /* Last data byte in TWDR has been transmitted (TWEA = ; ACK has been received */
-        case TWI_ST_DATA_ACK_LAST_BYTE:
-            TWIPerform(TWICommand::RESET);
+/*!
+ * Finds the fastest SCL frequency up to profile.maxFrequency at which the device acknowledges its address on every
+ * attempt, stepping down from 400 kHz. The bus has to be idle. Blocks until done.
+ * @param profile Profile of the device, receives TWBR and TWPS of the frequency found. Left unchanged if the device
+ * does not acknowledge at any frequency
+ * @param attempts Number of address-only writes that have to succeed at a frequency
+ * @return Frequency found in Hz, 0 if the device did not respond
+ */
+uint32_t TWI::probeSpeed(TWIDeviceProfile &profile, uint8_t attempts)
+{
+    static const uint32_t frequencies[] = {400000, 300000, 200000, 100000, 50000, 20000};
+    TWIDeviceProfile probe = profile;
+    TWIDeviceProfile *savedProfiles;
+    uint8_t savedCount;
+    {
+        TWIHardware::InterruptGuard guard;
+        savedProfiles = deviceProfiles;
+        savedCount = deviceProfileCount;
+        deviceProfiles = &probe;
+        deviceProfileCount = 1;
+    }
+
+    uint32_t found = 0;
+    for (uint8_t index = 0; (index < sizeof(frequencies) / sizeof(frequencies[0])) && (found == 0); index++) {
+        uint32_t frequency = frequencies[index];
+        if ((frequency > profile.maxFrequency) || (F_CPU / frequency <= 16)) {
+            continue;
+        }
+        probe.prescaler = prescalerFor(frequency);
+        uint32_t divider = bitRateDivider(frequency, probe.prescaler);
+        if ((divider < 10) || (divider > 0xFF)) {
+            // Out of range of the master mode
+            continue;
+        }
+        probe.bitRate = static_cast<uint8_t>(divider);
+
+        bool reliable = true;
+        for (uint8_t attempt = 0; (attempt < attempts) && reliable; attempt++) {
+            TWITransaction transaction = {};
+            transaction.address = profile.address;
+            transaction.direction = TWIDirection::Write;
+            reliable = transfer(transaction) == TWIResult::Success;
+        }
+        if (reliable) {
+            found = frequency;
+            profile.bitRate = probe.bitRate;
+            profile.prescaler = probe.prescaler;
+        }
+    }
+
+    TWIHardware::InterruptGuard guard;
+    deviceProfiles = savedProfiles;
+    deviceProfileCount = savedCount;
+    return found;
+}
+#endif
+
+#if TWI_SLAVE
+
+/*!
+ * Serves a register map in slave mode, like a typical I2C peripheral: the first byte of a write transfer sets the
+ * register pointer, further bytes are written to consecutive registers. Reads start at the register pointer. The
+ * pointer increments after every byte and wraps around at the end of the map. Everything is handled from within the
+ * interrupt.
+ * @param map Register map, nullptr to go back to the transmission and receiver buffers
+ */
+void TWI::setRegisterMap(TWIRegisterMap *map)
+{
+    TWIHardware::InterruptGuard guard;
+    if (map != nullptr) {
+        map->pointer = 0;
+    }
+    registerMap = map;
+}
+#endif
+
+#if TWI_MASTER
+
+void TWI::loadTransaction(TWITransaction *transaction)
+{
+    current = transaction;
+    applyProfile(transaction->address);
+    registerRemaining = static_cast<uint8_t>(transaction->registerSize);
+#if TWI_PEC
+    pecCrc = 0;
+    pecTrailer = transaction->pec;
+    readTrailer = 0;
+    blockOverflow = false;
+    blockCountPending = false;
+#endif
+    if ((transaction->segments != nullptr) && (transaction->segmentCount > 0)) {
+        segment = transaction->segments;
+        segmentsRemaining = transaction->segmentCount;
+        flashCursor = 0;
+        transferDirection = segment->direction;
+        transferRemaining = 0;
+        nextSegment();
+    }
+    else {
+        segmentsRemaining = 0;
+        readAhead = 0;
+        transferCursor = transaction->data;
+        flashCursor = (transaction->direction == TWIDirection::Write) ? transaction->flashData : 0;
+        transferRemaining = transaction->length;
+        transferDirection = transaction->direction;
+#if TWI_PEC
+        readTrailer = pecTrailer ? 1 : 0;
+        if (transaction->blockRead && (transferDirection == TWIDirection::Read)) {
+            // The count and at least one byte are read, the count then sets the number of bytes left
+            blockCountPending = true;
+            transferRemaining = 2;
+        }
+#endif
+    }
+    lastActivity = TWIHardware::readTimer();
+    sclReleased = lastActivity;
+    sdaReleased = lastActivity;
+#if TWI_STATISTICS
+    transactionStart = TWIHardware::readTimer();
+#endif
+}
+
+/*!
+ * Switches the bus speed to the one of the device, called before the START of every transaction. Devices without a
+ * profile run with the speed of configure(). TWBR and TWPS are only written if the speed changes.
+ * @param address Address of the slave device
+ */
+void TWI::applyProfile(uint8_t address)
+{
+    uint8_t bitRate = bitRateValue;
+    PrescalerValue prescaler = prescalerValue;
+    for (uint8_t index = 0; index < deviceProfileCount; index++) {
+        if (deviceProfiles[index].address == address) {
+            bitRate = deviceProfiles[index].bitRate;
+            prescaler = deviceProfiles[index].prescaler;
             break;
+        }
+    }
+    if ((bitRate != activeBitRate) || (prescaler != activePrescaler)) {
+        TWIHardware::writeBitRate(bitRate);
+        TWIHardware::writeStatus(static_cast<uint8_t>(prescaler));
+        activeBitRate = bitRate;
+        activePrescaler = prescaler;
+    }
+}
+
+/*!
+ * Moves the cursor to the next segment of a scatter-gather transaction. Called from within the interrupt only.
+ * @return Whether the segment continues the transfer or needs a repeated START, End after the last segment
+ */
+TWI::TWISegmentStep TWI::nextSegment()
+{
+    if (segmentsRemaining == 0) {
+        return TWISegmentStep::End;
+    }
+    bool restart = segment->restart || (segment->direction != transferDirection);
+    transferCursor = segment->data;
+    transferRemaining = segment->length;
+    transferDirection = segment->direction;
+    segment++;
+    segmentsRemaining--;
+
+    // The last byte of a read is NACKed, which has to take the segments continuing the read into account
+    readAhead = 0;
+    if (transferDirection == TWIDirection::Read) {
+        uint8_t index = 0;
+        for (; (index < segmentsRemaining) &&
+               (segment[index].direction == TWIDirection::Read) && !segment[index].restart; index++) {
+            readAhead += segment[index].length;
+        }
+#if TWI_PEC
+        // The PEC byte continues a read that runs up to the end of the transaction
+        readTrailer = (pecTrailer && (index == segmentsRemaining)) ? 1 : 0;
+#endif
+    }
+    return restart ? TWISegmentStep::Restart : TWISegmentStep::Continue;
+}
+
+bool TWI::readContinues()
+{
+#if TWI_PEC
+    return transferRemaining + readAhead + readTrailer > 1;
+#else
+    return transferRemaining + readAhead > 1;
+#endif
+}
+
+void TWI::transmit(uint8_t data)
+{
+#if TWI_PEC
+    TWI_PEC_UPDATE(pecCrc, data);
+#endif
+    TWIHardware::writeData(data);
+}
+
+uint8_t TWI::receive()
+{
+    uint8_t data = TWIHardware::readData();
+#if TWI_PEC
+    TWI_PEC_UPDATE(pecCrc, data);
+#endif
+    return data;
+}
 
-    default:
+/*!
+ * Finishes the transaction on the bus and chains the next queued transaction without releasing the bus in between.
+ * Called from within the interrupt only.
+ * @param result Result to be reported for the finished transaction
+ * @param ownsBus false if the bus has already been released by the hardware, e.g. after an arbitration loss
+ */
+void TWI::completeTransaction(TWIResult result, bool ownsBus)
+{
+    TWITransaction *done = current;
+    bool holdBus = ownsBus && done->repeatedStart && (result == TWIResult::Success);
+
+    queueHead = static_cast<uint8_t>((queueHead + 1) & (TWI_QUEUE_SIZE - 1));
+    if (queueHead != queueTail) {
+        loadTransaction(queue[queueHead]);
+        TWIInfo.state = Initializing;
+        if (ownsBus && !holdBus) {
+            TWIHardware::writeControl(TWIControl::STOP_START);
+        }
+        else {
+            TWIHardware::writeControl(TWIControl::START);
+        }
+    }
+    else {
+        current = nullptr;
+        if (holdBus) {
+            // The next submitted transaction continues with a repeated START
+            TWIInfo.state = RepeatedStartSent;
+            TWIHardware::writeControl(TWIControl::HOLD);
+        }
+        else {
             TWIInfo.state = Available;
-            break;
+            if (ownsBus) {
+                TWIHardware::writeControl((mode == TWIMode::Slave) ? TWIControl::STOP_SLAVE : TWIControl::STOP);
+            }
+            else if (mode == TWIMode::Slave) {
+                TWIHardware::writeControl(TWIControl::SLAVE);
+            }
+            else {
+                TWIHardware::writeControl(TWIControl::NACK);
+            }
+        }
+    }
+
+    finishTransaction(done, result);
+}
+
+/*!
+ * Finishes the current transaction while the driver is addressed as slave after lost arbitration. The next queued
+ * transaction is started by checkRestart() once the other master is done. Called from within the interrupt only.
+ * @param result Result to be reported for the finished transaction
+ */
+void TWI::dropTransaction(TWIResult result)
+{
+    TWITransaction *done = current;
+    queueHead = static_cast<uint8_t>((queueHead + 1) & (TWI_QUEUE_SIZE - 1));
+    if (queueHead != queueTail) {
+        loadTransaction(queue[queueHead]);
+        restartStamp = TWIHardware::readTimer();
+        restartBackoff = 0;
+        restartPolls = 0;
+        restartPending = true;
+    }
+    else {
+        current = nullptr;
+    }
+    finishTransaction(done, result);
+}
+
+void TWI::finishTransaction(TWITransaction *done, TWIResult result)
+{
+#if TWI_STATISTICS
+    // log2 histogram: the bucket is the number of significant bits of the duration
+    uint16_t ticks = static_cast<uint16_t>(TWIHardware::readTimer() - transactionStart);
+    uint8_t bucket = 0;
+    while ((ticks != 0) && (bucket < TWI_LATENCY_BUCKETS - 1)) {
+        ticks >>= 1;
+        bucket++;
+    }
+    statistics.latency[bucket]++;
+    statistics.transactions++;
+#endif
+
+    done->result = result;
+    if (done->callback != nullptr) {
+        done->callback(done);
+    }
+}
+#endif
+
+
+#if TWI_MASTER
+/*!
+ * Interrupt handlers, one per group of status codes. Each handler writes the final TWCR value itself, so the interrupt
+ * costs one table lookup and one indirect call on top of the work of the state.
+ */
+void TWI::onStart()
+{
+    // Address the slave of the transaction at the head of the queue. The register address of a combined transaction is
+    // written first, the read follows after the repeated START
+    if (registerRemaining > 0) {
+        transmit(static_cast<uint8_t>(current->address << 1));
+    }
+    else {
+        transmit(static_cast<uint8_t>((current->address << 1) | static_cast<uint8_t>(transferDirection)));
+    }
+    TWI_COUNT(bytesTransmitted);
+    TWIHardware::writeControl(TWIControl::TRANSMIT);
+}
+
+void TWI::onMasterTransmitAddressed()
+{
+    TWIInfo.state = MasterTransmitter;
+    TWIInfo.status = Master_TX_Init;
+    onMasterTransmitData();
+}
+
+void TWI::onMasterTransmitData()
+{
+    if (registerRemaining > 0) {
+        registerRemaining--;
+        transmit(static_cast<uint8_t>(current->reg >> (8 * registerRemaining)));
+        TWI_COUNT(bytesTransmitted);
+        TWIHardware::writeControl(TWIControl::TRANSMIT);
+    }
+    else if (transferDirection == TWIDirection::Read) {
+        // Register address of a combined transaction is written, continue with SLA+R without a STOP
+        TWIHardware::writeControl(TWIControl::START);
+    }
+    else if (transferRemaining > 0) {
+        transferRemaining--;
+        transmit((flashCursor != 0) ? TWIHardware::readFlash(flashCursor++) : *transferCursor++);
+        TWI_COUNT(bytesTransmitted);
+        TWIInfo.status = Master_TX_Progress;
+        TWIHardware::writeControl(TWIControl::TRANSMIT);
+    }
+    else {
+        switch (nextSegment()) {
+            case TWISegmentStep::Continue:
+                // Next write segment follows without a gap on the bus
+                onMasterTransmitData();
+                break;
+
+            case TWISegmentStep::Restart:
+                TWIHardware::writeControl(TWIControl::START);
+                break;
+
+            default:
+#if TWI_PEC
+                if (pecTrailer) {
+                    // All bytes of the transaction are sent, the CRC over them follows as last byte
+                    pecTrailer = false;
+                    TWIHardware::writeData(pecCrc);
+                    TWI_COUNT(bytesTransmitted);
+                    TWIHardware::writeControl(TWIControl::TRANSMIT);
+                    break;
+                }
+#endif
+                TWIInfo.status = Master_TX_Complete;
+                completeTransaction(TWIResult::Success, true);
+                break;
+        }
+    }
+}
+
+void TWI::onMasterTransmitNack()
+{
+    // A NACK on the last byte is a valid end of transmission, but not on the register address
+    if ((transferRemaining > 0) || (registerRemaining > 0) || (transferDirection == TWIDirection::Read) ||
+        (segmentsRemaining > 0)) {
+#if TWI_STATISTICS
+        // The register address is the only thing written ahead of a combined read or ahead of the first data byte
+        if ((registerRemaining > 0) || (transferDirection == TWIDirection::Read) ||
+            ((current->registerSize != TWIRegisterSize::None) && (transferRemaining == current->length))) {
+            statistics.registerNacks++;
+        }
+        else {
+            statistics.dataNacks++;
+        }
+#endif
+        TWIInfo.status = Error;
+        completeTransaction(TWIResult::DataNack, true);
+    }
+#if TWI_PEC
+    else if (current->pec) {
+        // Only the PEC byte may be NACKed, that is how the slave reports a mismatch
+        TWIInfo.status = Error;
+        if (pecTrailer) {
+            TWI_COUNT(dataNacks);
+            completeTransaction(TWIResult::DataNack, true);
+        }
+        else {
+            TWI_COUNT(pecErrors);
+            completeTransaction(TWIResult::PecError, true);
+        }
+    }
+#endif
+    else {
+        TWIInfo.status = Master_TX_Complete;
+        completeTransaction(TWIResult::Success, true);
+    }
+}
+
+void TWI::onAddressNack()
+{
+    TWI_COUNT(addressNacks);
+    TWIInfo.status = Error;
+    completeTransaction(TWIResult::AddressNack, true);
+}
+
+void TWI::onArbitrationLost()
+{
+    TWI_COUNT(arbitrationLosses);
+    TWIInfo.status = Error;
+    if (scheduleRetry()) {
+        // Release the bus to the other master, listening to the own address in slave mode
+        TWIInfo.state = Available;
+        TWIHardware::writeControl((mode == TWIMode::Slave) ? TWIControl::SLAVE : TWIControl::NACK);
+    }
+    else {
+        completeTransaction(TWIResult::ArbitrationLost, false);
+    }
+}
+
+#endif
+
+#if TWI_MASTER && TWI_SLAVE
+void TWI::onSlaveReceiveArbitrationLost()
+{
+    // The master that won addresses the driver: serve it first, the transaction is restarted after its STOP
+    TWI_COUNT(arbitrationLosses);
+    if ((current != nullptr) && !scheduleRetry()) {
+        dropTransaction(TWIResult::ArbitrationLost);
+    }
+    onSlaveReceiveAddressed();
+}
+
+void TWI::onSlaveTransmitArbitrationLost()
+{
+    TWI_COUNT(arbitrationLosses);
+    if ((current != nullptr) && !scheduleRetry()) {
+        dropTransaction(TWIResult::ArbitrationLost);
+    }
+    onSlaveTransmitAddressed();
+}
+
+#endif
+
+#if TWI_MASTER
+void TWI::onMasterReceiveAddressed()
+{
+    TWIInfo.state = MasterReceiver;
+    TWIInfo.status = Master_RX_Init;
+    // Checking if more than 1 byte is expected. If yes, send ACK, else send NACK
+    TWIHardware::writeControl(readContinues() ? TWIControl::ACK : TWIControl::NACK);
+}
+
+void TWI::onMasterReceiveData()
+{
+    *transferCursor++ = receive();
+    transferRemaining--;
+    TWI_COUNT(bytesReceived);
+    TWIInfo.status = Master_RX_Progress;
+#if TWI_PEC
+    if (blockCountPending) {
+        // SMBus block read: the first byte is the number of bytes that follow
+        blockCountPending = false;
+        uint8_t count = current->data[0];
+        if (count < current->length) {
+            transferRemaining = count;
+        }
+        else {
+            // The next byte ends the read with a NACK, the transaction fails
+            blockOverflow = true;
+            transferRemaining = 0;
+            readTrailer = 0;
+        }
+    }
+#endif
+    // The read continues into the next segment
+    while ((transferRemaining == 0) && (readAhead > 0)) {
+        nextSegment();
+    }
+    // Checking if more than 1 byte is expected. If yes, send ACK, else send NACK
+    TWIHardware::writeControl(readContinues() ? TWIControl::ACK : TWIControl::NACK);
+}
+
+void TWI::onMasterReceiveLast()
+{
+    if (transferRemaining > 0) {
+        *transferCursor++ = receive();
+        transferRemaining--;
+        TWI_COUNT(bytesReceived);
+    }
+#if TWI_PEC
+    else if (readTrailer != 0) {
+        // The CRC over all bytes of the transaction including a matching PEC is 0
+        receive();
+        readTrailer = 0;
+        pecTrailer = false;
+        TWI_COUNT(bytesReceived);
+    }
+#endif
+    TWISegmentStep step = nextSegment();
+    while ((step == TWISegmentStep::Continue) && (transferRemaining == 0)) {
+        step = nextSegment();
+    }
+    if (step != TWISegmentStep::End) {
+        // A read is ended by the NACK, anything following needs a repeated START
+        TWIHardware::writeControl(TWIControl::START);
+        return;
+    }
+    TWIInfo.status = Master_RX_Complete;
+#if TWI_PEC
+    if (blockOverflow) {
+        completeTransaction(TWIResult::BlockOverflow, true);
+        return;
+    }
+    if (current->pec && (pecCrc != 0)) {
+        TWI_COUNT(pecErrors);
+        completeTransaction(TWIResult::PecError, true);
+        return;
+    }
+#endif
+    completeTransaction(TWIResult::Success, true);
+}
+
+#endif
+
+void TWI::onBusError()
+{
+    TWI_COUNT(busErrors);
+    TWIInfo.status = Error;
+    // Writing TWSTO releases the lines without sending a STOP on the bus
+#if TWI_MASTER
+    if (current != nullptr) {
+        completeTransaction(TWIResult::BusError, true);
+        return;
+    }
+#endif
+    TWIInfo.state = Available;
+    TWIHardware::writeControl((mode == TWIMode::Slave) ? TWIControl::RECOVER_SLAVE : TWIControl::RECOVER);
+}
+
+#if TWI_SLAVE
+void TWI::onSlaveTransmitAddressed()
+{
+    // Reset buffer pointer
+    txIndex = 0;
+#if TWI_PEC
+    // The read of an SMBus command continues the CRC of the write that sent the command
+    if (!slavePecCarry) {
+        slavePecCrc = 0;
+    }
+    slavePecCarry = false;
+    slavePecNext = false;
+    TWI_PEC_UPDATE(slavePecCrc, static_cast<uint8_t>((slaveModeAddress << 1) | 0x01));
+#endif
+    if ((registerMap == nullptr) && (slaveStream == nullptr) && txRing.available()) {
+        replyRemaining = txRing.open();
+        replyActive = true;
+    }
+    TWIInfo.state = SlaveTransmitter;
+    onSlaveTransmitData();
+}
+
+void TWI::onSlaveTransmitData()
+{
+    TWI_COUNT(bytesTransmitted);
+    if (registerMap != nullptr) {
+        uint8_t reg = registerMap->pointer;
+        bool hidden = (registerMap->writeOnly != nullptr) &&
+                      (registerMap->writeOnly[reg >> 3] & (1 << (reg & 0x07)));
+        TWIHardware::writeData(hidden ? 0 : registerMap->registers[reg]);
+        registerMap->pointer = static_cast<uint8_t>((reg + 1 < registerMap->size) ? (reg + 1) : 0);
+    }
+    else if (slaveStream != nullptr) {
+        uint8_t data = 0;
+        slaveStream->next(data);
+        TWIHardware::writeData(data);
+    }
+#if TWI_PEC
+    else if (slavePecNext) {
+        // PEC after the last byte of the reply
+        slavePecNext = false;
+        TWIHardware::writeData(slavePecCrc);
+        TWIHardware::writeControl(TWIControl::NACK);
+        return;
+    }
+#endif
+    else if (replyActive) {
+        if (replyRemaining > 0) {
+            replyRemaining--;
+            uint8_t data = txRing.next();
+#if TWI_PEC
+            TWI_PEC_UPDATE(slavePecCrc, data);
+#endif
+            TWIHardware::writeData(data);
+        }
+        else {
+            TWIHardware::writeData(0);
+        }
+        if (replyRemaining == 0) {
+            txRing.release();
+            replyActive = false;
+#if TWI_PEC
+            if (slavePec) {
+                slavePecNext = true;
+                TWIHardware::writeControl(TWIControl::SLAVE);
+                return;
+            }
+#endif
+            // Last byte of the reply, TWEA = 0 tells the hardware not to expect an ACK anymore
+            TWIHardware::writeControl(TWIControl::NACK);
+            return;
+        }
+    }
+    // Copy data from current buffer position
+    else if (txIndex < txBufferLen) {
+        TWIHardware::writeData(txBuffer[txIndex++]);
+    }
+    else {
+        TWIHardware::writeData(0);
+    }
+    TWIHardware::writeControl(TWIControl::SLAVE);
+}
+
+void TWI::onSlaveTransmitNack()
+{
+    // The master stopped reading before the end of the reply
+    if (replyActive) {
+        txRing.release();
+        replyActive = false;
+    }
+#if TWI_PEC
+    slavePecNext = false;
+#endif
+    TWIInfo.state = Available;
+    TWIHardware::writeControl(TWIControl::SLAVE);
+}
+
+void TWI::onSlaveReceiveAddressed()
+{
+    registerPointerPending = true;
+    registerWriteCount = 0;
+    TWIInfo.state = SlaveReciever;
+#if TWI_PEC
+    // SLA+W, or 0 for a general call
+    slavePecCrc = 0;
+    slavePecCarry = false;
+    TWI_PEC_UPDATE(slavePecCrc, (TWI_STATUS & 0x10) ? 0 : static_cast<uint8_t>(slaveModeAddress << 1));
+#endif
+    // No room for another message, NACK its first byte
+    bool full = (registerMap == nullptr) && !rxRing.start();
+    TWIHardware::writeControl(full ? TWIControl::NACK : TWIControl::SLAVE);
+}
+
+void TWI::onSlaveReceiveData()
+{
+    TWI_COUNT(bytesReceived);
+    if (registerMap != nullptr) {
+        uint8_t data = TWIHardware::readData();
+        if (registerPointerPending) {
+            registerPointerPending = false;
+            registerMap->pointer = (data < registerMap->size) ? data : 0;
+            registerWriteFirst = registerMap->pointer;
+        }
+        else {
+            uint8_t reg = registerMap->pointer;
+            if ((registerMap->readOnly == nullptr) ||
+                !(registerMap->readOnly[reg >> 3] & (1 << (reg & 0x07)))) {
+                registerMap->registers[reg] = data;
+            }
+            registerWriteCount++;
+            registerMap->pointer = static_cast<uint8_t>((reg + 1 < registerMap->size) ? (reg + 1) : 0);
+        }
+        TWIHardware::writeControl(TWIControl::SLAVE);
+    }
+    else {
+        // Append to the message of this transfer. If the next byte does not fit anymore it is NACKed
+        uint8_t data = TWIHardware::readData();
+#if TWI_PEC
+        TWI_PEC_UPDATE(slavePecCrc, data);
+#endif
+        rxRing.put(data);
+        TWIHardware::writeControl(rxRing.hasRoom() ? TWIControl::SLAVE : TWIControl::NACK);
+    }
+}
+
+void TWI::onSlaveStop()
+{
+    if ((registerMap != nullptr) && (registerWriteCount > 0) && (registerMap->written != nullptr)) {
+        registerMap->written(registerWriteFirst, registerWriteCount);
+    }
+    registerWriteCount = 0;
+#if TWI_PEC
+    if (slavePec && (registerMap == nullptr)) {
+        // A one byte write is the command of a following read, longer writes end with their PEC
+        uint8_t length = rxRing.frameSize();
+        slavePecCarry = (length == 1);
+        if ((length > 1) && (slavePecCrc != 0)) {
+            rxRing.discard();
+            slavePecErrors++;
+            TWI_COUNT(pecErrors);
+        }
+        else if (length > 1) {
+            rxRing.unput();
+        }
+    }
+#endif
+    if (registerMap == nullptr) {
+        rxRing.commit();
+    }
+    TWIInfo.state = Available;
+    TWIHardware::writeControl(TWIControl::SLAVE);
+}
+
+void TWI::onSlaveReceiveNack()
+{
+    // Only sent when the receiver buffer is full: drop the incomplete message instead of overwriting memory
+    if (registerMap == nullptr) {
+        rxRing.discard();
+        rxRing.overflows++;
+    }
+    TWIInfo.state = Available;
+    TWIHardware::writeControl(TWIControl::SLAVE);
+}
+
+void TWI::onSlaveTransmitLast()
+{
+    TWIInfo.state = Available;
+    TWIHardware::writeControl(TWIControl::SLAVE);
+}
+
+#endif
+
+/** Status code not expected in this build or mode: TWINT is cleared to release SCL, as slave the address is ACKed **/
+void TWI::onUnexpected()
+{
+    TWIInfo.state = Available;
+    TWIHardware::writeControl((mode == TWIMode::Slave) ? TWIControl::SLAVE : TWIControl::RELEASE);
+}
+
+/****************************************************************/
+/* Dispatch table indexed by TWSR >> 3. The prescaler bits and  */
+/* the reserved bit are shifted out, so every status code maps  */
+/* to one of the 32 entries without masking. It is kept in      */
+/* program memory, an entry is loaded with two LPM.             */
+/****************************************************************/
+#if TWI_MASTER
+#define MASTER_HANDLER(handler) &TWI::handler
+#else
+#define MASTER_HANDLER(handler) &TWI::onUnexpected
+#endif
+#if TWI_SLAVE
+#define SLAVE_HANDLER(handler) &TWI::handler
+#else
+#define SLAVE_HANDLER(handler) &TWI::onUnexpected
+#endif
+// Arbitration lost to a master addressing the driver, only possible with both roles
+#if TWI_MASTER && TWI_SLAVE
+#define ARBITRATION_HANDLER(handler, slaveHandler) &TWI::handler
+#else
+#define ARBITRATION_HANDLER(handler, slaveHandler) SLAVE_HANDLER(slaveHandler)
+#endif
+
+const TWI::TWIStateHandler TWI::stateHandlers[32] PROGMEM = {
+    &TWI::onBusError,                                                               /* 0x00 TWI_BUS_ERROR */
+    MASTER_HANDLER(onStart),                                                        /* 0x08 TWI_START */
+    MASTER_HANDLER(onStart),                                                        /* 0x10 TWI_RESTART */
+    MASTER_HANDLER(onMasterTransmitAddressed),                                      /* 0x18 TWI_MT_SLA_ACK */
+    MASTER_HANDLER(onAddressNack),                                                  /* 0x20 TWI_MT_SLA_NACK */
+    MASTER_HANDLER(onMasterTransmitData),                                           /* 0x28 TWI_MT_DATA_ACK */
+    MASTER_HANDLER(onMasterTransmitNack),                                           /* 0x30 TWI_MT_DATA_NACK */
+    MASTER_HANDLER(onArbitrationLost),                                              /* 0x38 TWI_M_ARB_LOST */
+    MASTER_HANDLER(onMasterReceiveAddressed),                                       /* 0x40 TWI_MR_SLA_ACK */
+    MASTER_HANDLER(onAddressNack),                                                  /* 0x48 TWI_MR_SLA_NACK */
+    MASTER_HANDLER(onMasterReceiveData),                                            /* 0x50 TWI_MR_DATA_ACK */
+    MASTER_HANDLER(onMasterReceiveLast),                                            /* 0x58 TWI_MR_DATA_NACK */
+    SLAVE_HANDLER(onSlaveReceiveAddressed),                                         /* 0x60 TWI_SR_SLA_ACK */
+    ARBITRATION_HANDLER(onSlaveReceiveArbitrationLost, onSlaveReceiveAddressed),    /* 0x68 TWI_SR_SLA_ACK_M_ARB_LOST */
+    SLAVE_HANDLER(onSlaveReceiveAddressed),                                         /* 0x70 TWI_SR_GEN_ACK */
+    ARBITRATION_HANDLER(onSlaveReceiveArbitrationLost, onSlaveReceiveAddressed),    /* 0x78 TWI_SR_GEN_ACK_M_ARB_LOST */
+    SLAVE_HANDLER(onSlaveReceiveData),                                              /* 0x80 TWI_SR_SLA_DATA_ACK */
+    SLAVE_HANDLER(onSlaveReceiveNack),                                              /* 0x88 TWI_SR_SLA_DATA_NACK */
+    SLAVE_HANDLER(onSlaveReceiveData),                                              /* 0x90 TWI_SR_GEN_DATA_ACK */
+    SLAVE_HANDLER(onSlaveReceiveNack),                                              /* 0x98 TWI_SR_GEN_DATA_NACK */
+    SLAVE_HANDLER(onSlaveStop),                                                     /* 0xA0 TWI_SR_STOP_RESTART */
+    SLAVE_HANDLER(onSlaveTransmitAddressed),                                        /* 0xA8 TWI_ST_SLA_ACK */
+    ARBITRATION_HANDLER(onSlaveTransmitArbitrationLost, onSlaveTransmitAddressed),  /* 0xB0 TWI_ST_SLA_ACK_M_ARB_LOST */
+    SLAVE_HANDLER(onSlaveTransmitData),                                             /* 0xB8 TWI_ST_DATA_ACK */
+    SLAVE_HANDLER(onSlaveTransmitNack),                                             /* 0xC0 TWI_ST_DATA_NACK */
+    SLAVE_HANDLER(onSlaveTransmitLast),                                             /* 0xC8 TWI_ST_DATA_ACK_LAST_BYTE */
+    &TWI::onUnexpected,                                                             /* 0xD0 */
+    &TWI::onUnexpected,                                                             /* 0xD8 */
+    &TWI::onUnexpected,                                                             /* 0xE0 */
+    &TWI::onUnexpected,                                                             /* 0xE8 */
+    &TWI::onUnexpected,                                                             /* 0xF0 */
+    &TWI::onUnexpected                                                              /* 0xF8 No relevant state information available */
+};
+
+#undef MASTER_HANDLER
+#undef SLAVE_HANDLER
+#undef ARBITRATION_HANDLER
+
+void TWI::twi_interrupt_handler()
+{
+    uint8_t status = TWIHardware::readStatus();
+    uint16_t now = TWIHardware::readTimer();
+    lastActivity = now;
+#if TWI_TRACE_SIZE
+    TWITraceEntry &entry = trace[traceNext];
+    entry.time = now;
+    entry.status = static_cast<uint8_t>(status & 0xF8);
+    entry.state = static_cast<uint8_t>(TWIInfo.state);
+    entry.data = TWIHardware::readData();
+    traceNext = static_cast<uint8_t>((traceNext + 1) & (TWI_TRACE_SIZE - 1));
+    if (traceNext == 0) {
+        traceWrapped = true;
     }
+#endif
+    TWIHardware::readFunction(&stateHandlers[status >> 3])();
 }
 
 ISR(TWI_vect) {
-    twi.twi_interrupt_handler();
+    TWI::twi_interrupt_handler();
 }
 
+#ifdef TWI_TIMER_VECT
+/* Only wakes TWIWaitMode::Sleep, see TWI::pause() */
+EMPTY_INTERRUPT(TWI_TIMER_VECT);
+#endif
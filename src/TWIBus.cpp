@@ -0,0 +1,121 @@
+//
+// Master side of a TWI bus, implemented by the TWI peripheral and by software buses.
+//
+
+#include <TWIBus.h>
+
+/*!
+ * The hardware bus, created on first use. All constructors involved are constexpr, so it is constant initialized:
+ * neither a static constructor nor a guard variable is emitted.
+ * @return The single TWIHardwareBus
+ */
+TWIHardwareBus &TWIHardwareBus::instance()
+{
+    static TWIHardwareBus hardwareBus;
+    return hardwareBus;
+}
+
+/*!
+ * Writes data in one transaction, 0 bytes just address the slave
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param data Bytes to write, not copied
+ * @param length Number of bytes
+ * @return Result of the transaction
+ */
+TWIResult TWIBus::write(uint8_t slaveAddress, const uint8_t *data, uint16_t length)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Write;
+    // The buffer is only read from for write transactions
+    transaction.data = const_cast<uint8_t *>(data);
+    transaction.length = length;
+    return transfer(transaction);
+}
+
+TWIResult TWIBus::read(uint8_t slaveAddress, uint8_t *data, uint16_t length)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Read;
+    transaction.data = data;
+    transaction.length = length;
+    return transfer(transaction);
+}
+
+/*!
+ * Writes registers of a slave device: the register address is sent ahead of the data in the same transmission
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param reg Address of the first register
+ * @param data Register values, not copied
+ * @param length Number of bytes to be written
+ * @param registerSize 8 or 16 bit register address
+ * @return Result of the transaction
+ */
+TWIResult TWIBus::writeRegister(uint8_t slaveAddress,
+                                uint16_t reg,
+                                const uint8_t *data,
+                                uint16_t length,
+                                TWIRegisterSize registerSize)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Write;
+    transaction.data = const_cast<uint8_t *>(data);
+    transaction.length = length;
+    transaction.registerSize = registerSize;
+    transaction.reg = reg;
+    return transfer(transaction);
+}
+
+/*!
+ * Reads registers of a slave device: the register address is written, then the data is read after a repeated START
+ * @param slaveAddress Address of the TWI slave device (7 bit wide)
+ * @param reg Address of the first register
+ * @param data Receives the register values
+ * @param length Number of bytes to be read
+ * @param registerSize 8 or 16 bit register address
+ * @return Result of the transaction
+ */
+TWIResult TWIBus::readRegister(uint8_t slaveAddress,
+                               uint16_t reg,
+                               uint8_t *data,
+                               uint16_t length,
+                               TWIRegisterSize registerSize)
+{
+    TWITransaction transaction = {};
+    transaction.address = slaveAddress;
+    transaction.direction = TWIDirection::Read;
+    transaction.data = data;
+    transaction.length = length;
+    transaction.registerSize = registerSize;
+    transaction.reg = reg;
+    return transfer(transaction);
+}
+
+bool TWIBus::supports(const TWITransaction &) const
+{
+    return true;
+}
+
+/** Nothing to do for buses that detect timeouts by themselves, like the software bus in tick() **/
+void TWIBus::service()
+{
+}
+
+/*!
+ * Submits a transaction on caller owned memory and waits for it, waiting for room in the queue first
+ * @param transaction Descriptor of the transaction
+ * @return Result of the transaction, TWIResult::Unsupported if the bus cannot run it
+ */
+TWIResult TWIBus::transfer(TWITransaction &transaction)
+{
+    if (!supports(transaction)) {
+        transaction.result = TWIResult::Unsupported;
+        return transaction.result;
+    }
+    while (!submit(transaction)) {
+        TWIHardware::idle();
+    }
+    return wait(transaction);
+}
@@ -0,0 +1,151 @@
+//
+// Storage driver for AT24Cxx EEPROMs and I2C FRAMs.
+//
+
+#include <TWIEeprom.h>
+
+/*!
+ * Describes the memory
+ * @param address Slave address of the first chip, further chips follow at consecutive addresses
+ * @param chipSize Bytes addressed by one slave address
+ * @param pageSize Bytes of a page write, 0 for FRAM which has neither pages nor a write cycle
+ * @param addressSize 8 or 16 bit memory address
+ * @param chips Number of chips, more than MAX_CHIPS are limited to MAX_CHIPS
+ * @param bus Bus the chips are attached to
+ */
+TWIEeprom::TWIEeprom(uint8_t address,
+                     uint32_t chipSize,
+                     uint16_t pageSize,
+                     TWIRegisterSize addressSize,
+                     uint8_t chips,
+                     TWIBus &bus)
+    : bus(bus),
+      baseAddress(address),
+      chipSize(chipSize),
+      pageSize(pageSize),
+      addressSize(addressSize),
+      chips(chips),
+      writeCycles(0),
+      polls(0)
+{
+    // writeCycles has a bit per chip
+    if (this->chips > MAX_CHIPS) {
+        this->chips = MAX_CHIPS;
+    }
+}
+
+/*!
+ * Writes any number of bytes. Every page is one transaction straight from data, each chip is polled for the end of
+ * its previous write cycle right before it is written to again. Returns as soon as the last page is on the chip,
+ * without waiting for its write cycle.
+ * @param address First byte of the memory
+ * @param data Bytes to write, not copied
+ * @param length Number of bytes
+ * @return Result of the first transaction that failed, TWIResult::Success otherwise. TWIResult::OutOfRange if the
+ * range exceeds the memory
+ */
+TWIResult TWIEeprom::write(uint32_t address, const uint8_t *data, uint16_t length)
+{
+    if (address + length > size()) {
+        return TWIResult::OutOfRange;
+    }
+    while (length > 0) {
+        auto chip = static_cast<uint8_t>(address / chipSize);
+        uint32_t offset = address % chipSize;
+        uint32_t chunk = chipSize - offset;
+        if ((pageSize > 0) && (pageSize - offset % pageSize < chunk)) {
+            chunk = pageSize - offset % pageSize;
+        }
+        if (length < chunk) {
+            chunk = length;
+        }
+
+        TWIResult result = ready(chip);
+        if (result == TWIResult::Success) {
+            result = bus.writeRegister(static_cast<uint8_t>(baseAddress + chip), static_cast<uint16_t>(offset), data,
+                                       static_cast<uint16_t>(chunk), addressSize);
+        }
+        if (result != TWIResult::Success) {
+            return result;
+        }
+        if (pageSize > 0) {
+            writeCycles |= static_cast<uint8_t>(1 << chip);
+        }
+        address += chunk;
+        data += chunk;
+        length = static_cast<uint16_t>(length - chunk);
+    }
+    return TWIResult::Success;
+}
+
+/*!
+ * Reads any number of bytes, one sequential read per chip
+ * @param address First byte of the memory
+ * @param data Receives the bytes
+ * @param length Number of bytes
+ * @return Result of the first transaction that failed, TWIResult::Success otherwise. TWIResult::OutOfRange if the
+ * range exceeds the memory
+ */
+TWIResult TWIEeprom::read(uint32_t address, uint8_t *data, uint16_t length)
+{
+    if (address + length > size()) {
+        return TWIResult::OutOfRange;
+    }
+    while (length > 0) {
+        auto chip = static_cast<uint8_t>(address / chipSize);
+        uint32_t offset = address % chipSize;
+        uint32_t chunk = chipSize - offset;
+        if (length < chunk) {
+            chunk = length;
+        }
+
+        TWIResult result = ready(chip);
+        if (result == TWIResult::Success) {
+            result = bus.readRegister(static_cast<uint8_t>(baseAddress + chip), static_cast<uint16_t>(offset), data,
+                                      static_cast<uint16_t>(chunk), addressSize);
+        }
+        if (result != TWIResult::Success) {
+            return result;
+        }
+        address += chunk;
+        data += chunk;
+        length = static_cast<uint16_t>(length - chunk);
+    }
+    return TWIResult::Success;
+}
+
+TWIResult TWIEeprom::sync()
+{
+    for (uint8_t chip = 0; chip < chips; chip++) {
+        TWIResult result = ready(chip);
+        if (result != TWIResult::Success) {
+            return result;
+        }
+    }
+    return TWIResult::Success;
+}
+
+/*!
+ * ACK polling: an EEPROM does not acknowledge its address while it programs a page, so SLA+W is repeated until it
+ * does. Takes as long as the write cycle actually needs instead of the worst case of the data sheet.
+ * @param chip Index of the chip
+ * @return TWIResult::Success once the chip acknowledged, TWIResult::Timeout after TWI_EEPROM_POLL_LIMIT polls
+ */
+TWIResult TWIEeprom::ready(uint8_t chip)
+{
+    auto mask = static_cast<uint8_t>(1 << chip);
+    if (!(writeCycles & mask)) {
+        return TWIResult::Success;
+    }
+    for (uint16_t poll = 0; poll < TWI_EEPROM_POLL_LIMIT; poll++) {
+        polls++;
+        TWIResult result = bus.write(static_cast<uint8_t>(baseAddress + chip), nullptr, 0);
+        if (result != TWIResult::AddressNack) {
+            if (result == TWIResult::Success) {
+                writeCycles = static_cast<uint8_t>(writeCycles & ~mask);
+            }
+            return result;
+        }
+    }
+    return TWIResult::Timeout;
+}
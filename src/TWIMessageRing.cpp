@@ -0,0 +1,153 @@
+//
+// Single-producer/single-consumer ring of framed messages.
+//
+
+#include <TWIMessageRing.h>
+
+TWIMessageRing::TWIMessageRing()
+    : overflows(0),
+      buffer(nullptr),
+      size(0),
+      head(0),
+      tail(0),
+      frameStart(0),
+      writeIndex(0),
+      frameLength(0),
+      frameOpen(false),
+      readIndex(0)
+{
+}
+
+void TWIMessageRing::attach(uint8_t *storage, uint8_t storageSize)
+{
+    buffer = storage;
+    size = storageSize;
+    head = 0;
+    tail = 0;
+    frameOpen = false;
+    overflows = 0;
+}
+
+/*!
+ * Opens a new frame at the end of the published frames. A previously opened frame is dropped
+ * @return false if not even the length byte fits into the ring
+ */
+bool TWIMessageRing::start()
+{
+    frameOpen = false;
+    // One byte always stays free to tell a full ring from an empty one
+    if ((size == 0) || (advance(tail) == head)) {
+        return false;
+    }
+    frameStart = tail;
+    writeIndex = advance(tail);
+    frameLength = 0;
+    frameOpen = true;
+    return true;
+}
+
+bool TWIMessageRing::hasRoom() const
+{
+    return frameOpen && (frameLength < 0xFF) && (advance(writeIndex) != head);
+}
+
+bool TWIMessageRing::put(uint8_t data)
+{
+    if (!hasRoom()) {
+        return false;
+    }
+    buffer[writeIndex] = data;
+    writeIndex = advance(writeIndex);
+    frameLength++;
+    return true;
+}
+
+void TWIMessageRing::commit()
+{
+    if (frameOpen) {
+        buffer[frameStart] = frameLength;
+        frameOpen = false;
+        // Publishing the new end makes the frame visible to the consumer
+        tail = writeIndex;
+    }
+}
+
+void TWIMessageRing::discard()
+{
+    frameOpen = false;
+}
+
+uint8_t TWIMessageRing::frameSize() const
+{
+    return frameOpen ? frameLength : 0;
+}
+
+void TWIMessageRing::unput()
+{
+    if (frameOpen && (frameLength > 0)) {
+        writeIndex = static_cast<uint8_t>((writeIndex > 0) ? (writeIndex - 1) : (size - 1));
+        frameLength--;
+    }
+}
+
+bool TWIMessageRing::write(const uint8_t *data, uint8_t length)
+{
+    if (!start()) {
+        return false;
+    }
+    for (uint8_t index = 0; index < length; index++) {
+        if (!put(data[index])) {
+            discard();
+            return false;
+        }
+    }
+    commit();
+    return true;
+}
+
+bool TWIMessageRing::available() const
+{
+    return head != tail;
+}
+
+uint8_t TWIMessageRing::open()
+{
+    if (!available()) {
+        return 0;
+    }
+    readIndex = advance(head);
+    return buffer[head];
+}
+
+uint8_t TWIMessageRing::next()
+{
+    uint8_t data = buffer[readIndex];
+    readIndex = advance(readIndex);
+    return data;
+}
+
+void TWIMessageRing::release()
+{
+    if (available()) {
+        // A frame is shorter than the ring, so it wraps around at most once
+        uint16_t index = head + buffer[head] + 1U;
+        if (index >= size) {
+            index -= size;
+        }
+        // Publishing the new start hands the space back to the producer
+        head = static_cast<uint8_t>(index);
+    }
+}
+
+uint8_t TWIMessageRing::read(uint8_t *data, uint8_t maxLength)
+{
+    uint8_t length = open();
+    if (length > maxLength) {
+        length = maxLength;
+    }
+    for (uint8_t index = 0; index < length; index++) {
+        data[index] = next();
+    }
+    release();
+    return length;
+}
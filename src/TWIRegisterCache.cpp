@@ -0,0 +1,220 @@
+//
+// Shadow copy of the registers of a slave device.
+//
+
+#include <TWIRegisterCache.h>
+
+/*!
+ * Describes the cached registers, all of them start volatile and unknown
+ * @param address Slave address of the device
+ * @param shadow count bytes, owned by the application
+ * @param flags TWI_CACHE_FLAG_BYTES(count) bytes, owned by the application
+ * @param count Number of registers, starting at register 0
+ * @param registerSize 8 or 16 bit register address
+ * @param bus Bus the device is attached to
+ */
+TWIRegisterCache::TWIRegisterCache(uint8_t address,
+                                   uint8_t *shadow,
+                                   uint8_t *flags,
+                                   uint16_t count,
+                                   TWIRegisterSize registerSize,
+                                   TWIBus &bus)
+    : bus(bus),
+      address(address),
+      shadow(shadow),
+      flags(flags),
+      count(count),
+      registerSize(registerSize),
+      mapBytes(static_cast<uint16_t>((count + 7) / 8)),
+      hits(0),
+      skipped(0)
+{
+    for (uint16_t index = 0; index < 3 * mapBytes; index++) {
+        flags[index] = 0;
+    }
+}
+
+void TWIRegisterCache::setCacheable(uint16_t first, uint16_t length, bool cacheable)
+{
+    for (uint16_t reg = first; (reg < count) && (reg - first < length); reg++) {
+        assign(Cacheable, reg, cacheable);
+        if (!cacheable) {
+            assign(Valid, reg, false);
+        }
+    }
+}
+
+/*!
+ * Writes registers through to the device. Registers at both ends of the range that are known to hold the value
+ * already are left out, the rest is one burst write.
+ * @param reg First register
+ * @param data New contents of the registers
+ * @param length Number of registers
+ * @return Result of the write, TWIResult::Success if nothing had to be written. TWIResult::OutOfRange if the range
+ * exceeds the cached registers
+ */
+TWIResult TWIRegisterCache::write(uint16_t reg, const uint8_t *data, uint16_t length)
+{
+    if (static_cast<uint32_t>(reg) + length > count) {
+        return TWIResult::OutOfRange;
+    }
+    uint16_t first = 0;
+    uint16_t end = length;
+    while ((first < end) && unchanged(static_cast<uint16_t>(reg + first), data[first])) {
+        first++;
+    }
+    while ((end > first) && unchanged(static_cast<uint16_t>(reg + end - 1), data[end - 1])) {
+        end--;
+    }
+    skipped += length - (end - first);
+    if (first == end) {
+        return TWIResult::Success;
+    }
+
+    TWIResult result = bus.writeRegister(address, static_cast<uint16_t>(reg + first), &data[first],
+                                         static_cast<uint16_t>(end - first), registerSize);
+    for (uint16_t index = first; index < end; index++) {
+        auto written = static_cast<uint16_t>(reg + index);
+        shadow[written] = data[index];
+        assign(Dirty, written, false);
+        // After a failed write the device may hold either value
+        assign(Valid, written, (result == TWIResult::Success) && test(Cacheable, written));
+    }
+    return result;
+}
+
+/*!
+ * Reads registers. Staged registers read back their staged value, the device is only read if a register of the range
+ * is volatile or not known yet.
+ * @param reg First register
+ * @param data Receives the registers
+ * @param length Number of registers
+ * @return Result of the read. TWIResult::OutOfRange if the range exceeds the cached registers
+ */
+TWIResult TWIRegisterCache::read(uint16_t reg, uint8_t *data, uint16_t length)
+{
+    if (static_cast<uint32_t>(reg) + length > count) {
+        return TWIResult::OutOfRange;
+    }
+    bool cached = true;
+    for (uint16_t index = 0; cached && (index < length); index++) {
+        auto current = static_cast<uint16_t>(reg + index);
+        cached = test(Cacheable, current) && (test(Valid, current) || test(Dirty, current));
+    }
+    if (cached) {
+        for (uint16_t index = 0; index < length; index++) {
+            data[index] = shadow[reg + index];
+        }
+        hits += length;
+        return TWIResult::Success;
+    }
+
+    TWIResult result = bus.readRegister(address, reg, data, length, registerSize);
+    if (result != TWIResult::Success) {
+        return result;
+    }
+    for (uint16_t index = 0; index < length; index++) {
+        auto current = static_cast<uint16_t>(reg + index);
+        if (test(Dirty, current)) {
+            data[index] = shadow[current];
+        } else {
+            shadow[current] = data[index];
+            assign(Valid, current, test(Cacheable, current));
+        }
+    }
+    return TWIResult::Success;
+}
+
+/*!
+ * Changes registers in the shadow only. Registers known to hold the value already are not staged.
+ * @param reg First register
+ * @param data New contents of the registers
+ * @param length Number of registers
+ * @return TWIResult::Success, TWIResult::OutOfRange if the range exceeds the cached registers
+ */
+TWIResult TWIRegisterCache::stage(uint16_t reg, const uint8_t *data, uint16_t length)
+{
+    if (static_cast<uint32_t>(reg) + length > count) {
+        return TWIResult::OutOfRange;
+    }
+    for (uint16_t index = 0; index < length; index++) {
+        auto current = static_cast<uint16_t>(reg + index);
+        if (unchanged(current, data[index])) {
+            skipped++;
+            continue;
+        }
+        shadow[current] = data[index];
+        assign(Dirty, current, true);
+    }
+    return TWIResult::Success;
+}
+
+/*!
+ * Writes the staged registers in ascending order. Consecutive staged registers are one burst write. Runs separated by
+ * a few known registers are joined and the known values written again, as long as that is shorter than the SLA+W and
+ * register address of another write.
+ * @return Result of the first write that failed, its registers and the following ones stay staged
+ */
+TWIResult TWIRegisterCache::flush()
+{
+    const uint16_t bridge = (registerSize == TWIRegisterSize::Word) ? 3 : 2;
+    uint16_t reg = 0;
+    while (reg < count) {
+        if (!test(Dirty, reg)) {
+            reg++;
+            continue;
+        }
+        auto end = static_cast<uint16_t>(reg + 1);
+        for (;;) {
+            while ((end < count) && test(Dirty, end)) {
+                end++;
+            }
+            uint16_t next = end;
+            while ((next < count) && (next - end < bridge) && !test(Dirty, next) && known(next)) {
+                next++;
+            }
+            if ((next == end) || (next >= count) || !test(Dirty, next)) {
+                break;
+            }
+            end = next;
+        }
+
+        TWIResult result = bus.writeRegister(address, reg, &shadow[reg], static_cast<uint16_t>(end - reg),
+                                             registerSize);
+        if (result != TWIResult::Success) {
+            return result;
+        }
+        for (; reg < end; reg++) {
+            assign(Dirty, reg, false);
+            assign(Valid, reg, test(Cacheable, reg));
+        }
+    }
+    return TWIResult::Success;
+}
+
+void TWIRegisterCache::invalidate()
+{
+    for (uint16_t index = 0; index < 2 * mapBytes; index++) {
+        flags[index] = 0;
+    }
+}
+
+bool TWIRegisterCache::test(Flag flag, uint16_t reg) const
+{
+    return flags[flag * mapBytes + reg / 8] & (1 << (reg % 8));
+}
+
+void TWIRegisterCache::assign(Flag flag, uint16_t reg, bool value)
+{
+    uint8_t &bits = flags[flag * mapBytes + reg / 8];
+    auto mask = static_cast<uint8_t>(1 << (reg % 8));
+    bits = value ? static_cast<uint8_t>(bits | mask) : static_cast<uint8_t>(bits & ~mask);
+}
+
+/*!
+ * @return true if the device is known to hold value in the register: cacheable, valid and not staged
+ */
+bool TWIRegisterCache::unchanged(uint16_t reg, uint8_t value) const
+{
+    return known(reg) && !test(Dirty, reg) && (shadow[reg] == value);
+}
@@ -0,0 +1,276 @@
+//
+// Periodic background reads of sensor registers.
+//
+
+#include <TWIScheduler.h>
+
+/*!
+ * @param bus Bus the devices of the jobs and polls are attached to
+ */
+TWIScheduler::TWIScheduler(TWIBus &bus)
+    : bus(bus),
+      jobTable(nullptr),
+      jobCount(0),
+      readyPolls(nullptr),
+      serviceDue(false)
+{
+}
+
+/*!
+ * Sets the job table. The first reads are spread over the first ticks, so jobs of the same period do not all fall
+ * into the same tick. The table has to stay valid until stop() and all its reads finished. A job longer than
+ * TWI_POLL_LENGTH is never read, its lastResult is TWIResult::OutOfRange.
+ * @param jobs Table owned by the application
+ * @param count Number of jobs
+ */
+void TWIScheduler::start(TWIPollJob *jobs, uint8_t count)
+{
+    TWIHardware::InterruptGuard guard;
+    for (uint8_t index = 0; index < count; index++) {
+        TWIPollJob &job = jobs[index];
+        job.countdown = (job.period > 0) ? static_cast<uint16_t>(index % job.period + 1) : 0;
+        job.sequence = 0;
+        job.lastResult = (job.length > TWI_POLL_LENGTH) ? TWIResult::OutOfRange : TWIResult::Idle;
+        job.overruns = 0;
+        job.errors = 0;
+        if (job.transaction.result != TWIResult::Pending) {
+            job.transaction = {};
+        }
+    }
+    jobTable = jobs;
+    jobCount = count;
+}
+
+void TWIScheduler::stop()
+{
+    TWIHardware::InterruptGuard guard;
+    jobTable = nullptr;
+    jobCount = 0;
+}
+
+/*!
+ * Counts down every job and submits the ones that are due. A job whose previous read is still queued counts an
+ * overrun and waits for its next period. If the transaction queue is full the job is retried on the next tick.
+ * The bus is not serviced here, a bus recovery must not run in an interrupt. The tick only asks service() for it.
+ */
+void TWIScheduler::tick()
+{
+    serviceDue = true;
+
+    TWIPollJob *jobs = jobTable;
+    for (uint8_t index = 0; index < jobCount; index++) {
+        TWIPollJob &job = jobs[index];
+        if ((job.period == 0) || (job.length > TWI_POLL_LENGTH)) {
+            continue;
+        }
+        if (job.countdown > 1) {
+            job.countdown--;
+            continue;
+        }
+        job.countdown = job.period;
+
+        TWITransaction &transaction = job.transaction;
+        if (transaction.result == TWIResult::Pending) {
+            job.overruns++;
+            continue;
+        }
+        transaction.address = job.address;
+        transaction.direction = TWIDirection::Read;
+        transaction.data = job.received;
+        transaction.length = job.length;
+        transaction.registerSize = job.registerSize;
+        transaction.reg = job.reg;
+        transaction.callback = finished;
+        transaction.context = &job;
+        if (!bus.submit(transaction)) {
+            job.countdown = 1;
+        }
+    }
+
+    // Ready polls: unlink the finished ones and repeat the reads whose interval elapsed
+    TWIReadyPoll *volatile *link = &readyPolls;
+    while (*link != nullptr) {
+        TWIReadyPoll &poll = **link;
+        if (poll.result != TWIResult::Pending) {
+            *link = poll.next;
+            continue;
+        }
+        link = &poll.next;
+        if ((poll.countdown != 0) && (--poll.countdown == 0)) {
+            submitRead(poll);
+        }
+    }
+}
+
+/*!
+ * Services the bus once per tick, so a hung read times out and a lost arbitration is restarted although the main loop
+ * never polls a transaction. On the TWI a bus recovery takes about 100 us of the call.
+ */
+void TWIScheduler::service()
+{
+    if (serviceDue) {
+        serviceDue = false;
+        bus.service();
+    }
+}
+
+/*!
+ * Starts polling the status register of a device. The first status read is queued right away, further ones every
+ * poll.interval ticks until the masked status matches. The read of the data registers is queued from the interrupt
+ * that read the matching status, so it follows on the bus without a tick in between. The poll ends with a single
+ * call of poll.callback. The poll has to stay valid until then.
+ * @param poll Poll owned by the application
+ * @return false if the poll is still running
+ */
+bool TWIScheduler::pollUntil(TWIReadyPoll &poll)
+{
+    TWIHardware::InterruptGuard guard;
+    if (poll.result == TWIResult::Pending) {
+        return false;
+    }
+    poll.result = TWIResult::Pending;
+    poll.tries = 0;
+    poll.ready = false;
+    poll.countdown = 0;
+    poll.bus = &bus;
+    // A finished poll may still be linked until the next tick
+    bool linked = false;
+    for (TWIReadyPoll *entry = readyPolls; entry != nullptr; entry = entry->next) {
+        linked |= (entry == &poll);
+    }
+    if (!linked) {
+        poll.next = readyPolls;
+        readyPolls = &poll;
+    }
+    submitRead(poll);
+    return true;
+}
+
+/*!
+ * Completion callback of the reads, called from the TWI interrupt. A successful read is published as the new snapshot,
+ * a failed one leaves the last snapshot in data.
+ * @param transaction Transaction of the job
+ */
+void TWIScheduler::finished(TWITransaction *transaction)
+{
+    auto *job = static_cast<TWIPollJob *>(transaction->context);
+    if (transaction->result == TWIResult::Success) {
+        // Readers see an odd sequence while data is written
+        job->sequence++;
+        for (uint8_t index = 0; index < job->length; index++) {
+            job->data[index] = job->received[index];
+        }
+        job->sequence++;
+    } else {
+        job->errors++;
+    }
+    job->lastResult = transaction->result;
+}
+
+/*!
+ * Queues the next read of a poll: the status register until it matched, the data registers afterwards. If the
+ * transaction queue is full the read is retried on the next tick.
+ * @param poll Running poll
+ */
+void TWIScheduler::submitRead(TWIReadyPoll &poll)
+{
+    TWITransaction &transaction = poll.transaction;
+    transaction = {};
+    transaction.address = poll.address;
+    transaction.direction = TWIDirection::Read;
+    transaction.registerSize = poll.registerSize;
+    if (poll.ready) {
+        transaction.reg = poll.dataReg;
+        transaction.data = poll.data;
+        transaction.length = poll.length;
+        transaction.callback = dataRead;
+    } else {
+        transaction.reg = poll.statusReg;
+        transaction.data = &poll.status;
+        transaction.length = 1;
+        transaction.callback = statusRead;
+    }
+    transaction.context = &poll;
+    if (!poll.bus->submit(transaction)) {
+        poll.countdown = 1;
+    }
+}
+
+/*!
+ * Completion callback of the status reads, called from the TWI interrupt. A matching status queues the data read,
+ * otherwise the status read is repeated after the interval.
+ * @param transaction Transaction of the poll
+ */
+void TWIScheduler::statusRead(TWITransaction *transaction)
+{
+    auto *poll = static_cast<TWIReadyPoll *>(transaction->context);
+    poll->tries++;
+    TWIResult result = transaction->result;
+    if ((result == TWIResult::Success) && ((poll->status & poll->mask) == poll->expected)) {
+        if (poll->length == 0) {
+            finishPoll(*poll, TWIResult::Success);
+        } else {
+            poll->ready = true;
+            submitRead(*poll);
+        }
+        return;
+    }
+    // Devices busy with a conversion may not acknowledge their address, that counts as not ready
+    if ((result != TWIResult::Success) && (result != TWIResult::AddressNack)) {
+        finishPoll(*poll, result);
+    } else if ((poll->maxTries != 0) && (poll->tries >= poll->maxTries)) {
+        finishPoll(*poll, TWIResult::Timeout);
+    } else if (poll->interval == 0) {
+        submitRead(*poll);
+    } else {
+        poll->countdown = poll->interval;
+    }
+}
+
+/*!
+ * Completion callback of the data read, called from the TWI interrupt
+ * @param transaction Transaction of the poll
+ */
+void TWIScheduler::dataRead(TWITransaction *transaction)
+{
+    finishPoll(*static_cast<TWIReadyPoll *>(transaction->context), transaction->result);
+}
+
+void TWIScheduler::finishPoll(TWIReadyPoll &poll, TWIResult result)
+{
+    poll.countdown = 0;
+    poll.result = result;
+    if (poll.callback != nullptr) {
+        poll.callback(&poll);
+    }
+}
+
+/*!
+ * Copies the data of the last read if it succeeded. The reads on the bus do not touch the snapshot, it only changes
+ * when a read finishes. The copy is checked against the sequence of the job, a copy torn by a read finishing in between
+ * is repeated.
+ * @param job Job of the table
+ * @param data Receives job.length bytes
+ * @param sequence Optional, receives the sequence of the snapshot to tell new data from data already seen
+ * @return false while the first read is outstanding or the last read failed
+ */
+bool TWIScheduler::read(const TWIPollJob &job, uint8_t *data, uint8_t *sequence) const
+{
+    for (;;) {
+        uint8_t before = job.sequence;
+        if ((before & 0x01) || (job.lastResult != TWIResult::Success)) {
+            return false;
+        }
+        // Volatile, so the copy stays between the two reads of the sequence
+        const volatile uint8_t *source = job.data;
+        for (uint8_t index = 0; index < job.length; index++) {
+            data[index] = source[index];
+        }
+        if (job.sequence == before) {
+            if (sequence != nullptr) {
+                *sequence = before;
+            }
+            return true;
+        }
+    }
+}
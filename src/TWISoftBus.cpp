@@ -0,0 +1,378 @@
+//
+// TWI master bit-banged on two port pins, clocked by a timer interrupt.
+//
+
+#include <TWISoftBus.h>
+
+/*!
+ * Releases both lines
+ * @param scl Port pin of SCL
+ * @param sda Port pin of SDA
+ */
+TWISoftBus::TWISoftBus(const TWIPin &scl, const TWIPin &sda)
+    : sclPin(scl),
+      sdaPin(sda),
+      queue{},
+      queueHead(0),
+      queueTail(0),
+      current(nullptr),
+      step(Step::Idle),
+      phase(Phase::Address),
+      reading(false),
+      shift(0),
+      bit(0),
+      cursor(nullptr),
+      flashCursor(0),
+      remaining(0),
+      registerRemaining(0),
+      waited(0),
+      stopResult(TWIResult::Idle)
+{
+    TWIHardware::initPin(sclPin);
+    TWIHardware::initPin(sdaPin);
+}
+
+/*!
+ * Queues a transaction, it is started by the next tick once the bus is free
+ * @param transaction Descriptor of the transaction, owned by the caller until it is finished
+ * @return false if the queue is full, the transaction is pending, or it has segments or a PEC
+ */
+bool TWISoftBus::submit(TWITransaction &transaction)
+{
+    if (!supports(transaction)) {
+        return false;
+    }
+    TWIHardware::InterruptGuard guard;
+    auto next = static_cast<uint8_t>((queueTail + 1) & (TWI_QUEUE_SIZE - 1));
+    if ((next == queueHead) || (transaction.result == TWIResult::Pending)) {
+        return false;
+    }
+    transaction.result = TWIResult::Pending;
+    transaction.retries = 0;
+    queue[queueTail] = &transaction;
+    queueTail = next;
+    return true;
+}
+
+/*!
+ * @return false for transactions with segments or an SMBus PEC, they need the TWI peripheral. false for reads of 0
+ * bytes as well: after the ACK of SLA+R the slave already drives the first data bit, which can keep the STOP off the bus
+ */
+bool TWISoftBus::supports(const TWITransaction &transaction) const
+{
+    if ((transaction.segments != nullptr) || (transaction.segmentCount > 0)) {
+        return false;
+    }
+    if ((transaction.direction == TWIDirection::Read) && (transaction.length == 0)) {
+        return false;
+    }
+#if TWI_PEC
+    if (transaction.pec || transaction.blockRead) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool TWISoftBus::poll(const TWITransaction &transaction)
+{
+    return transaction.result != TWIResult::Pending;
+}
+
+/*!
+ * Waits until a submitted transaction is finished, in the wait mode of TWI::setWaitMode() like the TWI. The timer
+ * interrupt does the transfer and wakes a sleeping CPU, a stuck bus is detected by tick() through TWI_SOFT_TIMEOUT
+ * @param transaction Descriptor of the transaction
+ * @return Result of the transaction
+ */
+TWIResult TWISoftBus::wait(const TWITransaction &transaction)
+{
+    while (!poll(transaction)) {
+        TWI::pause(transaction);
+    }
+    return transaction.result;
+}
+
+bool TWISoftBus::isIdle() const
+{
+    return (queueHead == queueTail) && (step == Step::Idle);
+}
+
+/*!
+ * Advances the bus by one step: SCL changes at most once per tick, SDA only changes while SCL is low except for the
+ * START and STOP conditions. A slave stretching the clock, or another master keeping the bus busy, holds the bus in
+ * its step until TWI_SOFT_TIMEOUT ticks have passed.
+ */
+void TWISoftBus::tick()
+{
+    switch (step) {
+        case Step::Idle:
+            if (current == nullptr) {
+                if (queueHead == queueTail) {
+                    return;
+                }
+                load(queue[queueHead]);
+            }
+            // START once the bus is free
+            if (!TWIHardware::readPin(sclPin) || !TWIHardware::readPin(sdaPin)) {
+                if (stretched()) {
+                    complete(TWIResult::Timeout);
+                }
+                return;
+            }
+            TWIHardware::pullPin(sdaPin);
+            step = Step::Started;
+            break;
+
+        case Step::Held:
+            if (queueHead == queueTail) {
+                return;
+            }
+            load(queue[queueHead]);
+            TWIHardware::releasePin(sclPin);
+            step = Step::RestartHigh;
+            break;
+
+        case Step::Started:
+            clockOut();
+            break;
+
+        case Step::ClockLow:
+            TWIHardware::releasePin(sclPin);
+            step = Step::ClockHigh;
+            break;
+
+        case Step::ClockHigh:
+            if (!TWIHardware::readPin(sclPin)) {
+                if (stretched()) {
+                    end(TWIResult::Timeout);
+                }
+                return;
+            }
+            sample();
+            break;
+
+        case Step::RestartLow:
+            TWIHardware::releasePin(sclPin);
+            step = Step::RestartHigh;
+            break;
+
+        case Step::RestartHigh:
+            if (!TWIHardware::readPin(sclPin)) {
+                if (stretched()) {
+                    end(TWIResult::Timeout);
+                }
+                return;
+            }
+            TWIHardware::pullPin(sdaPin);
+            step = Step::Started;
+            break;
+
+        case Step::StopLow:
+            TWIHardware::releasePin(sclPin);
+            step = Step::StopHigh;
+            break;
+
+        case Step::StopHigh:
+            if (!TWIHardware::readPin(sclPin)) {
+                if (!stretched()) {
+                    return;
+                }
+                // SCL is still held low, releasing SDA now is no STOP
+                stopResult = TWIResult::Timeout;
+            }
+            TWIHardware::releasePin(sdaPin);
+            step = Step::Idle;
+            complete(stopResult);
+            break;
+    }
+}
+
+/** Makes transaction the one on the bus, it starts with SLA+W unless it is a plain read **/
+void TWISoftBus::load(TWITransaction *transaction)
+{
+    current = transaction;
+    phase = Phase::Address;
+    reading = (transaction->direction == TWIDirection::Read) && (transaction->registerSize == TWIRegisterSize::None);
+    shift = static_cast<uint8_t>((transaction->address << 1) | (reading ? 1 : 0));
+    bit = 0;
+    cursor = transaction->data;
+    flashCursor = transaction->flashData;
+    remaining = transaction->length;
+    registerRemaining = static_cast<uint8_t>(transaction->registerSize);
+    waited = 0;
+}
+
+/** Pulls SCL and sets SDA for the current bit: a bit of shift, the ACK of a read, or released for the receiver **/
+void TWISoftBus::clockOut()
+{
+    TWIHardware::pullPin(sclPin);
+    bool high;
+    bool receiving = reading && (phase == Phase::Data);
+    if (bit < 8) {
+        high = receiving || (shift & (0x80 >> bit));
+    } else {
+        // ACK of a read while more bytes follow, NACK on the last one
+        high = !receiving || (remaining <= 1);
+    }
+    if (high) {
+        TWIHardware::releasePin(sdaPin);
+    } else {
+        TWIHardware::pullPin(sdaPin);
+    }
+    step = Step::ClockLow;
+}
+
+/** SCL is high: reads the bit, checks a released SDA for another master, and continues with the next bit **/
+void TWISoftBus::sample()
+{
+    waited = 0;
+    bool level = TWIHardware::readPin(sdaPin);
+    bool receiving = reading && (phase == Phase::Data);
+    if (bit < 8) {
+        if (receiving) {
+            shift = static_cast<uint8_t>((shift << 1) | (level ? 1 : 0));
+        } else if (level != ((shift & (0x80 >> bit)) != 0)) {
+            // SDA was released but another master pulls it: it owns the bus from here on
+            TWIHardware::releasePin(sdaPin);
+            step = Step::Idle;
+            complete(TWIResult::ArbitrationLost);
+            return;
+        }
+        bit++;
+        clockOut();
+        return;
+    }
+    bit = 0;
+    byteDone(!level);
+}
+
+/*!
+ * Continues after the ACK bit of a byte
+ * @param acknowledged The slave acknowledged the byte, meaningless for bytes read
+ */
+void TWISoftBus::byteDone(bool acknowledged)
+{
+    switch (phase) {
+        case Phase::Address:
+            if (!acknowledged) {
+                end(TWIResult::AddressNack);
+            } else if (registerRemaining > 0) {
+                phase = Phase::Register;
+                loadByte();
+                clockOut();
+            } else {
+                startData();
+            }
+            break;
+
+        case Phase::Register:
+            if (!acknowledged) {
+                end(TWIResult::DataNack);
+            } else if (registerRemaining > 0) {
+                loadByte();
+                clockOut();
+            } else if (current->direction == TWIDirection::Read) {
+                restart();
+            } else {
+                startData();
+            }
+            break;
+
+        case Phase::Data:
+            if (reading) {
+                *cursor++ = shift;
+                remaining--;
+            } else if (!acknowledged && (remaining > 0)) {
+                end(TWIResult::DataNack);
+                break;
+            }
+            if (remaining == 0) {
+                end(TWIResult::Success);
+            } else {
+                loadByte();
+                clockOut();
+            }
+            break;
+    }
+}
+
+void TWISoftBus::startData()
+{
+    phase = Phase::Data;
+    if (remaining == 0) {
+        end(TWIResult::Success);
+        return;
+    }
+    loadByte();
+    clockOut();
+}
+
+/** Loads shift with the next register address byte, high byte first, or the next data byte of a write **/
+void TWISoftBus::loadByte()
+{
+    if (phase == Phase::Register) {
+        shift = static_cast<uint8_t>((registerRemaining == 2) ? (current->reg >> 8) : current->reg);
+        registerRemaining--;
+    } else if (reading) {
+        shift = 0;
+    } else {
+        if (flashCursor != 0) {
+            shift = TWIHardware::readFlash(flashCursor++);
+        } else {
+            shift = *cursor++;
+        }
+        remaining--;
+    }
+}
+
+/** Repeated START and SLA+R after the register address of a read **/
+void TWISoftBus::restart()
+{
+    phase = Phase::Address;
+    reading = true;
+    shift = static_cast<uint8_t>((current->address << 1) | 1);
+    TWIHardware::pullPin(sclPin);
+    TWIHardware::releasePin(sdaPin);
+    step = Step::RestartLow;
+}
+
+/*!
+ * Ends the transaction on the bus with a STOP, or keeps the bus for a repeated START if the transaction asks for it
+ * @param result Result of the transaction
+ */
+void TWISoftBus::end(TWIResult result)
+{
+    TWIHardware::pullPin(sclPin);
+    if ((result == TWIResult::Success) && current->repeatedStart) {
+        TWIHardware::releasePin(sdaPin);
+        step = Step::Held;
+        complete(result);
+        return;
+    }
+    TWIHardware::pullPin(sdaPin);
+    stopResult = result;
+    step = Step::StopLow;
+}
+
+/** Counts a tick the bus did not follow, true once the timeout of the transaction has passed **/
+bool TWISoftBus::stretched()
+{
+    uint16_t timeout = (current->timeout != 0) ? current->timeout : TWI_SOFT_TIMEOUT;
+    return ++waited > timeout;
+}
+
+/*!
+ * Finishes the transaction at the head of the queue. The next one is started by the following tick
+ * @param result Result of the transaction
+ */
+void TWISoftBus::complete(TWIResult result)
+{
+    TWITransaction *done = current;
+    current = nullptr;
+    queueHead = static_cast<uint8_t>((queueHead + 1) & (TWI_QUEUE_SIZE - 1));
+    done->result = result;
+    if (done->callback != nullptr) {
+        done->callback(done);
+    }
+}
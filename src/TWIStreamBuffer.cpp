@@ -0,0 +1,82 @@
+//
+// Double buffer feeding the slave transmitter with a stream of any length.
+//
+
+#include <TWIStreamBuffer.h>
+
+TWIStreamBuffer::TWIStreamBuffer()
+    : underruns(0),
+      blocks{nullptr, nullptr},
+      size(0),
+      refill(nullptr),
+      lengths{0, 0},
+      active(0),
+      index(0),
+      acquired(0)
+{
+}
+
+void TWIStreamBuffer::attach(uint8_t *first, uint8_t *second, uint8_t blockSize, TWIStreamRefill refillBlock)
+{
+    blocks[0] = first;
+    blocks[1] = second;
+    size = blockSize;
+    refill = refillBlock;
+    active = 0;
+    index = 0;
+    underruns = 0;
+    lengths[0] = (refill != nullptr) ? refill(blocks[0], size) : 0;
+    lengths[1] = (refill != nullptr) ? refill(blocks[1], size) : 0;
+}
+
+/*!
+ * Returns the block that is sent after the queued ones: the active block if it is empty, the other block otherwise
+ * @return nullptr if both blocks are queued
+ */
+uint8_t *TWIStreamBuffer::acquire()
+{
+    uint8_t block = active;
+    if (lengths[block] != 0) {
+        block ^= 1;
+        if (lengths[block] != 0) {
+            return nullptr;
+        }
+    }
+    acquired = block;
+    return blocks[block];
+}
+
+void TWIStreamBuffer::publish(uint8_t length)
+{
+    if (length > size) {
+        length = size;
+    }
+    // Writing the length hands the block to the consumer
+    lengths[acquired] = length;
+}
+
+bool TWIStreamBuffer::next(uint8_t &data)
+{
+    uint8_t block = active;
+    if (lengths[block] == 0) {
+        // The active block is empty: continue with the other one, or ask the producer for more
+        block ^= 1;
+        if ((lengths[block] == 0) && (refill != nullptr)) {
+            lengths[block] = refill(blocks[block], size);
+        }
+        if (lengths[block] == 0) {
+            underruns++;
+            return false;
+        }
+        active = block;
+        index = 0;
+    }
+    data = blocks[block][index++];
+    if (index >= lengths[block]) {
+        // Block sent: hand it back, or refill it right away, and swap to the other one
+        index = 0;
+        lengths[block] = (refill != nullptr) ? refill(blocks[block], size) : 0;
+        active = block ^ 1;
+    }
+    return true;
+}
@@ -0,0 +1,249 @@
+//
+// Decoder of the TWI event trace.
+//
+
+#include <TWITrace.h>
+
+namespace {
+
+    /** Minimal line builder, avoids pulling printf into the firmware **/
+    class Line {
+    public:
+        Line() : length(0) { text[0] = '\0'; }
+
+        /** Appends a string in program memory, like the names of statusName() and stateName() **/
+        void appendFlash(const char *string)
+        {
+            auto address = static_cast<TWIFlashAddress>(reinterpret_cast<uintptr_t>(string));
+            for (char character; (character = static_cast<char>(TWIHardware::readFlash(address))) != '\0'; address++) {
+                appendChar(character);
+            }
+        }
+
+        void appendChar(char character)
+        {
+            if (length < sizeof(text) - 1) {
+                text[length++] = character;
+                text[length] = '\0';
+            }
+        }
+
+        void appendHex(uint8_t value)
+        {
+            appendChar('0');
+            appendChar('x');
+            appendDigit(static_cast<uint8_t>(value >> 4));
+            appendDigit(static_cast<uint8_t>(value & 0x0F));
+        }
+
+        void appendDecimal(uint64_t value)
+        {
+            char digits[20];
+            uint8_t count = 0;
+            do {
+                digits[count++] = static_cast<char>('0' + (value % 10));
+                value /= 10;
+            } while (value != 0);
+            while (count > 0) {
+                appendChar(digits[--count]);
+            }
+        }
+
+        void appendBinary(uint8_t value)
+        {
+            appendChar('b');
+            for (uint8_t bit = 8; bit > 0; bit--) {
+                appendChar((value & (1 << (bit - 1))) ? '1' : '0');
+            }
+        }
+
+        const char *c_str() const { return text; }
+
+    private:
+        void appendDigit(uint8_t digit)
+        {
+            appendChar(static_cast<char>((digit < 10) ? ('0' + digit) : ('A' + digit - 10)));
+        }
+
+        char text[64];
+        uint8_t length;
+    };
+}
+
+/** Names in program memory, a listing line is built in RAM one character at a time **/
+static const char statusBusError[] PROGMEM = "TWI_BUS_ERROR";
+static const char statusStart[] PROGMEM = "TWI_START";
+static const char statusRestart[] PROGMEM = "TWI_RESTART";
+static const char statusMtSlaAck[] PROGMEM = "TWI_MT_SLA_ACK";
+static const char statusMtSlaNack[] PROGMEM = "TWI_MT_SLA_NACK";
+static const char statusMtDataAck[] PROGMEM = "TWI_MT_DATA_ACK";
+static const char statusMtDataNack[] PROGMEM = "TWI_MT_DATA_NACK";
+static const char statusMArbLost[] PROGMEM = "TWI_M_ARB_LOST";
+static const char statusMrSlaAck[] PROGMEM = "TWI_MR_SLA_ACK";
+static const char statusMrSlaNack[] PROGMEM = "TWI_MR_SLA_NACK";
+static const char statusMrDataAck[] PROGMEM = "TWI_MR_DATA_ACK";
+static const char statusMrDataNack[] PROGMEM = "TWI_MR_DATA_NACK";
+static const char statusStSlaAck[] PROGMEM = "TWI_ST_SLA_ACK";
+static const char statusStSlaAckMArbLost[] PROGMEM = "TWI_ST_SLA_ACK_M_ARB_LOST";
+static const char statusStDataAck[] PROGMEM = "TWI_ST_DATA_ACK";
+static const char statusStDataNack[] PROGMEM = "TWI_ST_DATA_NACK";
+static const char statusStDataAckLastByte[] PROGMEM = "TWI_ST_DATA_ACK_LAST_BYTE";
+static const char statusSrSlaAck[] PROGMEM = "TWI_SR_SLA_ACK";
+static const char statusSrSlaAckMArbLost[] PROGMEM = "TWI_SR_SLA_ACK_M_ARB_LOST";
+static const char statusSrGenAck[] PROGMEM = "TWI_SR_GEN_ACK";
+static const char statusSrGenAckMArbLost[] PROGMEM = "TWI_SR_GEN_ACK_M_ARB_LOST";
+static const char statusSrSlaDataAck[] PROGMEM = "TWI_SR_SLA_DATA_ACK";
+static const char statusSrSlaDataNack[] PROGMEM = "TWI_SR_SLA_DATA_NACK";
+static const char statusSrGenDataAck[] PROGMEM = "TWI_SR_GEN_DATA_ACK";
+static const char statusSrGenDataNack[] PROGMEM = "TWI_SR_GEN_DATA_NACK";
+static const char statusSrStopRestart[] PROGMEM = "TWI_SR_STOP_RESTART";
+static const char statusNoInfo[] PROGMEM = "TWI_NO_INFO";
+static const char statusUnknown[] PROGMEM = "TWI_UNKNOWN";
+
+static const char stateAvailable[] PROGMEM = "Available";
+static const char stateInitializing[] PROGMEM = "Initializing";
+static const char stateRepeatedStartSent[] PROGMEM = "RepeatedStartSent";
+static const char stateMasterTransmitter[] PROGMEM = "MasterTransmitter";
+static const char stateMasterReceiver[] PROGMEM = "MasterReceiver";
+static const char stateSlaveTransmitter[] PROGMEM = "SlaveTransmitter";
+static const char stateSlaveReciever[] PROGMEM = "SlaveReciever";
+static const char stateUnknown[] PROGMEM = "Unknown";
+
+static const char vcdHeader[][26] PROGMEM = {
+    "$timescale 1 ns $end",
+    "$scope module twi $end",
+    "$var wire 8 s status $end",
+    "$var wire 8 t state $end",
+    "$var wire 8 d data $end",
+    "$upscope $end",
+    "$enddefinitions $end"
+};
+
+/*!
+ * @param status TWSR value, the prescaler bits are ignored
+ * @return Name of the status code in program memory, read it with TWIHardware::readFlash()
+ */
+const char *TWITrace::statusName(uint8_t status)
+{
+    switch (status & 0xF8) {
+        case TWI_BUS_ERROR:             return statusBusError;
+        case TWI_START:                 return statusStart;
+        case TWI_RESTART:               return statusRestart;
+        case TWI_MT_SLA_ACK:            return statusMtSlaAck;
+        case TWI_MT_SLA_NACK:           return statusMtSlaNack;
+        case TWI_MT_DATA_ACK:           return statusMtDataAck;
+        case TWI_MT_DATA_NACK:          return statusMtDataNack;
+        case TWI_M_ARB_LOST:            return statusMArbLost;
+        case TWI_MR_SLA_ACK:            return statusMrSlaAck;
+        case TWI_MR_SLA_NACK:           return statusMrSlaNack;
+        case TWI_MR_DATA_ACK:           return statusMrDataAck;
+        case TWI_MR_DATA_NACK:          return statusMrDataNack;
+        case TWI_ST_SLA_ACK:            return statusStSlaAck;
+        case TWI_ST_SLA_ACK_M_ARB_LOST: return statusStSlaAckMArbLost;
+        case TWI_ST_DATA_ACK:           return statusStDataAck;
+        case TWI_ST_DATA_NACK:          return statusStDataNack;
+        case TWI_ST_DATA_ACK_LAST_BYTE: return statusStDataAckLastByte;
+        case TWI_SR_SLA_ACK:            return statusSrSlaAck;
+        case TWI_SR_SLA_ACK_M_ARB_LOST: return statusSrSlaAckMArbLost;
+        case TWI_SR_GEN_ACK:            return statusSrGenAck;
+        case TWI_SR_GEN_ACK_M_ARB_LOST: return statusSrGenAckMArbLost;
+        case TWI_SR_SLA_DATA_ACK:       return statusSrSlaDataAck;
+        case TWI_SR_SLA_DATA_NACK:      return statusSrSlaDataNack;
+        case TWI_SR_GEN_DATA_ACK:       return statusSrGenDataAck;
+        case TWI_SR_GEN_DATA_NACK:      return statusSrGenDataNack;
+        case TWI_SR_STOP_RESTART:       return statusSrStopRestart;
+        case 0xF8:                      return statusNoInfo;
+        default:                        return statusUnknown;
+    }
+}
+
+/*!
+ * @param state TWIState
+ * @return Name of the state in program memory, read it with TWIHardware::readFlash()
+ */
+const char *TWITrace::stateName(uint8_t state)
+{
+    switch (state) {
+        case Available:         return stateAvailable;
+        case Initializing:      return stateInitializing;
+        case RepeatedStartSent: return stateRepeatedStartSent;
+        case MasterTransmitter: return stateMasterTransmitter;
+        case MasterReceiver:    return stateMasterReceiver;
+        case SlaveTransmitter:  return stateSlaveTransmitter;
+        case SlaveReciever:     return stateSlaveReciever;
+        default:                return stateUnknown;
+    }
+}
+
+/*!
+ * Writes a readable listing of the trace, one entry per line:
+ *   <time> <status> <status name> <state> <data>
+ * @param entries Entries returned by TWI::getTrace(), oldest first
+ * @param count Number of entries
+ * @param write Receives every line without line break
+ */
+void TWITrace::printListing(const TWITraceEntry *entries, uint8_t count, TWITraceWriter write)
+{
+    for (uint8_t index = 0; index < count; index++) {
+        const TWITraceEntry &entry = entries[index];
+        Line line;
+        line.appendDecimal(entry.time);
+        line.appendChar(' ');
+        line.appendHex(entry.status);
+        line.appendChar(' ');
+        line.appendFlash(statusName(entry.status));
+        line.appendChar(' ');
+        line.appendFlash(stateName(entry.state));
+        line.appendChar(' ');
+        line.appendHex(entry.data);
+        write(line.c_str());
+    }
+}
+
+/*!
+ * Writes the trace as value change dump with the signals status, state and data. The time starts at the first entry,
+ * the 16 bit timestamps are unwrapped assuming less than one timer period between two entries. It is counted in 64
+ * bits, a trace of a quiet bus easily spans more than the 4.29 s of 32 bit nanoseconds.
+ * @param entries Entries returned by TWI::getTrace(), oldest first
+ * @param count Number of entries
+ * @param tickNs Length of a TWI_TIMER tick in ns, 500 for Timer1 at F_CPU / 8 and 16 MHz
+ * @param write Receives every line without line break
+ */
+void TWITrace::printVCD(const TWITraceEntry *entries, uint8_t count, uint32_t tickNs, TWITraceWriter write)
+{
+    for (const char *header : vcdHeader) {
+        Line line;
+        line.appendFlash(header);
+        write(line.c_str());
+    }
+
+    uint64_t time = 0;
+    for (uint8_t index = 0; index < count; index++) {
+        const TWITraceEntry &entry = entries[index];
+        if (index > 0) {
+            time += static_cast<uint64_t>(static_cast<uint16_t>(entry.time - entries[index - 1].time)) * tickNs;
+        }
+        Line line;
+        line.appendChar('#');
+        line.appendDecimal(time);
+        write(line.c_str());
+
+        Line status;
+        status.appendBinary(entry.status);
+        status.appendChar(' ');
+        status.appendChar('s');
+        write(status.c_str());
+
+        Line state;
+        state.appendBinary(entry.state);
+        state.appendChar(' ');
+        state.appendChar('t');
+        write(state.c_str());
+
+        Line data;
+        data.appendBinary(entry.data);
+        data.appendChar(' ');
+        data.appendChar('d');
+        write(data.c_str());
+    }
+}
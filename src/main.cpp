@@ -4,12 +4,20 @@
 int main()
 {
     TWI twi;
+#if TWI_SLAVE
     twi.TWISetMode(TWIMode::Slave, 0x01);
+#else
+    twi.TWISetMode(TWIMode::Master);
+#endif
     sei();
 
     while(true) {
         _delay_ms(50);
+#if TWI_SLAVE
         twi.Read();
+#else
+        twi.Write(0x01, "ping");
+#endif
     }
     return 0;
-}
\ No newline at end of file
+}